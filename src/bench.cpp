@@ -0,0 +1,1466 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+/**
+ * lhbench - micro benchmarks for the hot spots of lhack.
+ *
+ *   lhbench pix fbdump [iterations]
+ *      Runs the underline check and the 4bpp->8bpp conversion over every
+ *      scanline of a frame buffer dump, with the scalar and with the
+ *      SIMD kernels.
+ *
+ *   lhbench match npaths [nqueries] [alpha]
+ *      Indexes a synthetic library of 'npaths' file names and looks up
+ *      OCR-like distorted titles with BestMatch() and with the reference
+ *      implementation it replaced, checking that both agree.
+ *
+ *   lhbench grab [iterations]
+ *      Renders synthetic frame buffers for the DX and the K3, with and
+ *      without a collection header, with the selection on every row (and
+ *      on none), and replays them through FrameGrabber, grabbing the
+ *      selected title and the whole page, and preparing the selected title
+ *      for the OCR. The selection's fingerprints (what lhackd's screen
+ *      watch polls) are timed and checked to differ. The K3 layout is also rendered at 8 and 16bpp.
+ *
+ *   lhbench glyphs [ntitles] [iterations]
+ *      Renders titles (and their authors) in a made-up font on DX and K3
+ *      home screens and reads them back with RecognizeGlyphs() and the
+ *      font's glyphs, as drawn and with some of their pixels flipped.
+ *
+ *   lhbench render [npaths] [ntitles]
+ *      Draws the names of a synthetic library with the made-up font's
+ *      glyphs (see RenderedTitles), and matches titles drawn on DX and K3
+ *      home screens against them: names of the library, as drawn and with
+ *      some of their pixels flipped, and titles which aren't in it.
+ *
+ *   lhbench tree dir [sizes] [nqueries] [alpha]
+ *      Creates libraries of empty files with book-like names under 'dir'
+ *      (1k, 10k, 100k and 1M files by default, reused by later runs) and
+ *      times the crawl, the index build and load, BestMatch() and the
+ *      whole pipeline except the OCR, separately.
+ *
+ * The grab, glyphs, render and tree modes report the median and the 99th percentile of
+ * each stage, and the peak RSS at its end.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <algorithm>
+#include <cmath>
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "devicedefs.h"
+#include "pixops.h"
+#include "framegrabber.h"
+#include "titleprep.h"
+#include "glyphs.h"
+#include "rendered.h"
+#include "filematch.h"
+#include "threads.h"
+#include "stats.h"
+
+namespace {
+
+using namespace std;
+using namespace lhack;
+
+typedef DeviceDimensions DIM;
+
+inline double
+NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+bool
+LoadFile(const char *file, vector<unsigned char>& out)
+{
+    ifstream in(file, ios::in | ios::binary);
+    if (!in)
+        return false;
+    in.seekg(0, ios::end);
+    out.resize(in.tellg());
+    in.seekg(0, ios::beg);
+    in.read(reinterpret_cast<char*>(&out[0]), out.size());
+    return !in.fail();
+}
+
+template <bool (*Check)(const unsigned*, int, unsigned)>
+double
+TimeCheck(const vector<unsigned char>& fb, int iters, unsigned *solid)
+{
+    int bytes_row = (DIM::kScreenWidth * DIM::kBPP) / 8;
+    int rows = fb.size() / bytes_row;
+    int check_start = ((DIM::kOffsetX + 2*sizeof(unsigned))*DIM::kBPP) / (8 * sizeof(unsigned));
+    int check_len = ((DIM::kEntryLen - 2*sizeof(unsigned))*DIM::kBPP) / (8 * sizeof(unsigned));
+
+    *solid = 0;
+    double start = NowNs();
+    for (int it = 0; it < iters; it++) {
+        for (int y = 0; y < rows; y++) {
+            const unsigned *line = reinterpret_cast<const unsigned*>(&fb[y * bytes_row]);
+            *solid += Check(line + check_start, check_len, DIM::kUlineColor);
+        }
+    }
+    return (NowNs() - start) / ((double) iters * rows);
+}
+
+template <void (*Unpack)(const unsigned char*, char*, int)>
+double
+TimeUnpack(const vector<unsigned char>& fb, int iters, vector<char>& out)
+{
+    int bytes_row = (DIM::kScreenWidth * DIM::kBPP) / 8;
+    int bytes_row_title = (DIM::kEntryLen * DIM::kBPP) / 8;
+    int off_x = (DIM::kOffsetX * DIM::kBPP) / 8;
+    int rows = fb.size() / bytes_row;
+
+    out.assign(2 * bytes_row_title * rows, 0);
+    double start = NowNs();
+    for (int it = 0; it < iters; it++) {
+        for (int y = 0; y < rows; y++)
+            Unpack(&fb[y * bytes_row + off_x], &out[2 * bytes_row_title * y], bytes_row_title);
+    }
+    return (NowNs() - start) / ((double) iters * rows);
+}
+
+int
+BenchPix(int argc, char **argv)
+{
+    if (argc < 1) {
+        cerr << "Syntax: lhbench pix fbdump [iterations]" << endl;
+        return 2;
+    }
+    int iters = (argc > 1)? atoi(argv[1]): 200;
+
+    vector<unsigned char> fb;
+    if (!LoadFile(argv[0], fb)
+            || fb.size() < (size_t) (DIM::kScreenWidth * DIM::kScreenHeight * DIM::kBPP) / 8) {
+        cerr << "Can't load a " << DIM::kScreenWidth << 'x' << DIM::kScreenHeight
+             << " frame buffer dump from " << argv[0] << endl;
+        return 2;
+    }
+
+#if defined(LHACK_SIMD_NEON)
+    const char *simd = "neon";
+#elif defined(LHACK_SIMD_SSE2)
+    const char *simd = "sse2";
+#else
+    const char *simd = "none";
+#endif
+
+    unsigned solid_sc, solid_simd;
+    double check_sc = TimeCheck<scalar::IsSolidLine>(fb, iters, &solid_sc);
+    double check_simd = TimeCheck<IsSolidLine>(fb, iters, &solid_simd);
+
+    vector<char> out_sc, out_simd;
+    double unpack_sc = TimeUnpack<scalar::Unpack4To8>(fb, iters, out_sc);
+    double unpack_simd = TimeUnpack<Unpack4To8>(fb, iters, out_simd);
+
+    if (solid_sc != solid_simd || out_sc != out_simd) {
+        cerr << "The SIMD kernels disagree with the scalar ones!" << endl;
+        return 1;
+    }
+
+    printf("simd: %s\n", simd);
+    printf("%-12s %12s %12s %8s\n", "kernel", "scalar ns/ln", "simd ns/ln", "speedup");
+    printf("%-12s %12.1f %12.1f %7.2fx\n", "uline-check", check_sc, check_simd, check_sc / check_simd);
+    printf("%-12s %12.1f %12.1f %7.2fx\n", "unpack-4to8", unpack_sc, unpack_simd, unpack_sc / unpack_simd);
+
+    return 0;
+}
+
+// A small deterministic PRNG, so that the runs are comparable
+class Rng
+{
+public:
+    explicit Rng(unsigned seed): state_(seed * 2654435761u + 1) {}
+
+    unsigned Next()
+    {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 17;
+        state_ ^= state_ << 5;
+        return state_;
+    }
+
+    unsigned Uniform(unsigned n) { return Next() % n; }
+
+private:
+    unsigned state_;
+};
+
+const char* const kWords[] = {
+    "The", "A", "of", "and", "in", "to", "Night", "House", "Secret", "War",
+    "Peace", "Love", "Time", "Dark", "Light", "Last", "First", "King", "Queen",
+    "Man", "Woman", "Girl", "Boy", "World", "City", "River", "Road", "Sea",
+    "Fire", "Ice", "Stone", "Shadow", "Dragon", "Garden", "Island", "Winter",
+    "Summer", "Death", "Life", "Blood", "Gold", "Silver", "Iron", "Glass",
+    "Star", "Moon", "Sun", "Book", "Story", "History", "Journey", "Return",
+    "Empire", "Kingdom", "Game", "Children", "Father", "Mother", "Brother",
+    "Sister", "Wolf", "Lion", "Crow", "Storm", "Wind", "Rain", "Snow",
+    "Mountain", "Forest", "Valley", "Ocean", "Ship", "Train", "Letters",
+    "Memoirs", "Principles", "Introduction", "Guide", "Handbook", "Art",
+    "Science", "Programming", "Algorithms", "Mathematics", "Physics", "Python",
+    "Practical", "Modern", "Complete", "Essential", "Advanced", "Lost",
+    "Hidden", "Silent", "Broken", "Golden", "Wild", "Great", "Little"
+};
+const char* const kNames[] = {
+    "Smith", "Johnson", "Tolstoy", "Austen", "Dickens", "Twain", "Orwell",
+    "Melville", "Bronte", "Hemingway", "Steinbeck", "Knuth", "Stroustrup",
+    "Sagan", "Asimov", "Herbert", "Tolkien", "Pratchett", "Gaiman", "Le Guin"
+};
+
+template <typename T, size_t N>
+inline size_t Count(T (&)[N]) { return N; }
+
+// A book-like title of 1-6 words, optionally followed by an author's name
+string
+SyntheticTitle(Rng& rng, bool with_author)
+{
+    string title;
+    unsigned nwords = 1 + rng.Uniform(3) + rng.Uniform(4);
+    for (unsigned w = 0; w < nwords; w++) {
+        if (w)
+            title.push_back(' ');
+        title.append(kWords[rng.Uniform(Count(kWords))]);
+    }
+    if (with_author) {
+        title.append(" - ");
+        title.append(kNames[rng.Uniform(Count(kNames))]);
+    }
+    return title;
+}
+
+// Imitates the typical OCR errors - substituted and dropped letters
+string
+Distort(Rng& rng, const string& title, unsigned percent)
+{
+    static const char kConfusions[] = "il1|oO0ecrnmhbdqg";
+    string out;
+    for (size_t i = 0; i < title.size(); i++) {
+        unsigned dice = rng.Uniform(100);
+        if (dice < percent / 3)
+            continue;
+        if (dice < percent)
+            out.push_back(kConfusions[rng.Uniform(sizeof(kConfusions) - 1)]);
+        else
+            out.push_back(title[i]);
+    }
+    return out;
+}
+
+template <typename T1, typename T2>
+struct CompareFirst {
+    inline bool operator()(const pair<T1, T2>& left, const pair<T1, T2>& right) const
+    {
+        return left.first < right.first;
+    }
+};
+
+template <typename T1, typename T2>
+struct CompareSecond {
+    inline bool operator()(const pair<T1, T2>& left, const pair<T1, T2>& right) const
+    {
+        return left.second < right.second;
+    }
+};
+
+void
+ReferenceQueryFeats(const string& query, vector<pair<ngramid_t, unsigned> >& out_feats)
+{
+    vector<ngramid_t> ngids;
+    for (NgramCursor ngram(query); !ngram.AtEnd(); ngram.Next())
+        ngids.push_back(ngram.id());
+    sort(ngids.begin(), ngids.end());
+    ngramid_t prev_id = ngids[0];
+    unsigned count = 0;
+    for (vector<ngramid_t>::iterator it=ngids.begin(); it != ngids.end(); it++) {
+        if (prev_id != *it) {
+            out_feats.push_back(make_pair(prev_id, count));
+            prev_id = *it;
+            count = 1;
+        }
+        else {
+            ++ count;
+        }
+    }
+    out_feats.push_back(make_pair(prev_id, count));
+}
+
+// Decompresses a whole posting list, as the reference implementation
+// needs random access to it
+void
+DecodePostings(const PostingList& list, vector<index_atom_t>& out)
+{
+    out.clear();
+    for (PostingCursor cur(list); !cur.AtEnd(); cur.Next())
+        out.push_back(make_pair(cur.pathid(), cur.count()));
+}
+
+/**
+ * The std::list based BestMatch() this tool compares against. It has the
+ * same feature-index and tie-breaking fixes, so both must agree exactly.
+ */
+int
+ReferenceBestMatch(const string& name, int tau, int minlen, const NgramIndex& ngindex)
+{
+    string query;
+    NormalizeName(name, query);
+    if (query.empty())
+        return -1;
+    typedef vector<pair<ngramid_t, unsigned> > feat_vec_t;
+    feat_vec_t feats; feats.reserve(query.size());
+    ReferenceQueryFeats(query, feats);
+
+    vector<pair<unsigned, unsigned> > freq2feat;
+    unsigned zeros = 0;
+    PostingList list;
+    vector<index_atom_t> decoded;
+    for (unsigned p = 0; p < feats.size(); p++) {
+        if (!ngindex.Lookup(feats[p].first, &list)) {
+            ++ zeros;
+            continue;
+        }
+        freq2feat.push_back(make_pair(p, list.count));
+    }
+    stable_sort(freq2feat.begin(), freq2feat.end(), CompareSecond<unsigned, unsigned>());
+
+    vector<index_atom_t> candidates;
+    size_t i = 0;
+    int f = 0;
+    int signature_len = query.size() - tau - zeros + 1;
+    if (signature_len < 1)
+        return -1;
+    while (f < signature_len && i < freq2feat.size()) {
+        const pair<ngramid_t, unsigned>& feat = feats[freq2feat[i].first];
+        ngindex.Lookup(feat.first, &list);
+        DecodePostings(list, decoded);
+        for (vector<index_atom_t>::iterator invit = decoded.begin(); invit != decoded.end(); invit++) {
+            if ((int) ngindex.fnlen(invit->first) < minlen)
+                continue;
+            candidates.push_back(make_pair(invit->first, min(invit->second, feat.second)));
+        }
+        f += feat.second;
+        ++ i;
+    }
+    if (candidates.empty())
+        return -1;
+
+    sort(candidates.begin(), candidates.end(), CompareFirst<pathid_t, unsigned>());
+    std::list<index_atom_t> candlist;
+    for (vector<index_atom_t>::iterator it = candidates.begin(); it != candidates.end(); it++) {
+        if (!candlist.empty() && candlist.back().first == it->first)
+            candlist.back().second += it->second;
+        else
+            candlist.push_back(*it);
+    }
+    unsigned best_count = 0;
+    pathid_t most_similar = 0;
+    for (std::list<index_atom_t>::iterator it = candlist.begin(); it != candlist.end(); it++) {
+        if (it->second > best_count) {
+            best_count = it->second;
+            most_similar = it->first;
+        }
+    }
+
+    int max_sim = query.size() - f - zeros;
+    for (size_t j = i; j < freq2feat.size(); j++) {
+        const pair<ngramid_t, unsigned>& feat = feats[freq2feat[j].first];
+        ngindex.Lookup(feat.first, &list);
+        DecodePostings(list, decoded);
+        const index_atom_t *postings = decoded.empty()? 0: &decoded[0];
+        unsigned npostings = decoded.size();
+        std::list<index_atom_t>::iterator ilist = candlist.begin();
+        while (ilist != candlist.end()) {
+            unsigned cand_maxsim = ilist->second + max_sim;
+            if (cand_maxsim < best_count || (int) cand_maxsim < tau) {
+                candlist.erase(ilist++);
+                if (candlist.empty())
+                    return -1;
+                continue;
+            }
+            const index_atom_t *lbit = lower_bound(postings, postings + npostings, *ilist,
+                                                   CompareFirst<pathid_t, unsigned>());
+            if (lbit != postings + npostings && lbit->first == ilist->first) {
+                ilist->second += min(lbit->second, feat.second);
+                if (ilist->second > best_count
+                        || (ilist->second == best_count && ilist->first < most_similar)) {
+                    best_count = ilist->second;
+                    most_similar = ilist->first;
+                }
+            }
+            ++ ilist;
+        }
+        max_sim -= feat.second;
+    }
+
+    return ((int) best_count >= tau)? (int) most_similar: -1;
+}
+
+// Fills 'out' with 'npaths' synthetic book file names
+void
+SyntheticLibrary(unsigned npaths, unsigned seed, IndexSource& out)
+{
+    Rng rng(seed);
+    static const char* const kExt[] = {".mobi", ".pdf", ".azw", ".txt"};
+    vector<string> paths(npaths);
+    for (unsigned i = 0; i < npaths; i++) {
+        paths[i] = "/mnt/us/documents/";
+        paths[i].append(SyntheticTitle(rng, rng.Uniform(2)));
+        paths[i].append(kExt[rng.Uniform(Count(kExt))]);
+    }
+    SortForIndex(paths);
+    out.fullpaths.reserve(npaths);
+    for (unsigned i = 0; i < npaths; i++)
+        AddPath(paths[i], out);
+}
+
+int
+BenchMatch(int argc, char **argv)
+{
+    if (argc < 1) {
+        cerr << "Syntax: lhbench match npaths [nqueries] [alpha]" << endl;
+        return 2;
+    }
+    unsigned npaths = atoi(argv[0]);
+    unsigned nqueries = (argc > 1)? atoi(argv[1]): 1000;
+    float alpha = (argc > 2)? atof(argv[2]): 0.5;
+
+    IndexSource src;
+    double start = NowNs();
+    SyntheticLibrary(npaths, 1, src);
+    NgramIndex index;
+    index.Build(src, "");
+    double build_ms = (NowNs() - start) / 1e6;
+
+    // The queries are distorted titles of random books in the library
+    Rng rng(2);
+    vector<string> queries(nqueries);
+    vector<int> taus(nqueries);
+    for (unsigned q = 0; q < nqueries; q++) {
+        unsigned id = rng.Uniform(npaths);
+        const string& path = src.fullpaths[id];
+        string title = path.substr(src.fnbase[id], path.rfind('.') - src.fnbase[id]);
+        queries[q] = Distort(rng, title.substr(0, title.find(" - ")), 8);
+        string normalized;
+        NormalizeName(queries[q], normalized);
+        taus[q] = max(1, (int) ceil(alpha * normalized.length() - 1e-6));
+    }
+
+    vector<int> ref(nqueries), res(nqueries);
+    start = NowNs();
+    for (unsigned q = 0; q < nqueries; q++)
+        ref[q] = ReferenceBestMatch(queries[q], taus[q], taus[q], index);
+    double ref_us = (NowNs() - start) / 1e3 / nqueries;
+
+    start = NowNs();
+    for (unsigned q = 0; q < nqueries; q++)
+        res[q] = BestMatch(queries[q], kSimOverlap, alpha, index);
+    double res_us = (NowNs() - start) / 1e3 / nqueries;
+
+    // The other measures search only the partitions within their length bounds
+    double measure_us[kNumSimMeasures];
+    unsigned measure_found[kNumSimMeasures];
+    double measure_cand[kNumSimMeasures];
+    for (int m = 0; m < kNumSimMeasures; m++) {
+        Stats stats;
+        measure_found[m] = 0;
+        measure_cand[m] = 0;
+        start = NowNs();
+        for (unsigned q = 0; q < nqueries; q++) {
+            measure_found[m] += (BestMatch(queries[q], (SimMeasure) m, alpha, index, &stats) != -1);
+            measure_cand[m] += stats.candidates;
+        }
+        measure_us[m] = (NowNs() - start) / 1e3 / nqueries;
+    }
+
+    unsigned mismatches = 0, found = 0;
+    for (unsigned q = 0; q < nqueries; q++) {
+        mismatches += (ref[q] != res[q]);
+        found += (res[q] != -1);
+    }
+
+    printf("paths: %u, n-grams indexed in %.1f ms, queries: %u (%u matched)\n",
+           npaths, build_ms, nqueries, found);
+    printf("index: %u n-grams, %u postings, %lu bytes (%.2f bytes/posting)\n",
+           index.nngrams(), index.npostings(), (unsigned long) index.size(),
+           (double) index.size() / index.npostings());
+    printf("%-12s %12s\n", "engine", "us/query");
+    printf("%-12s %12.1f  (includes decoding the lists)\n", "list", ref_us);
+    printf("%-12s %12.1f  (%.2fx)\n", "cpmerge", res_us, ref_us / res_us);
+    printf("%-12s %12s %12s %12s\n", "measure", "us/query", "candidates", "matched");
+    for (int m = 0; m < kNumSimMeasures; m++) {
+        printf("%-12s %12.1f %12.1f %12u\n", kSimMeasureNames[m], measure_us[m],
+               measure_cand[m] / nqueries, measure_found[m]);
+    }
+    if (mismatches) {
+        cerr << mismatches << " queries returned different results!" << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+// The samples of one stage, e.g. the latencies of all queries
+class Samples
+{
+public:
+    void Add(double value) { values_.push_back(value); }
+    size_t size() const { return values_.size(); }
+
+    // The nearest-rank percentile, 'p' in [0, 100]
+    double Percentile(double p) const
+    {
+        if (values_.empty())
+            return 0;
+        vector<double> sorted(values_);
+        sort(sorted.begin(), sorted.end());
+        size_t rank = (size_t) ceil(p / 100 * sorted.size());
+        return sorted[rank? rank - 1: 0];
+    }
+
+private:
+    vector<double> values_;
+};
+
+// Resets the peak RSS, where the kernel supports it (Linux 4.0 and later),
+// so that each stage reports its own peak. Otherwise the peaks accumulate.
+void
+ResetPeakRss()
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+void
+PrintStageHeader()
+{
+    printf("%-26s %8s %12s %12s %10s\n", "stage", "samples", "p50", "p99", "peak RSS");
+}
+
+void
+PrintStage(const string& name, const Samples& ns)
+{
+    double p50 = ns.Percentile(50), p99 = ns.Percentile(99);
+    const char *unit = "us";
+    double scale = 1e3;
+    if (p50 >= 1e6) {
+        unit = "ms";
+        scale = 1e6;
+    }
+    printf("%-26s %8lu %9.1f %2s %9.1f %2s %7.1f MB\n", name.c_str(), (unsigned long) ns.size(),
+           p50 / scale, unit, p99 / scale, unit, PeakRssKb() / 1024.0);
+    ResetPeakRss();
+}
+
+// The first scanline of a title with ink (see RenderFrame())
+const int kWordTop = 3;
+
+// The K3 layout on 8 and 16bpp frame buffers, for the unpackers of the
+// newer models
+struct K3Dimensions8: K3Dimensions {
+    static const int kBPP = 8;
+};
+
+struct K3Dimensions16: K3Dimensions {
+    static const int kBPP = 16;
+};
+
+// Sets pixel 'x' of scanline 'y' to the gray level 'level' (0-15, 15 is
+// the ink, whose words make kUlineColor at any depth)
+template <typename D>
+inline void
+PutPixel(vector<unsigned char>& fb, int x, int y, unsigned level)
+{
+    unsigned char *row = &fb[y * (D::kScreenWidth * D::kBPP) / 8];
+    if (D::kBPP == 4) {
+        unsigned char& px = row[x / 2];
+        px = (x & 1)? ((px & 0xf0) | level): ((px & 0x0f) | (level << 4));
+    }
+    else if (D::kBPP == 8) {
+        row[x] = level * 17;
+    }
+    else {
+        unsigned gray = level * 17;
+        uint16_t px = ((gray >> 3) << 11) | ((gray >> 2) << 5) | (gray >> 3);
+        memcpy(row + 2 * x, &px, sizeof(px));
+    }
+}
+
+// Sets the pixels [x0, x1) of scanline 'y' to 'level'
+template <typename D>
+void
+FillRow(vector<unsigned char>& fb, int y, int x0, int x1, unsigned level)
+{
+    for (int x = x0; x < x1; x++)
+        PutPixel<D>(fb, x, y, level);
+}
+
+// The scalar conversion the grabber's crops are checked against
+template <typename D>
+void
+ReferenceUnpack(const unsigned char *src, char *dst, int npixels)
+{
+    if (D::kBPP == 4)
+        scalar::Unpack4To8(src, dst, npixels / 2);
+    else
+        RowUnpacker<D::kBPP>::Unpack(src, dst, npixels);
+}
+
+// Draws a "word" of random ink levels in the columns [x0, x1) of the
+// title whose top is on scanline 'y'
+template <typename D>
+void
+RenderWord(vector<unsigned char>& fb, int y, int x0, int x1, Rng& rng)
+{
+    for (int k = kWordTop; k < D::kFontHeight; k++) {
+        for (int x = x0; x < x1; x++)
+            PutPixel<D>(fb, D::kOffsetX + x, y + k, 0x8 | (rng.Next() & 0x7));
+    }
+}
+
+/**
+ * Draws a Kindle home screen: the titles are "words" of random gray ink,
+ * with gaps of at most kMaxBBGap, followed by some metadata after a wider
+ * gap. Each has the dotted underline of an unselected entry, except for
+ * 'selected' (-1 for none), which gets the solid one. 'out_extents' (if
+ * given) gets the columns [x0, x1) of each title, without the metadata.
+ */
+template <typename D>
+void
+RenderFrame(bool collection, int selected, Rng& rng, vector<unsigned char>& fb,
+            vector<pair<int, int> > *out_extents = 0)
+{
+    int bytes_row = (D::kScreenWidth * D::kBPP) / 8;
+    fb.assign(bytes_row * D::kScreenHeight, 0);
+
+    // the collection's name is underlined all across the screen
+    if (collection)
+        FillRow<D>(fb, D::kOffsetUlineCol, 0, D::kScreenWidth, 0xf);
+
+    if (out_extents)
+        out_extents->clear();
+    int y = collection? D::kOffsetYCol: D::kOffsetY;
+    int entries = collection? D::kEntryPerPgCol: D::kEntryPerPg;
+    for (int e = 0; e < entries; e++) {
+        int x0 = rng.Uniform(8), x = x0, x1 = x0;
+        int len = D::kEntryLen / 4 + rng.Uniform(D::kEntryLen / 3);
+        while (x < len) {
+            x1 = x + 10 + rng.Uniform(50);
+            RenderWord<D>(fb, y, x, x1, rng);
+            x = x1 + 3 + rng.Uniform(D::kMaxBBGap - 3);
+        }
+        x = x1 + D::kMaxBBGap + 1 + rng.Uniform(30);
+        RenderWord<D>(fb, y, x, min(x + 80, (int) D::kEntryLen), rng);
+        if (out_extents)
+            out_extents->push_back(make_pair(x0, x1));
+
+        int uline = y + D::kFontHeight + D::kUlineBaseOffset + 1;
+        if (e == selected) {
+            FillRow<D>(fb, uline, D::kOffsetX, D::kOffsetX + D::kEntryLen + 16, 0xf);
+        }
+        else {
+            for (int x = D::kOffsetX; x + 4 <= D::kOffsetX + D::kEntryLen; x += 8)
+                FillRow<D>(fb, uline, x, x + 4, 0xf);
+        }
+
+        y += D::kFontHeight + D::kUlineBaseOffset + D::kEntryGap;
+    }
+}
+
+bool
+SaveFile(const string& file, const vector<unsigned char>& data)
+{
+    ofstream out(file.c_str(), ios::out | ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&data[0]), data.size());
+    return !out.fail();
+}
+
+// Checks the bitmap of the title in row 'row' against the frame it was cut from
+template <typename D>
+bool
+CheckTitle(const BitmapView& title, bool collection, int row, const vector<unsigned char>& fb)
+{
+    int bytes_row = (D::kScreenWidth * D::kBPP) / 8;
+    int y = (collection? D::kOffsetYCol: D::kOffsetY)
+          + row * (D::kFontHeight + D::kUlineBaseOffset + D::kEntryGap);
+    vector<char> expected(D::kEntryLen);
+    for (int k = 0; k < D::kFontHeight + D::kUlineMinOffset; k++) {
+        ReferenceUnpack<D>(&fb[(y + k) * bytes_row + (D::kOffsetX * D::kBPP) / 8],
+                           &expected[0], D::kEntryLen);
+        if (memcmp(&expected[0], title.row(k), expected.size()) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Checks what PrepareTitle() made of the title spanning the columns
+// 'extent' of the crop: the ink's box, with the margin, in black on white
+template <typename D>
+bool
+CheckPrepared(const Bitmap& prepared, pair<int, int> extent)
+{
+    BitmapView view = prepared.view();
+    int width = extent.second - extent.first;
+    int height = D::kFontHeight - kWordTop;
+    if (!view.IsValid() || view.width() != width + 2 * kTitlePadding
+            || view.height() != height + 2 * kTitlePadding)
+        return false;
+    for (int y = 0; y < view.height(); y++) {
+        for (int x = 0; x < view.width(); x++) {
+            bool margin = (x < kTitlePadding || x >= kTitlePadding + width
+                           || y < kTitlePadding || y >= kTitlePadding + height);
+            unsigned char px = view.row(y)[x];
+            if (px != 0 && px != 0xff)
+                return false;
+            if (margin && px != 0xff)
+                return false;
+        }
+    }
+    // the words begin and end with ink
+    return view.row(kTitlePadding)[kTitlePadding] == 0
+        && view.row(kTitlePadding)[kTitlePadding + width - 1] == 0;
+}
+
+// Checks the grabbed bitmap against the frame it was cut from
+template <typename D>
+bool
+CheckGrab(const BitmapView& title, bool collection, int selected, const vector<unsigned char>& fb)
+{
+    if (selected < 0)
+        return !title.IsValid();
+    if (!title.IsValid())
+        return false;
+    return CheckTitle<D>(title, collection, selected, fb);
+}
+
+// Checks the result of GrabAll() - every title on the page
+template <typename D>
+bool
+CheckGrabAll(const vector<BitmapView>& titles, int found, bool collection, int selected,
+             const vector<unsigned char>& fb)
+{
+    if (found != selected)
+        return false;
+    if (selected < 0)
+        return titles.empty();
+    if ((int) titles.size() != (collection? D::kEntryPerPgCol: D::kEntryPerPg))
+        return false;
+    for (size_t row = 0; row < titles.size(); row++) {
+        if (!CheckTitle<D>(titles[row], collection, row, fb))
+            return false;
+    }
+    return true;
+}
+
+// Replays the frames of one device and layout through FrameGrabber
+template <typename D>
+bool
+BenchGrabLayout(const char *device, bool collection, int iters, const string& fbfile)
+{
+    int entries = collection? D::kEntryPerPgCol: D::kEntryPerPg;
+    Rng rng(3);
+    Samples found, none, page, prep, fingerprint;
+    vector<unsigned char> fb;
+    vector<pair<int, int> > extents;
+    vector<uint64_t> fingerprints;
+    vector<BitmapView> titles;
+    Bitmap prepared;
+    for (int selected = -1; selected < entries; selected++) {
+        RenderFrame<D>(collection, selected, rng, fb, &extents);
+        if (!SaveFile(fbfile, fb))
+            return false;
+
+        FrameGrabber<D> grabber(fbfile.c_str());
+        for (int it = 0; it < iters; it++) {
+            double start = NowNs();
+            BitmapView title = grabber.GrabSelected();
+            double elapsed = NowNs() - start;
+            if (it == 0 && !CheckGrab<D>(title, collection, selected, fb)) {
+                cerr << device << ": wrong crop for row " << selected
+                     << (collection? " (collection)": "") << endl;
+                return false;
+            }
+            (selected < 0? none: found).Add(elapsed);
+        }
+        for (int it = 0; it < iters; it++) {
+            double start = NowNs();
+            int row = grabber.GrabAll(titles);
+            double elapsed = NowNs() - start;
+            if (it == 0 && !CheckGrabAll<D>(titles, row, collection, selected, fb)) {
+                cerr << device << ": wrong page crop for row " << selected
+                     << (collection? " (collection)": "") << endl;
+                return false;
+            }
+            if (selected >= 0)
+                page.Add(elapsed);
+        }
+        // a fingerprint per selection, 0 for none
+        for (int it = 0; it < iters; it++) {
+            double start = NowNs();
+            uint64_t print = grabber.Fingerprint();
+            fingerprint.Add(NowNs() - start);
+            if (it == 0 && ((selected < 0) != (print == 0)
+                            || find(fingerprints.begin(), fingerprints.end(), print)
+                               != fingerprints.end())) {
+                cerr << device << ": the fingerprint of row " << selected
+                     << (collection? " (collection)": "") << " isn't new" << endl;
+                return false;
+            }
+            if (it == 0)
+                fingerprints.push_back(print);
+        }
+        BitmapView title = grabber.GrabSelected();
+        for (int it = 0; selected >= 0 && it < iters; it++) {
+            double start = NowNs();
+            PrepareTitle<D>(title, prepared);
+            prep.Add(NowNs() - start);
+            if (it == 0 && !CheckPrepared<D>(prepared, extents[selected])) {
+                cerr << device << ": wrong preparation of row " << selected
+                     << (collection? " (collection)": "") << endl;
+                return false;
+            }
+        }
+    }
+
+    string name = string(device) + (collection? " collection": " home");
+    PrintStage(name + " selected", found);
+    PrintStage(name + " no selection", none);
+    PrintStage(name + " whole page", page);
+    PrintStage(name + " prepare", prep);
+    PrintStage(name + " fingerprint", fingerprint);
+    return true;
+}
+
+int
+BenchGrab(int argc, char **argv)
+{
+    int iters = (argc > 0)? atoi(argv[0]): 200;
+    char fbfile[64];
+    snprintf(fbfile, sizeof(fbfile), "/tmp/lhbench-fb%d.raw", (int) getpid());
+
+    // The frames are plain files, mapped like the device's frame buffer
+    // would be (a new mapping per frame, the probes and crops are timed)
+    PrintStageHeader();
+    bool ok = BenchGrabLayout<KDXDimensions>("dx", false, iters, fbfile)
+           && BenchGrabLayout<KDXDimensions>("dx", true, iters, fbfile)
+           && BenchGrabLayout<K3Dimensions>("k3", false, iters, fbfile)
+           && BenchGrabLayout<K3Dimensions>("k3", true, iters, fbfile)
+           && BenchGrabLayout<K3Dimensions8>("k3-8bpp", false, iters, fbfile)
+           && BenchGrabLayout<K3Dimensions16>("k3-16bpp", false, iters, fbfile);
+    unlink(fbfile);
+
+    return ok? 0: 1;
+}
+
+/**
+ * A made-up font for the glyphs mode: each printable ASCII character is
+ * a random glyph, 3 to 10 columns wide, in the rows the titles are drawn
+ * in (see RenderWord()). The letters are kLetterGap columns apart, the
+ * words kWordGap.
+ */
+template <typename D>
+class SyntheticFont
+{
+public:
+    static const int kLetterGap = 2;
+    static const int kWordGap = 7;
+
+    explicit SyntheticFont(Rng& rng)
+    {
+        inkcol_t rows = 0;
+        for (int k = kWordTop; k < D::kFontHeight; k++)
+            rows |= inkcol_t(1) << k;
+        for (int c = 0; c < 128; c++) {
+            memset(cells_[c], 0, sizeof(cells_[c]));
+            widths_[c] = 0;
+            if (c <= ' ' || c > '~')
+                continue;
+            widths_[c] = 3 + rng.Uniform(8);
+            for (int x = 0; x < widths_[c]; x++) {
+                int k = kWordTop + rng.Uniform(D::kFontHeight - kWordTop);
+                cells_[c][x] = (rng.Next() & rows) | (inkcol_t(1) << k);
+            }
+        }
+    }
+
+    // The columns 'text' takes
+    int Width(const string& text) const
+    {
+        int width = 0;
+        for (size_t i = 0; i < text.size(); i++)
+            width += Advance(text[i]);
+        return width - kLetterGap;
+    }
+
+    /**
+     * Draws 'text' into the title whose top is on scanline 'y', from
+     * column 'x', flipping each pixel with the probability 1/'noise'
+     * (0 - none)
+     */
+    void Draw(vector<unsigned char>& fb, int y, int x, const string& text,
+              Rng& rng, unsigned noise) const
+    {
+        for (size_t i = 0; i < text.size(); i++) {
+            int c = text[i] & 0x7f;
+            for (int col = 0; col < widths_[c]; col++) {
+                for (int k = kWordTop; k < D::kFontHeight; k++) {
+                    bool ink = (cells_[c][col] >> k) & 1;
+                    if (noise && rng.Uniform(noise) == 0)
+                        ink = !ink;
+                    PutPixel<D>(fb, D::kOffsetX + x + col, y + k, ink? 0xf: 0);
+                }
+            }
+            x += Advance(text[i]);
+        }
+    }
+
+    // The glyphs of the characters, as lhglyphs would collect them
+    void MakeGlyphs(GlyphSet& out) const
+    {
+        out = GlyphSet();
+        out.set_height(D::kFontHeight + D::kUlineMinOffset);
+        out.set_space((kLetterGap + kWordGap + 1) / 2);
+        out.set_gaps(kLetterGap, kLetterGap + kWordGap);
+        for (int c = 0; c < 128; c++) {
+            if (widths_[c])
+                out.Add(string(1, (char) c), cells_[c]);
+        }
+    }
+
+private:
+    int Advance(char c) const
+    {
+        return (c == ' ')? kWordGap: widths_[c & 0x7f] + kLetterGap;
+    }
+
+    inkcol_t cells_[128][kGlyphWidth];
+    int widths_[128];
+};
+
+// Reads titles drawn with a SyntheticFont back with its glyphs
+template <typename D>
+bool
+BenchGlyphsLayout(const char *device, unsigned ntitles, int iters, const string& fbfile)
+{
+    Rng rng(5);
+    SyntheticFont<D> font(rng);
+    GlyphSet glyphs;
+    font.MakeGlyphs(glyphs);
+
+    vector<unsigned char> fb;
+    string text;
+    for (int noisy = 0; noisy < 2; noisy++) {
+        Samples read;
+        unsigned right = 0, wrong = 0, left = 0;
+        for (unsigned t = 0; t < ntitles; t++) {
+            // as many words as fit, with the author after them
+            string title, author = kNames[rng.Uniform(Count(kNames))];
+            int room = D::kEntryLen - font.Width(author) - D::kMaxBBGap - 8;
+            for (int w = 0; w < 6; w++) {
+                string longer = title + (w? " ": "") + kWords[rng.Uniform(Count(kWords))];
+                if (font.Width(longer) > room)
+                    break;
+                title = longer;
+            }
+
+            RenderFrame<D>(false, 0, rng, fb);
+            int y = D::kOffsetY;
+            for (int k = 0; k < D::kFontHeight; k++)
+                FillRow<D>(fb, y + k, D::kOffsetX, D::kOffsetX + D::kEntryLen, 0);
+            font.Draw(fb, y, 0, title, rng, noisy? 40: 0);
+            font.Draw(fb, y, font.Width(title) + D::kMaxBBGap + 4, author, rng, 0);
+            if (!SaveFile(fbfile, fb))
+                return false;
+
+            FrameGrabber<D> grabber(fbfile.c_str());
+            BitmapView image = grabber.GrabSelected();
+            bool ok = false;
+            for (int it = 0; it < iters; it++) {
+                double start = NowNs();
+                ok = RecognizeGlyphs<D>(glyphs, image, &text);
+                read.Add(NowNs() - start);
+            }
+            if (!ok)
+                left++;
+            else if (text == title)
+                right++;
+            else
+                wrong++;
+        }
+
+        string name = string(device) + (noisy? " noisy": " clean");
+        PrintStage(name, read);
+        printf("    %u right, %u wrong, %u left to Tesseract (%u glyphs)\n",
+               right, wrong, left, (unsigned) glyphs.size());
+        if (!noisy && right != ntitles) {
+            cerr << device << ": the clean titles weren't all read right" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+BenchGlyphs(int argc, char **argv)
+{
+    unsigned ntitles = (argc > 0)? atoi(argv[0]): 200;
+    int iters = (argc > 1)? atoi(argv[1]): 20;
+    char fbfile[64];
+    snprintf(fbfile, sizeof(fbfile), "/tmp/lhbench-fb%d.raw", (int) getpid());
+
+    PrintStageHeader();
+    bool ok = BenchGlyphsLayout<KDXDimensions>("dx", ntitles, iters, fbfile)
+           && BenchGlyphsLayout<K3Dimensions>("k3", ntitles, iters, fbfile);
+    unlink(fbfile);
+
+    return ok? 0: 1;
+}
+
+// Matches titles drawn with a SyntheticFont against the names of a
+// synthetic library drawn with its glyphs
+template <typename D>
+bool
+BenchRenderLayout(const char *device, unsigned npaths, unsigned ntitles,
+                  const string& fbfile, const string& titlesfile)
+{
+    Rng rng(7);
+    SyntheticFont<D> font(rng);
+    GlyphSet glyphs;
+    font.MakeGlyphs(glyphs);
+
+    IndexSource src;
+    SyntheticLibrary(npaths, 11, src);
+    NgramIndex index;
+    index.Build(src, "");
+
+    // drawn and saved, then loaded back
+    Samples draw, load;
+    RenderedTitles rendered, loaded;
+    double start = NowNs();
+    rendered.Update(index, glyphs, titlesfile);
+    draw.Add(NowNs() - start);
+    start = NowNs();
+    loaded.Update(index, glyphs, titlesfile);
+    load.Add(NowNs() - start);
+    PrintStage(string(device) + " draw", draw);
+    PrintStage(string(device) + " load", load);
+    if (loaded.size() != rendered.size()) {
+        cerr << device << ": " << loaded.size() << " names loaded, " << rendered.size()
+             << " drawn" << endl;
+        return false;
+    }
+
+    static const char* const kPasses[] = {" clean", " noisy", " unknown"};
+    Rng unknown(12);
+    vector<unsigned char> fb;
+    bool ok = true;
+    for (int pass = 0; pass < 3; pass++) {
+        Samples match;
+        unsigned right = 0, wrong = 0, left = 0;
+        for (unsigned t = 0; t < ntitles; t++) {
+            string author = kNames[rng.Uniform(Count(kNames))];
+            int room = D::kEntryLen - font.Width(author) - D::kMaxBBGap - 8;
+            string text;
+            do {
+                text = (pass == 2)? SyntheticTitle(unknown, false)
+                                  : DisplayName(index.path(rng.Uniform(index.nfrozen())));
+            } while (font.Width(text) > room);
+
+            RenderFrame<D>(false, 0, rng, fb);
+            int y = D::kOffsetY;
+            for (int k = 0; k < D::kFontHeight; k++)
+                FillRow<D>(fb, y + k, D::kOffsetX, D::kOffsetX + D::kEntryLen, 0);
+            font.Draw(fb, y, 0, text, rng, (pass == 1)? 40: 0);
+            font.Draw(fb, y, font.Width(text) + D::kMaxBBGap + 4, author, rng, 0);
+            if (!SaveFile(fbfile, fb))
+                return false;
+
+            FrameGrabber<D> grabber(fbfile.c_str());
+            BitmapView image = grabber.GrabSelected();
+            start = NowNs();
+            TitleShape shape;
+            unsigned distance;
+            int id = -1;
+            if (GrabbedShape<D>(glyphs, image, &shape))
+                id = loaded.Match(shape, index, glyphs, &distance);
+            match.Add(NowNs() - start);
+
+            // a name drawn the same is as good as the one picked
+            if (id < 0)
+                left++;
+            else if (DisplayName(index.path(id)) == text)
+                right++;
+            else
+                wrong++;
+        }
+
+        PrintStage(string(device) + kPasses[pass], match);
+        printf("    %u right, %u wrong, %u left to the OCR (%u of %u names drawn)\n",
+               right, wrong, left, (unsigned) loaded.size(), index.nfrozen());
+        if (wrong) {
+            cerr << device << kPasses[pass] << ": titles taken for other files" << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int
+BenchRender(int argc, char **argv)
+{
+    unsigned npaths = (argc > 0)? atoi(argv[0]): 100000;
+    unsigned ntitles = (argc > 1)? atoi(argv[1]): 200;
+    char fbfile[64], titlesfile[64];
+    snprintf(fbfile, sizeof(fbfile), "/tmp/lhbench-fb%d.raw", (int) getpid());
+    snprintf(titlesfile, sizeof(titlesfile), "/tmp/lhbench-titles%d", (int) getpid());
+
+    // the SIMD distance has to agree with the scalar one
+    Rng rng(3);
+    uint8_t a[kSignatureBins + 7], b[kSignatureBins + 7];
+    for (int i = 0; i < kSignatureBins + 7; i++) {
+        a[i] = rng.Next();
+        b[i] = rng.Next();
+    }
+    if (SumAbsDiff(a, b, kSignatureBins + 7) != scalar::SumAbsDiff(a, b, kSignatureBins + 7)) {
+        cerr << "SumAbsDiff() differs from the scalar version" << endl;
+        return 1;
+    }
+
+    PrintStageHeader();
+    bool ok = BenchRenderLayout<KDXDimensions>("dx", npaths, ntitles, fbfile, titlesfile)
+           && BenchRenderLayout<K3Dimensions>("k3", npaths, ntitles, fbfile, titlesfile);
+    unlink(fbfile);
+    unlink(titlesfile);
+
+    return ok? 0: 1;
+}
+
+/**
+ * Picks the words of the tree mode's titles. A few thousand made-up words
+ * follow the real ones, and the ranks are drawn from a Zipf distribution,
+ * so that (like in real titles) a few words are very common and most
+ * are rare.
+ */
+class Vocabulary
+{
+public:
+    explicit Vocabulary(unsigned nwords)
+    {
+        static const char* const kSyllables[] = {
+            "ka", "ri", "to", "men", "sa", "lo", "ver", "an", "del", "mi", "ron",
+            "ta", "bel", "or", "is", "gar", "nu", "el", "po", "shi", "dan", "ex"
+        };
+        Rng rng(4);
+        for (size_t i = 0; i < Count(kWords); i++)
+            words_.push_back(kWords[i]);
+        while (words_.size() < nwords) {
+            string word;
+            unsigned nsyl = 2 + rng.Uniform(3);
+            for (unsigned k = 0; k < nsyl; k++)
+                word.append(kSyllables[rng.Uniform(Count(kSyllables))]);
+            word[0] = toupper(word[0]);
+            words_.push_back(word);
+        }
+
+        double sum = 0;
+        for (unsigned r = 1; r <= nwords; r++) {
+            sum += 1 / pow((double) r, 1.07);
+            cdf_.push_back(sum);
+        }
+        for (unsigned r = 0; r < nwords; r++)
+            cdf_[r] /= sum;
+    }
+
+    const string& Pick(Rng& rng) const
+    {
+        double u = (rng.Next() & 0xffffff) / (double) 0x1000000;
+        size_t r = lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+        return words_[min(r, words_.size() - 1)];
+    }
+
+private:
+    vector<string> words_;
+    vector<double> cdf_;
+};
+
+// A relative path in a Kindle-like library: most books are right in
+// "documents", the rest are in author (and sometimes series) folders.
+// Some are personal documents named after their ASIN.
+string
+SyntheticBookPath(Rng& rng, const Vocabulary& vocab, unsigned id)
+{
+    static const char* const kExt[] = {".mobi", ".azw", ".pdf", ".txt", ".prc"};
+
+    string author = kNames[rng.Uniform(Count(kNames))];
+    if (rng.Uniform(2))
+        author = vocab.Pick(rng) + " " + author;
+
+    string path;
+    unsigned layout = rng.Uniform(10);
+    if (layout >= 6)
+        path = author + "/";
+    if (layout == 9)
+        path += vocab.Pick(rng) + " Series/";
+
+    unsigned nwords = 1 + rng.Uniform(3) + rng.Uniform(5);
+    for (unsigned w = 0; w < nwords; w++) {
+        if (w)
+            path.push_back(' ');
+        path.append(vocab.Pick(rng));
+    }
+    if (rng.Uniform(3) == 0) {
+        char asin[32];
+        snprintf(asin, sizeof(asin), "-asin_B%09u_EBOK", id);
+        path.append(asin);
+    }
+    else {
+        path.append(" - ");
+        path.append(author);
+    }
+    path.append(kExt[rng.Uniform(Count(kExt))]);
+
+    return path;
+}
+
+/**
+ * Creates a library of 'npaths' empty files under 'dir', unless an earlier
+ * run did. The names are generated again anyway (they are deterministic),
+ * and returned in 'out_paths'.
+ */
+bool
+MakeTree(const string& dir, unsigned npaths, vector<string>& out_paths)
+{
+    Vocabulary vocab(4000);
+    Rng rng(5);
+    out_paths.resize(npaths);
+    for (unsigned i = 0; i < npaths; i++)
+        out_paths[i] = dir + "/" + SyntheticBookPath(rng, vocab, i);
+
+    string stamp = dir + "/.lhbench-complete";
+    struct stat st;
+    if (stat(stamp.c_str(), &st) == 0)
+        return true;
+
+    mkdir(dir.c_str(), 0755);
+    for (unsigned i = 0; i < npaths; i++) {
+        const string& path = out_paths[i];
+        for (size_t slash = path.find('/', dir.size() + 1); slash != string::npos;
+                slash = path.find('/', slash + 1))
+            mkdir(path.substr(0, slash).c_str(), 0755);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "Can't create " << path << endl;
+            return false;
+        }
+        close(fd);
+    }
+
+    int fd = open(stamp.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0)
+        close(fd);
+    return true;
+}
+
+void
+BenchTreeSize(const string& basedir, unsigned npaths, unsigned nqueries, float alpha)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/lib%u", npaths);
+    string root = basedir + name;
+
+    double start = NowNs();
+    vector<string> paths;
+    if (!MakeTree(root, npaths, paths))
+        return;
+    printf("\n%u files under %s (set up in %.1f s)\n", npaths, root.c_str(),
+           (NowNs() - start) / 1e9);
+    PrintStageHeader();
+    ResetPeakRss();
+
+    static const char* const kFilters[] = {"*.mobi", "*.azw", "*.pdf", "*.txt", "*.prc"};
+    vector<string> filters(kFilters, kFilters + Count(kFilters));
+    string key = IndexKey(root, filters);
+    string idxfile = KeyedIndexFile(root + ".idx", key);
+    unsigned repeats = (npaths >= 1000000)? 3: (npaths >= 100000)? 5: 11;
+
+    // Crawling and indexing, with one and with all CPUs (the file system
+    // metadata is cached after the first run)
+    unsigned ncpus = OnlineCpus();
+    vector<unsigned> nthreads_list(1, 1);
+    if (ncpus > 1)
+        nthreads_list.push_back(ncpus);
+    for (size_t t = 0; t < nthreads_list.size(); t++) {
+        unsigned nthreads = nthreads_list[t];
+        Samples crawl;
+        for (unsigned r = 0; r < repeats; r++) {
+            IndexSource src;
+            src.key = key;
+            start = NowNs();
+            IndexFiles(root, filters, src, nthreads);
+            crawl.Add(NowNs() - start);
+        }
+        char stage[32];
+        snprintf(stage, sizeof(stage), "IndexFiles (%u thr)", nthreads);
+        PrintStage(stage, crawl);
+    }
+
+    IndexSource src;
+    src.key = key;
+    IndexFiles(root, filters, src, ncpus);
+
+    Samples build;
+    for (unsigned r = 0; r < repeats; r++) {
+        NgramIndex index;
+        start = NowNs();
+        index.Build(src, idxfile);
+        build.Add(NowNs() - start);
+    }
+    PrintStage("Build + save", build);
+
+    Samples load;
+    for (unsigned r = 0; r < repeats; r++) {
+        NgramIndex index;
+        start = NowNs();
+        if (index.Open(idxfile, key))
+            index.IsFresh();
+        load.Add(NowNs() - start);
+    }
+    PrintStage("Open + IsFresh", load);
+
+    // The queries are distorted titles of random books
+    Rng rng(6);
+    vector<string> queries(nqueries);
+    for (unsigned q = 0; q < nqueries; q++) {
+        const string& path = paths[rng.Uniform(npaths)];
+        string title = path.substr(path.rfind('/') + 1);
+        title = title.substr(0, min(title.find(" - "), title.find("-asin_")));
+        queries[q] = Distort(rng, title, 8);
+    }
+
+    NgramIndex index;
+    index.Open(idxfile, key);
+    Samples match;
+    unsigned found = 0;
+    for (unsigned q = 0; q < nqueries; q++) {
+        start = NowNs();
+        int id = BestMatch(queries[q], kSimOverlap, alpha, index);
+        match.Add(NowNs() - start);
+        found += (id >= 0);
+    }
+    PrintStage("BestMatch", match);
+    index.Close();
+
+    // What one lhack run does, except the OCR: grab the selection, load
+    // the saved index, check it and search it
+    char fbfile[64];
+    snprintf(fbfile, sizeof(fbfile), "/tmp/lhbench-fb%d.raw", (int) getpid());
+    vector<unsigned char> fb;
+    RenderFrame<DIM>(false, 3, rng, fb);
+    SaveFile(fbfile, fb);
+    SearchOptions opts;
+    opts.index_file = root + ".idx";     // keyed by the Library, as idxfile
+    Samples pipeline;
+    unsigned runs = min(nqueries, 200u);
+    for (unsigned q = 0; q < runs; q++) {
+        start = NowNs();
+        FrameGrabber<DIM> grabber(fbfile);
+        grabber.GrabSelected();
+        Library library(root, filters, opts);
+        library.Search(queries[q], kSimOverlap, alpha);
+        pipeline.Add(NowNs() - start);
+    }
+    unlink(fbfile);
+    PrintStage("pipeline w/o OCR", pipeline);
+
+    struct stat st;
+    stat(idxfile.c_str(), &st);
+    printf("%u of %u queries matched, %u distinct paths, index file: %.1f MB\n",
+           found, nqueries, (unsigned) src.fullpaths.size(), st.st_size / 1048576.0);
+}
+
+int
+BenchTree(int argc, char **argv)
+{
+    if (argc < 1) {
+        cerr << "Syntax: lhbench tree dir [sizes] [nqueries] [alpha]" << endl;
+        return 2;
+    }
+    string dir = argv[0];
+    string sizes = (argc > 1)? argv[1]: "1000,10000,100000,1000000";
+    unsigned nqueries = (argc > 2)? atoi(argv[2]): 1000;
+    float alpha = (argc > 3)? atof(argv[3]): 0.5;
+
+    mkdir(dir.c_str(), 0755);
+    for (size_t pos = 0; pos < sizes.size(); ) {
+        size_t comma = sizes.find(',', pos);
+        if (comma == string::npos)
+            comma = sizes.size();
+        unsigned npaths = atoi(sizes.substr(pos, comma - pos).c_str());
+        if (npaths)
+            BenchTreeSize(dir, npaths, nqueries, alpha);
+        pos = comma + 1;
+    }
+
+    return 0;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        cerr << "Syntax: lhbench pix fbdump [iterations]\n"
+                "       lhbench match npaths [nqueries] [alpha]\n"
+                "       lhbench grab [iterations]\n"
+                "       lhbench glyphs [ntitles] [iterations]\n"
+                "       lhbench render [npaths] [ntitles]\n"
+                "       lhbench tree dir [sizes] [nqueries] [alpha]" << endl;
+        return 2;
+    }
+
+    string mode = argv[1];
+    if (mode == "pix")
+        return BenchPix(argc - 2, argv + 2);
+    if (mode == "match")
+        return BenchMatch(argc - 2, argv + 2);
+    if (mode == "grab")
+        return BenchGrab(argc - 2, argv + 2);
+    if (mode == "glyphs")
+        return BenchGlyphs(argc - 2, argv + 2);
+    if (mode == "render")
+        return BenchRender(argc - 2, argv + 2);
+    if (mode == "tree")
+        return BenchTree(argc - 2, argv + 2);
+
+    cerr << "Unknown benchmark: " << mode << endl;
+    return 2;
+}
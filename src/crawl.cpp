@@ -0,0 +1,220 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <deque>
+#include <cstring>
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "crawl.h"
+#include "threads.h"
+
+namespace lhack {
+
+using namespace std;
+
+bool
+MatchesFilters(const char *name, const vector<string>& filters)
+{
+    for (size_t i = 0; i < filters.size(); i++) {
+        if (fnmatch(filters[i].c_str(), name, FNM_CASEFOLD) == 0)
+            return true;
+    }
+    return false;
+}
+
+namespace {
+
+struct CrawlQueue {
+    Mutex lock;
+    deque<string> dirs;
+};
+
+// The state shared by the crawler threads
+struct CrawlState {
+    CrawlState(unsigned nqueues): queues(nqueues), pending(0), queued(0)
+    {
+        for (unsigned i = 0; i < nqueues; i++)
+            queues[i] = new CrawlQueue;
+    }
+
+    ~CrawlState()
+    {
+        for (unsigned i = 0; i < queues.size(); i++)
+            delete queues[i];
+    }
+
+    const vector<string> *filters;
+    vector<CrawlQueue*> queues;
+
+    Mutex lock;         // guards the counters below
+    CondVar work;       // signalled when a directory is queued or the crawl is over
+    unsigned pending;   // directories queued or being scanned
+    unsigned queued;    // directories waiting in the queues
+};
+
+class CrawlWorker
+{
+public:
+    CrawlWorker(): state_(0), id_(0), shard_(0) {}
+    CrawlWorker(CrawlState *state, unsigned id, CrawlShard *shard):
+        state_(state), id_(id), shard_(shard) {}
+
+    void Run();
+
+private:
+    bool Pop(string& dir);
+    void Push(const string& dir);
+    void Scan(const string& dir);
+
+    CrawlState *state_;
+    unsigned id_;
+    CrawlShard *shard_;
+};
+
+bool
+CrawlWorker::Pop(string& dir)
+{
+    // the own queue is used as a stack (depth-first, good locality),
+    // while the others are robbed from the opposite end
+    unsigned nqueues = state_->queues.size();
+    for (unsigned k = 0; k < nqueues; k++) {
+        CrawlQueue *q = state_->queues[(id_ + k) % nqueues];
+        ScopedLock l(q->lock);
+        if (q->dirs.empty())
+            continue;
+        if (k == 0) {
+            dir = q->dirs.back();
+            q->dirs.pop_back();
+        }
+        else {
+            dir = q->dirs.front();
+            q->dirs.pop_front();
+        }
+        ScopedLock lc(state_->lock);
+        -- state_->queued;
+        return true;
+    }
+    return false;
+}
+
+void
+CrawlWorker::Push(const string& dir)
+{
+    CrawlQueue *q = state_->queues[id_];
+    {
+        ScopedLock l(q->lock);
+        q->dirs.push_back(dir);
+    }
+    ScopedLock lc(state_->lock);
+    ++ state_->pending;
+    ++ state_->queued;
+    state_->work.Signal();
+}
+
+void
+CrawlWorker::Scan(const string& dir)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return;
+
+    struct stat st;
+    if (fstat(dirfd(d), &st) == 0) {
+        DirStamp stamp;
+        stamp.path = dir;
+        stamp.mtime_sec = st.st_mtim.tv_sec;
+        stamp.mtime_nsec = st.st_mtim.tv_nsec;
+        shard_->dirs.push_back(stamp);
+    }
+
+    string prefix(dir);
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/')
+        prefix.push_back('/');
+
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            if (lstat((prefix + name).c_str(), &st) < 0)
+                continue;
+            type = S_ISDIR(st.st_mode)? DT_DIR: DT_REG;
+        }
+
+        if (type == DT_DIR)
+            Push(prefix + name);
+        else if (type == DT_REG || type == DT_LNK) {
+            ++ shard_->nvisited;
+            if (MatchesFilters(name, *state_->filters))
+                shard_->paths.push_back(prefix + name);
+        }
+    }
+
+    closedir(d);
+}
+
+void
+CrawlWorker::Run()
+{
+    string dir;
+    for (;;) {
+        if (!Pop(dir)) {
+            ScopedLock l(state_->lock);
+            while (state_->pending && !state_->queued)
+                state_->work.Wait(state_->lock);
+            if (!state_->pending)
+                return;
+            continue;
+        }
+
+        Scan(dir);
+
+        ScopedLock l(state_->lock);
+        if (!-- state_->pending)
+            state_->work.Broadcast();
+    }
+}
+
+} // anonymous namespace
+
+void
+ParallelCrawl(const string& root, const vector<string>& filters,
+              unsigned nthreads, vector<CrawlShard>& out_shards)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+
+    CrawlState state(nthreads);
+    state.filters = &filters;
+    out_shards.assign(nthreads, CrawlShard());
+
+    vector<CrawlWorker> workers;
+    for (unsigned i = 0; i < nthreads; i++)
+        workers.push_back(CrawlWorker(&state, i, &out_shards[i]));
+
+    state.queues[0]->dirs.push_back(root);
+    state.pending = state.queued = 1;
+
+    RunAll(workers);
+}
+
+}; // namespace lhack
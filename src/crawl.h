@@ -0,0 +1,53 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef CRAWL_H
+#define CRAWL_H
+
+#include <vector>
+#include <string>
+
+#include "ngindex.h"
+
+namespace lhack {
+
+using namespace std;
+
+// What one crawler thread found
+struct CrawlShard {
+    CrawlShard(): nvisited(0) {}
+
+    vector<string> paths;   // the files matching the filters
+    dirstamps_t dirs;
+    unsigned nvisited;      // all the files seen
+};
+
+// Checks a file name against a list of globs (case-insensitive)
+bool MatchesFilters(const char *name, const vector<string>& filters);
+
+/**
+ * Walks the tree under 'root' with 'nthreads' threads. Each thread takes
+ * directories from its own queue and queues the subdirectories it finds
+ * there; a thread which runs out of work steals from the other queues.
+ * 'out_shards' gets one entry per thread. The order of the paths depends
+ * on the scheduling.
+ */
+void ParallelCrawl(const string& root, const vector<string>& filters,
+                   unsigned nthreads, vector<CrawlShard>& out_shards);
+
+};
+
+#endif // CRAWL_H
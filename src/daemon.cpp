@@ -0,0 +1,166 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <cstring>
+#include <cerrno>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+namespace lhack {
+
+using namespace std;
+
+namespace {
+
+bool
+FillAddress(const char *sockpath, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr->sun_path))
+        return false;
+    strcpy(addr->sun_path, sockpath);
+    return true;
+}
+
+bool
+WriteAll(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool
+ReadAll(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+int
+ListenDaemon(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    if (!FillAddress(sockpath, &addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    unlink(sockpath);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+            || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int
+ConnectDaemon(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    if (!FillAddress(sockpath, &addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+size_t
+MessageSize(const message_t& fields)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < fields.size(); i++)
+        size += fields[i].size() + 1;
+    return size;
+}
+
+bool
+SendMessage(int fd, const message_t& fields)
+{
+    string payload;
+    for (size_t i = 0; i < fields.size(); i++) {
+        payload.append(fields[i]);
+        payload.push_back('\0');
+    }
+    if (payload.size() > kMaxMessageSize)
+        return false;
+
+    uint32_t len = payload.size();
+    return WriteAll(fd, reinterpret_cast<const char*>(&len), sizeof(len))
+            && WriteAll(fd, payload.data(), payload.size());
+}
+
+bool
+RecvMessage(int fd, message_t& out_fields)
+{
+    uint32_t len;
+    if (!ReadAll(fd, reinterpret_cast<char*>(&len), sizeof(len))
+            || len > kMaxMessageSize)
+        return false;
+
+    string payload(len, '\0');
+    if (len && !ReadAll(fd, &payload[0], len))
+        return false;
+
+    out_fields.clear();
+    size_t start = 0;
+    while (start < payload.size()) {
+        size_t end = payload.find('\0', start);
+        if (end == string::npos)
+            return false;
+        out_fields.push_back(payload.substr(start, end - start));
+        start = end + 1;
+    }
+
+    return true;
+}
+
+}; // namespace lhack
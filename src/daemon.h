@@ -0,0 +1,67 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <string>
+#include <vector>
+
+namespace lhack {
+
+using namespace std;
+
+/**
+ * The protocol spoken between lhack and lhackd over a Unix domain socket.
+ * Each message is a 32-bit length (host byte order) followed by that many
+ * bytes of '\0'-terminated fields. A connection carries one request and
+ * one reply.
+ *
+ * Request: "resolve", rootdir, comma-sep-filters, similarity-coeff, rebuild("0"/"1"),
+ *          [stats("0"/"1"), [number of results, [similarity measure]]]
+ * Reply:   exit status, matched path, OCR result, [statistics as JSON or "",
+ *          [path, overlap, similarity]...]
+ *
+ * The results are only sent if more than one was requested (and only
+ * those that fit, see kMaxResults). The measure
+ * is one of kSimMeasureNames ("overlap" if it is missing).
+ */
+typedef vector<string> message_t;
+
+static const char kCmdResolve[] = "resolve";
+
+// Messages above this size are rejected
+static const unsigned kMaxMessageSize = 64 * 1024;
+
+// The most results a request may ask for. The reply carries only as many
+// of them as fit in kMaxMessageSize, from the best.
+static const unsigned kMaxResults = 100;
+
+// Creates the listening socket, replacing a stale one. Returns -1 on error.
+int ListenDaemon(const char *sockpath);
+
+// Connects to a running daemon. Returns -1 if there is none.
+int ConnectDaemon(const char *sockpath);
+
+// The size of the message's payload, as sent
+size_t MessageSize(const message_t& fields);
+
+bool SendMessage(int fd, const message_t& fields);
+bool RecvMessage(int fd, message_t& out_fields);
+
+};
+
+#endif // DAEMON_H
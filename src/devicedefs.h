@@ -131,5 +131,29 @@ struct K3Dimensions {
     static const int kMaxBBGap = 40;
 };
 
+// A list of device types (see KnownDevices)
+struct NoDevice {};
+
+template <typename DIM, typename Next = NoDevice>
+struct DeviceList {
+    typedef DIM Head;
+    typedef Next Tail;
+};
+
+// The devices a binary supports. The one whose screen width, height and
+// kBPP are those the frame buffer reports is used (see NewResolver()), so
+// a new model only needs its struct above and an entry here. The frame
+// buffer depths supported are those of RowUnpacker (pixops.h).
+typedef DeviceList<KDXDimensions,
+        DeviceList<K3Dimensions> > KnownDevices;
+
+// The device assumed when the geometry can't be read, e.g. from a frame
+// buffer dump on a development host
+#if defined(LHACK_K3)
+typedef K3Dimensions DeviceDimensions;
+#else
+typedef KDXDimensions DeviceDimensions;
+#endif
+
 };
 #endif // DEVICEDEFS_H
@@ -19,50 +19,42 @@
 #include <utility>
 #include <functional>
 #include <algorithm>
-#include <tr1/unordered_map>
-#include <list>
 #include <cmath>
+#include <climits>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 
+#include <sys/stat.h>
 #include <fts.h>
-#include <fnmatch.h>
+
+#include "ngindex.h"
+#include "ngrams.h"
+#include "crawl.h"
+#include "threads.h"
+#include "filematch.h"
+#include "rendered.h"
 
 namespace lhack {
 
 using namespace std;
 
-typedef unsigned int ngramid_t;
+typedef vector<pair<ngramid_t, unsigned> > qfeat_t; // query features
 
-class Identity : public unary_function<ngramid_t, ngramid_t>
+void
+PrintNgram(ngramid_t id)
 {
-public:
-    inline ngramid_t operator()(ngramid_t value) const {
-        return value;
+    for (unsigned i = 0; i < NgramCursor::kSize; i++) {
+        char c = NgramCursor::Byte(id, i);
+        cout << (i? ",": "") << (c? c: '_');
     }
-};
-
-typedef unsigned int pathid_t;
-
-// <pathid, count_of_ngram_occurences_in_path(pathid)>
-typedef pair<pathid_t, unsigned> index_atom_t;
-
-// array recording all paths where the ngram was encountered
-typedef vector<index_atom_t> ngram_invert_t;
-
-typedef tr1::unordered_map<ngramid_t, ngram_invert_t, Identity> index_t;
-typedef vector<string> fullpaths_t;
-typedef vector<pair<ngramid_t, unsigned> > qfeat_t; // query features
+}
 
 void
 PrintFeatures(const qfeat_t& feats)
 {
     for (qfeat_t::const_iterator it = feats.begin(); it != feats.end(); it++) {
-        ngramid_t id = it->first;
-        char* idbytes = reinterpret_cast<char*>(&id);
-        cout << (idbytes[0]? idbytes[0]: '_') << ",";
-        cout << (idbytes[1]? idbytes[1]: '_') << ",";
-        cout << (idbytes[2]? idbytes[2]: '_');
+        PrintNgram(it->first);
         cout << ": " << it->second << endl;
     }
 }
@@ -74,10 +66,7 @@ PrintIndex(index_t& index)
     for (index_t::iterator it = index.begin(); it != index.end(); it++) {
         cout << "ID: ";
         ngramid_t id = it->first;
-        char* idbytes = reinterpret_cast<char*>(&id);
-        cout << (idbytes[0]? idbytes[0]: '_') << ",";
-        cout << (idbytes[1]? idbytes[1]: '_') << ",";
-        cout << (idbytes[2]? idbytes[2]: '_');
+        PrintNgram(id);
         cout << "<" << id << "> [";
         ngram_invert_t& invidx = it->second;
         for (ngram_invert_t::iterator it2 = invidx.begin(); it2 != invidx.end(); it2++) {
@@ -119,85 +108,327 @@ FindBasename(const string& path, int *fnbase, int *fnlen)
 }
 
 /**
- * Uses letter (or rather byte) tri-grams
- * @todo NOTE: THE CODE DEPENDS ON CPU ENDIANESS (assumes LE - check on ARM)
+ * Indexes the n-grams of a normalized file name (see ngrams.h)
  */
 inline void
-MakeIndex(const string& path, unsigned pathid,
-          int fnbase, int fnlen, index_t& ngindex)
+MakeIndex(const string& name, unsigned pathid, index_t& ngindex)
+{
+    for (NgramCursor ngram(name); !ngram.AtEnd(); ngram.Next()) {
+        // Most n-grams are rare, so the lists are left to grow on demand.
+        // They are compressed anyway when the index is frozen.
+        ngram_invert_t& invidx = ngindex[ngram.id()];
+        if (!invidx.empty() && invidx.back().first == pathid)  // 2 or more instances of that n-gram in this path?
+            ++ invidx.back().second;
+        else
+            invidx.push_back(make_pair(pathid, 1));
+    }
+}
+
+bool
+AddPath(const string& path, IndexSource& out)
 {
-    unsigned int ngram = 0;
-    char* const ngbytes = reinterpret_cast<char*>(&ngram);
+    int fnbase, fnlen;
+    if (!FindBasename(path, &fnbase, &fnlen))
+        return false;
 
-    for (int i = fnbase; i < (fnbase + fnlen); i++) {
-        ngbytes[3] = path[i];
-        ngram >>= 8;
+    string name;
+    NormalizeName(path.data() + fnbase, path.data() + fnbase + fnlen, name);
+    out.fullpaths.push_back(path);
+    out.fnbase.push_back(fnbase);
+    out.fnlen.push_back(name.size());
+    MakeIndex(name, out.first_pathid + out.fullpaths.size() - 1, out.index);
 
-        index_t::iterator it = ngindex.find(ngram);
-        if (it == ngindex.end()) { // is this the first time n-gram of this type is inserted?
-            ngram_invert_t invidx;
-            invidx.reserve(20);
-            invidx.push_back(make_pair(pathid, 1));
-            ngindex.insert(make_pair(ngram, invidx));
+    return true;
+}
+
+namespace {
+
+// Orders the positions of paths by the length of the file name, then by path
+class IndexOrderLess
+{
+public:
+    IndexOrderLess(const vector<string>& paths, const vector<unsigned>& fnlen):
+        paths_(paths), fnlen_(fnlen) {}
+
+    inline bool operator()(unsigned left, unsigned right) const
+    {
+        if (fnlen_[left] != fnlen_[right])
+            return fnlen_[left] < fnlen_[right];
+        return ComparePaths(paths_[left].c_str(), paths_[right].c_str()) < 0;
+    }
+
+private:
+    const vector<string>& paths_;
+    const vector<unsigned>& fnlen_;
+};
+
+} // anonymous namespace
+
+void
+SortForIndex(vector<string>& paths)
+{
+    vector<unsigned> fnlen(paths.size(), 0);
+    vector<unsigned> order(paths.size());
+    string name;
+    for (size_t i = 0; i < paths.size(); i++) {
+        int fnbase, len;
+        if (FindBasename(paths[i], &fnbase, &len)) {
+            const char *base = paths[i].data() + fnbase;
+            NormalizeName(base, base + len, name);
+            fnlen[i] = name.size();
         }
-        else {
-            ngram_invert_t& invidx = it->second;
-            if (invidx.back().first == pathid)  // 2 or more instances of that 3-gram in this path?
-                ++ invidx.back().second;
-            else
-                invidx.push_back(make_pair(pathid, 1));
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), IndexOrderLess(paths, fnlen));
+
+    vector<string> sorted(paths.size());
+    for (size_t i = 0; i < order.size(); i++)
+        sorted[i].swap(paths[order[i]]);
+    paths.swap(sorted);
+}
+
+namespace {
+
+struct DirStampLess {
+    inline bool operator()(const DirStamp& left, const DirStamp& right) const
+    {
+        return ComparePaths(left.path.c_str(), right.path.c_str()) < 0;
+    }
+};
+
+int
+CompareEntries(const FTSENT **left, const FTSENT **right)
+{
+    return strcmp((*left)->fts_name, (*right)->fts_name);
+}
+
+// Indexes a range of the crawled paths, numbering them from
+// 'first_pathid' on
+class ShardIndexer
+{
+public:
+    ShardIndexer(): first_(0), last_(0), out_(0) {}
+    ShardIndexer(const string *first, const string *last, IndexSource *out):
+        first_(first), last_(last), out_(out) {}
+
+    void Run()
+    {
+        for (const string *it = first_; it != last_; it++)
+            AddPath(*it, *out_);
+    }
+
+private:
+    const string *first_, *last_;
+    IndexSource *out_;
+};
+
+/**
+ * The multi-threaded IndexFiles(). The tree is crawled in parallel and
+ * the paths are put in the same order a single-threaded walk would
+ * give them, so that the pathids (and the tie-breaking in BestMatch())
+ * don't depend on the scheduling. Then each thread indexes a contiguous
+ * range of pathids. The partial indices are concatenated in the order
+ * of the ranges, which keeps every posting list sorted by pathid.
+ */
+void
+IndexFilesParallel(const string& root, const vector<string>& filters,
+                   IndexSource& out, unsigned nthreads)
+{
+    vector<CrawlShard> shards;
+    ParallelCrawl(root, filters, nthreads, shards);
+
+    vector<string> paths;
+    for (size_t w = 0; w < shards.size(); w++) {
+        paths.insert(paths.end(), shards[w].paths.begin(), shards[w].paths.end());
+        vector<string>().swap(shards[w].paths);
+        out.dirs.insert(out.dirs.end(), shards[w].dirs.begin(), shards[w].dirs.end());
+        out.nvisited += shards[w].nvisited;
+    }
+    SortForIndex(paths);
+    sort(out.dirs.begin(), out.dirs.end(), DirStampLess());
+
+    size_t nparts = min<size_t>(nthreads, paths.size());
+    vector<IndexSource> partial(nparts);
+    vector<ShardIndexer> indexers;
+    for (size_t w = 0; w < nparts; w++) {
+        size_t first = paths.size() * w / nparts;
+        size_t last = paths.size() * (w + 1) / nparts;
+        partial[w].first_pathid = first;
+        partial[w].fullpaths.reserve(last - first);
+        indexers.push_back(ShardIndexer(&paths[0] + first, &paths[0] + last, &partial[w]));
+    }
+    RunAll(indexers);
+
+    for (size_t w = 0; w < partial.size(); w++) {
+        // pathids of paths with no basename have been skipped by AddPath()
+        // so the ranges must be closed up
+        IndexSource& part = partial[w];
+        pathid_t shift = part.first_pathid - out.fullpaths.size();
+        out.fullpaths.insert(out.fullpaths.end(), part.fullpaths.begin(), part.fullpaths.end());
+        out.fnbase.insert(out.fnbase.end(), part.fnbase.begin(), part.fnbase.end());
+        out.fnlen.insert(out.fnlen.end(), part.fnlen.begin(), part.fnlen.end());
+        for (index_t::iterator it = part.index.begin(); it != part.index.end(); it++) {
+            ngram_invert_t& invidx = out.index[it->first];
+            size_t start = invidx.size();
+            invidx.insert(invidx.end(), it->second.begin(), it->second.end());
+            if (shift) {
+                for (size_t k = start; k < invidx.size(); k++)
+                    invidx[k].first -= shift;
+            }
         }
+        index_t().swap(part.index); // free it as soon as possible
     }
 }
 
-// Returns a list of the full paths to all files under "root"
-// 'filters' is an array of globs, used to select a subset of the files
-// 'minlen' is the minimum file name length(w/o the extension)
+} // anonymous namespace
+
+// Collects the full paths to all files under "root" and indexes their names.
+// 'filters' is an array of globs, used to select a subset of the files.
+// The mtimes of the directories are recorded as well, so that the index
+// can later be checked for staleness without re-crawling.
 void
 IndexFiles(const string& root, const vector<string>& filters,
-           fullpaths_t& out_fpaths, index_t& out_index,
-           int minlen, int maxlen)
+           IndexSource& out, unsigned nthreads)
 {
+    if (nthreads > 1) {
+        IndexFilesParallel(root, filters, out, nthreads);
+        return;
+    }
+
     char* const roots[] = {(char*) root.c_str(), 0};
-    FTS *tree = fts_open(roots, FTS_NOCHDIR, 0);
+    FTS *tree = fts_open(roots, FTS_NOCHDIR, CompareEntries);
+    if (!tree)
+        return;
 
+    vector<string> paths;
     FTSENT *node;
     while ((node = fts_read(tree))) {
-        if (node->fts_info & FTS_F) {
-            int i = 0;
-            for (; i < filters.size(); i++) {
-                if (fnmatch(filters[i].c_str(), node->fts_name, FNM_CASEFOLD) == 0)
-                    break;
-            }
-            if (i == filters.size())
-                continue;
+        if (node->fts_info == FTS_D) {
+            DirStamp stamp;
+            stamp.path = node->fts_path;
+            stamp.mtime_sec = node->fts_statp->st_mtim.tv_sec;
+            stamp.mtime_nsec = node->fts_statp->st_mtim.tv_nsec;
+            out.dirs.push_back(stamp);
+        }
+        else if (node->fts_info & FTS_F) {
+            ++ out.nvisited;
+            if (MatchesFilters(node->fts_name, filters))
+                paths.push_back(node->fts_path);
+        }
+    }
 
-            string path(node->fts_path);
-            int fnbase, fnlen;
-            if (!FindBasename(path, &fnbase, &fnlen))
-                continue;
+    fts_close(tree);
 
-            if (fnlen < minlen)
-                continue;
-            fnlen = min(fnlen, maxlen);
-            out_fpaths.push_back(path);
-            MakeIndex(path, out_fpaths.size() - 1, fnbase, fnlen, out_index);
+    SortForIndex(paths);
+    for (size_t i = 0; i < paths.size(); i++)
+        AddPath(paths[i], out);
+}
+
+bool
+ParseSimMeasure(const string& name, SimMeasure *out_measure)
+{
+    for (int m = 0; m < kNumSimMeasures; m++) {
+        if (name == kSimMeasureNames[m]) {
+            *out_measure = (SimMeasure) m;
+            return true;
         }
     }
+    return false;
+}
 
-    fts_close(tree);
+namespace {
+
+// Rounding that doesn't trip over the float error of e.g. 0.7 * 10
+inline unsigned
+CeilBound(double x)
+{
+    return (x <= 0)? 0: (unsigned) ceil(x - 1e-6);
+}
+
+inline unsigned
+FloorBound(double x)
+{
+    return (x >= UINT_MAX)? UINT_MAX: (unsigned) floor(x + 1e-6);
+}
+
+} // anonymous namespace
+
+SimBounds::SimBounds(SimMeasure measure, float alpha, unsigned qlen):
+    measure_(measure), alpha_(alpha), qlen_(qlen), minlen_(1), maxlen_(UINT_MAX)
+{
+    double a = alpha_, q = qlen;
+    switch (measure_) {
+    case kSimOverlap:
+        // the name must be long enough to contain the shared n-grams
+        minlen_ = Tau(0);
+        break;
+    case kSimCosine:
+        minlen_ = CeilBound(a * a * q);
+        if (a > 0)
+            maxlen_ = FloorBound(q / (a * a));
+        break;
+    case kSimDice:
+        minlen_ = CeilBound(a / (2 - a) * q);
+        if (a > 0)
+            maxlen_ = FloorBound((2 - a) / a * q);
+        break;
+    case kSimJaccard:
+    default:
+        minlen_ = CeilBound(a * q);
+        if (a > 0)
+            maxlen_ = FloorBound(q / a);
+        break;
+    }
+    minlen_ = max(minlen_, 1u);
+}
+
+unsigned
+SimBounds::Tau(unsigned len) const
+{
+    double a = alpha_, q = qlen_;
+    unsigned tau;
+    switch (measure_) {
+    case kSimOverlap:
+        tau = CeilBound(a * q);
+        break;
+    case kSimCosine:
+        tau = CeilBound(a * sqrt(q * len));
+        break;
+    case kSimDice:
+        tau = CeilBound(a * (q + len) / 2);
+        break;
+    case kSimJaccard:
+    default:
+        tau = CeilBound(a * (q + len) / (1 + a));
+        break;
+    }
+    // a match has to share something with the query
+    return max(tau, 1u);
 }
 
+float
+SimBounds::Similarity(unsigned overlap, unsigned len) const
+{
+    switch (measure_) {
+    case kSimOverlap:
+        return (float) overlap / qlen_;
+    case kSimCosine:
+        return (float) (overlap / sqrt((double) qlen_ * len));
+    case kSimDice:
+        return (float) (2.0 * overlap / (qlen_ + len));
+    case kSimJaccard:
+    default:
+        return (float) overlap / (qlen_ + len - overlap);
+    }
+}
+
+// Counts the distinct n-grams of a normalized query
 void QueryFeats(const string& query, vector<pair<ngramid_t, unsigned> >& out_feats)
 {
     vector<ngramid_t> ngids;
-    ngramid_t ngramid = 0;
-    char *ngbytes = reinterpret_cast<char*>(&ngramid);
-    for(string::const_iterator it = query.begin(); it != query.end(); it++) {
-        ngbytes[3] = *it;
-        ngramid >>= 8;
-        ngids.push_back(ngramid);
-    }
+    ngids.reserve(query.size());
+    for (NgramCursor ngram(query); !ngram.AtEnd(); ngram.Next())
+        ngids.push_back(ngram.id());
     sort(ngids.begin(), ngids.end());
     ngramid_t prev_id = ngids[0];
     unsigned count = 0;
@@ -214,167 +445,728 @@ void QueryFeats(const string& query, vector<pair<ngramid_t, unsigned> >& out_fea
     out_feats.push_back(make_pair(prev_id, count));
 }
 
-template <typename T1, typename T2>
-class CompareFirst : public binary_function<pair<T1, T2>, pair<T1, T2>, bool >
+// The n-grams two normalized names share, counted as in BestMatches()
+unsigned SharedNgrams(const string& left, const string& right)
 {
-public:
-    inline bool operator()(const pair<T1, T2>& left, const pair<T1, T2>& right)
+    if (left.empty() || right.empty())
+        return 0;
+    vector<pair<ngramid_t, unsigned> > lfeats, rfeats;
+    QueryFeats(left, lfeats);
+    QueryFeats(right, rfeats);
+    unsigned shared = 0;
+    size_t l = 0, r = 0;
+    while (l < lfeats.size() && r < rfeats.size()) {
+        if (lfeats[l].first < rfeats[r].first) {
+            ++ l;
+        }
+        else if (rfeats[r].first < lfeats[l].first) {
+            ++ r;
+        }
+        else {
+            shared += min(lfeats[l].second, rfeats[r].second);
+            ++ l;
+            ++ r;
+        }
+    }
+    return shared;
+}
+
+// A query feature found in the index
+struct QueryFeature {
+    ngramid_t ngram;
+    unsigned count;                 // occurrences in the query
+    PostingList postings;
+    PostingList added;              // postings added since the index was frozen
+
+    unsigned df() const { return postings.count + added.count; }
+};
+
+struct RarerFeature {
+    inline bool operator()(const QueryFeature& left, const QueryFeature& right) const
     {
-        return left.first < right.first;
+        return left.df() < right.df();
     }
 };
 
-template <typename T1, typename T2>
-class CompareSecond : public binary_function<pair<T1, T2>, pair<T1, T2>, bool >
+// A file name sharing some n-grams with the query
+struct Candidate {
+    pathid_t pathid;
+    unsigned overlap;
+    unsigned len;           // its n-gram count
+    unsigned tau;           // the overlap it needs to be alpha-similar
+};
+
+// Where the file names within the length bounds of a query are
+struct Window {
+    Window(const SimBounds& bounds, const NgramIndex& ngindex):
+        minlen(bounds.MinLen()), maxlen(bounds.MaxLen()),
+        check_frozen(!ngindex.IsPartitioned()), nfrozen(ngindex.nfrozen())
+    {
+        ngindex.FrozenRange(minlen, maxlen, &first, &last);
+    }
+
+    pathid_t first, last;   // the frozen pathids which may be within the bounds
+    unsigned minlen, maxlen;
+    bool check_frozen;      // the index isn't partitioned, so [first, last) is everything
+    pathid_t nfrozen;
+};
+
+/**
+ * Merges the postings of 'feat' into the sorted candidate array 'cand',
+ * adding up the counts of the paths present in both. Erased paths and
+ * paths with file names outside the bounds are skipped. 'tmp' is
+ * a scratch buffer.
+ */
+inline void
+MergeCandidates(vector<Candidate>& cand, vector<Candidate>& tmp, const QueryFeature& feat,
+                const Window& win, const SimBounds& bounds, const NgramIndex& ngindex)
+{
+    tmp.clear();
+    tmp.reserve(cand.size() + feat.df());
+    vector<Candidate>::const_iterator cit = cand.begin();
+    ChainedCursor pit(feat.postings, feat.added);
+    for (pit.SkipTo(win.first); !pit.AtEnd(); pit.Next()) {
+        pathid_t pathid = pit.pathid();
+        if (pathid >= win.last && pathid < win.nfrozen) {
+            // past the partitions that matter - on to the added paths
+            pit.SkipTo(win.nfrozen);
+            if (pit.AtEnd())
+                break;
+            pathid = pit.pathid();
+        }
+        if (ngindex.IsErased(pathid))
+            continue;
+        while (cit != cand.end() && cit->pathid < pathid)
+            tmp.push_back(*cit++);
+        unsigned count = min(pit.count(), feat.count);
+        if (cit != cand.end() && cit->pathid == pathid) {
+            tmp.push_back(*cit++);
+            tmp.back().overlap += count;
+            continue;
+        }
+        Candidate c;
+        c.len = ngindex.fnlen(pathid);
+        if ((pathid >= win.nfrozen || win.check_frozen)
+                && (c.len < win.minlen || c.len > win.maxlen))
+            continue;
+        c.pathid = pathid;
+        c.overlap = count;
+        c.tau = bounds.Tau(c.len);
+        tmp.push_back(c);
+    }
+    tmp.insert(tmp.end(), cit, vector<Candidate>::const_iterator(cand.end()));
+    cand.swap(tmp);
+}
+
+// Orders the matches from the best: the more similar first and, on ties,
+// the lower pathid, so that the results don't depend on the order in which
+// the features are processed
+struct BetterMatch {
+    inline bool operator()(const Match& left, const Match& right) const
+    {
+        return left.similarity > right.similarity
+            || (left.similarity == right.similarity && left.pathid < right.pathid);
+    }
+};
+
+/**
+ * Keeps the k best of the candidates offered to it in a heap, with the
+ * worst of them on top. Once it is full, the worst similarity is a lower
+ * bound of the k-th best similarity.
+ */
+class TopK
 {
 public:
-    inline bool operator()(const pair<T1, T2>& left, const pair<T1, T2>& right)
+    explicit TopK(size_t k): k_(k) { heap_.reserve(k); }
+
+    void Clear() { heap_.clear(); }
+
+    void Offer(const Match& cand)
+    {
+        if (heap_.size() < k_) {
+            heap_.push_back(cand);
+            push_heap(heap_.begin(), heap_.end(), BetterMatch());
+        }
+        else if (BetterMatch()(cand, heap_.front())) {
+            pop_heap(heap_.begin(), heap_.end(), BetterMatch());
+            heap_.back() = cand;
+            push_heap(heap_.begin(), heap_.end(), BetterMatch());
+        }
+    }
+
+    // The similarity a candidate needs to get into the top k (-1 until k are known)
+    float Threshold() const
+    {
+        return (heap_.size() < k_)? -1: heap_.front().similarity;
+    }
+
+    // Moves the matches out, from the best one
+    void Take(vector<Match>& out)
     {
-        return left.second < right.second;
+        sort_heap(heap_.begin(), heap_.end(), BetterMatch());
+        out.swap(heap_);
+        heap_.clear();
     }
+
+private:
+    size_t k_;
+    vector<Match> heap_;
 };
 
+inline Match
+Score(const Candidate& cand, const SimBounds& bounds)
+{
+    Match m;
+    m.pathid = cand.pathid;
+    m.overlap = cand.overlap;
+    m.similarity = bounds.Similarity(cand.overlap, cand.len);
+    return m;
+}
+
 /**
- * Returns the pathid for the best matching file name or -1 if no
- * result satisfies the similarity criteria(tau)
+ * Finds the (up to) 'k' file names most similar to 'query', from the best,
+ * which are at least 'alpha'-similar to it.
+ *
+ * This is the CPMerge algorithm of SimString: the candidates are generated
+ * from the posting lists of the rarest features (the "signature"), and
+ * are then checked against the remaining features, dropping the ones
+ * that can no longer reach their tau or the k-th best similarity seen so
+ * far. The candidates are kept in a flat array sorted by pathid, so that
+ * each pass is a merge against a (sorted) posting list, skipping the
+ * blocks of postings that fall between two candidates. Only the pathids
+ * of the partitions within the length bounds of the measure are merged.
  */
-int BestMatch(const string& query, int tau, index_t& ngindex)
+size_t BestMatches(const string& query, SimMeasure measure, float alpha,
+                   const NgramIndex& ngindex, size_t k, vector<Match>& out_matches,
+                   Stats *stats)
 {
+    out_matches.clear();
+    string normalized;
+    NormalizeName(query, normalized);
+    if (normalized.empty() || !k)
+        return 0;
+
+    // the query has as many n-grams as bytes, after the normalization
+    unsigned qlen = normalized.size();
+    SimBounds bounds(measure, alpha, qlen);
+    Window win(bounds, ngindex);
+
     // Extract the query's features
-    typedef vector<pair<ngramid_t, unsigned> > feat_vec_t;
-    feat_vec_t feats; feats.reserve(query.size());
-    QueryFeats(query, feats);
+    vector<pair<ngramid_t, unsigned> > qfeats;
+    qfeats.reserve(qlen);
+    QueryFeats(normalized, qfeats);
 
     // Order the features from the rarest to the more common
-    typedef vector<pair<ngramid_t, unsigned> > freq_vec_t;
-    freq_vec_t freqs; freqs.reserve(feats.size());
-    vector<pair<unsigned, unsigned> > freq2feat;
-    unsigned zeros = 0, p = 0;
-    for (feat_vec_t::iterator it = feats.begin(); it != feats.end(); it++) {
-        index_t::iterator ixit = ngindex.find(it->first);
-        if (ixit == ngindex.end()) {
+    vector<QueryFeature> feats;
+    feats.reserve(qfeats.size());
+    unsigned zeros = 0;
+    for (size_t q = 0; q < qfeats.size(); q++) {
+        QueryFeature f;
+        f.ngram = qfeats[q].first;
+        f.count = qfeats[q].second;
+        f.postings = f.added = kNoPostings;
+        bool found = ngindex.Lookup(f.ngram, &f.postings);
+        found |= ngindex.LookupAdded(f.ngram, &f.added);
+        if (!found) {
             ++ zeros;
             continue; // this query feature is not in the index
         }
-
-        freqs.push_back(make_pair(it->first, ixit->second.size()));
-        freq2feat.push_back(make_pair(p++, ixit->second.size()));
+        feats.push_back(f);
     }
-    sort(freqs.begin(), freqs.end(), CompareSecond<ngramid_t, unsigned>());
+    stable_sort(feats.begin(), feats.end(), RarerFeature());
 
-    // The indices of the original features are permuted in the same way as in freqs
-    sort(freq2feat.begin(), freq2feat.end(), CompareSecond<unsigned, unsigned>());
-
-    // Make a short list of candidate file names
-    vector<index_atom_t> candidates; candidates.reserve(150); // the initial size is just a guess
-    int i = 0, f = 0;
-    int signature_len = query.size() - tau - zeros + 1;
+    // Make a short list of candidate file names. The shortest names within
+    // the bounds need the fewest shared n-grams, so their tau decides the
+    // length of the signature.
+    int tau = bounds.Tau(bounds.MinLen());
+    int signature_len = qlen - tau - zeros + 1;
     if (signature_len < 1)
-        return -1;
-    while (f < signature_len) {
-        ngram_invert_t& invidx = (ngindex.find(freqs[i].first))->second;
-        for (ngram_invert_t::iterator invit = invidx.begin(); invit != invidx.end(); invit++) {
-            unsigned featidx = freq2feat[i].first;
-            candidates.push_back(make_pair(invit->first, min(invit->second, feats[featidx].second)));
-        }
-        f += feats[freq2feat[i].first].second;
+        return 0;
+    vector<Candidate> candidates, scratch;
+    size_t i = 0;
+    int f = 0;
+    while (f < signature_len && i < feats.size()) {
+        MergeCandidates(candidates, scratch, feats[i], win, bounds, ngindex);
+        f += feats[i].count;
         ++ i;
     }
 
+    if (stats)
+        stats->candidates = candidates.size();
     if (candidates.empty())
-        return -1;
+        return 0;
 
-    //cout << "Candidate array size: " << candidates.size() << endl;
+    TopK best(k);
+    for (size_t c = 0; c < candidates.size(); c++)
+        best.Offer(Score(candidates[c], bounds));
+    float threshold = best.Threshold();
 
-    // Fold the list on pathid and put the entries in a list
-    sort(candidates.begin(), candidates.end(), CompareFirst<pathid_t, unsigned>());
-    pathid_t prev = candidates[0].first;
-    unsigned count = 0;
-    list<index_atom_t> candlist;
-    unsigned best_count = 0;
-    pathid_t most_similar = 0;
-    for (vector<index_atom_t>::iterator it = candidates.begin(); it != candidates.end(); it++) {
-        if (it->first != prev) {
-            candlist.push_back(make_pair(prev, count));
-            prev = it->first;
-            count = it->second;
-        }
-        else {
-            count += it->second;
-            if (count > best_count) {
-                best_count = count;
-                most_similar = it->first;
-            }
-        }
-    }
-    candlist.push_back(make_pair(prev, count));
-
-    // cout << "Candidate list size: " << candlist.size() << endl;
+    // For the rest of the features update the candidates, while pruning those,
+    // that don't have a chance of getting into the top k or fit within the
+    // similarity bounds. The survivors are compacted in place. The overlaps
+    // only grow, so the threshold of the previous pass stays valid while the
+    // top k is collected again.
+    int max_sim = qlen - f - zeros;
+    for (size_t j = i; j < feats.size(); j++) {
+        ChainedCursor pit(feats[j].postings, feats[j].added);
+        unsigned feat_count = feats[j].count;
+        best.Clear();
+        size_t w = 0;
+        for (size_t c = 0; c < candidates.size(); c++) {
+            Candidate cand = candidates[c];
 
-    // For the rest of the features update the entries in the candidate list, while pruning those,
-    // that don't have a chance of becoming the best candidate or fit within the similarity bounds
-    int max_sim = query.size() - f - zeros;
-    for (int j = i; j < freqs.size(); j++) {
-        ngram_invert_t& invidx = (ngindex.find(freqs[j].first))->second;
-        unsigned feat_count = feats[freq2feat[j].first].second;
-        list<index_atom_t>::iterator ilist = candlist.begin();
-        while ( ilist != candlist.end()) {
             // Check if the candidate isn't prommising
-            //cout << "Current candidate: " << ilist->first << endl;
-            unsigned cand_maxsim = ilist->second + max_sim;
-            if (cand_maxsim < best_count || cand_maxsim < tau) {
-                candlist.erase(ilist++);
-                if (candlist.size() == 0)
-                    return -1;
-                else
-                    continue;
-            }
+            unsigned cand_maxsim = cand.overlap + max_sim;
+            if (cand_maxsim < cand.tau
+                    || bounds.Similarity(cand_maxsim, cand.len) < threshold)
+                continue;
 
             // check if this candidate path has the current feature
-            // The inverted index is sorted because of the way it is constructed
-            ngram_invert_t::iterator lbit = lower_bound(
-                        invidx.begin(), invidx.end(), *ilist,
-                        CompareFirst<pathid_t, unsigned>());
-            if (lbit == invidx.end() || lbit->first != ilist->first) {
-                ++ ilist;
-                continue;
-            }
+            pit.SkipTo(cand.pathid);
+            if (!pit.AtEnd() && pit.pathid() == cand.pathid)
+                cand.overlap += min(pit.count(), feat_count);
 
-            ilist->second += min(lbit->second, feat_count);
-            if (ilist->second > best_count) {
-                best_count = ilist->second;
-                most_similar = ilist->first;
+            // (one below the threshold can't make it into the top k yet,
+            // but it may later)
+            Match m = Score(cand, bounds);
+            if (m.similarity >= threshold) {
+                best.Offer(m);
+                threshold = max(threshold, best.Threshold());
             }
-
-            ++ ilist;
+            candidates[w++] = cand;
         }
+        candidates.resize(w);
+        if (candidates.empty())
+            break;
 
         max_sim -= feat_count;
     }
+    if (stats)
+        stats->candidates_left = candidates.size();
+    if (candidates.empty())
+        return 0;
+
+    // A name below its tau is less than alpha-similar, so it ranks below
+    // all the names that aren't
+    vector<Match> top;
+    best.Take(top);
+    for (size_t t = 0; t < top.size() && top[t].similarity >= alpha - 1e-6; t++) {
+        if (top[t].overlap < bounds.Tau(ngindex.fnlen(top[t].pathid)))
+            break;
+        out_matches.push_back(top[t]);
+    }
 
-    if (best_count >= tau)
-        return most_similar;
-    else
+    return out_matches.size();
+}
+
+/**
+ * Returns the pathid for the best matching file name or -1 if no
+ * result is at least 'alpha'-similar to the query.
+ */
+int BestMatch(const string& query, SimMeasure measure, float alpha,
+              const NgramIndex& ngindex, Stats *stats)
+{
+    vector<Match> matches;
+    if (!BestMatches(query, measure, alpha, ngindex, 1, matches, stats))
         return -1;
+    return matches[0].pathid;
 }
 
-string Search(const string& fsroot, vector<string>& filters,
-              const string& target, float alpha)
-{
-    // overlap similarity (not cosine as in the paper)
-    int tau = ceil(alpha * target.length());
-    vector<string> fullpaths;
-    fullpaths.reserve(1024);
-    int minlen = tau, maxlen = target.length();
-    index_t index(10111);
-    IndexFiles(fsroot, filters, fullpaths, index, minlen, maxlen);
-    int path = BestMatch(target, tau, index);
-    if (path == -1) {
-        return string();
+/**
+ * Rebuilds the index of a Library from its live (not erased) paths on a
+ * separate thread. Only the frozen part of the live index is read by the
+ * thread, so the library can go on applying changes and serving queries.
+ */
+class Compactor
+{
+public:
+    Compactor(const NgramIndex& live, const string& key, const string& file,
+              const dirstamps_t& dirs);
+
+    void Start();
+    bool IsDone();
+
+    // Waits for the thread. Returns the new index or 0 if it couldn't be built.
+    NgramIndex* Finish();
+
+    void Run();
+
+private:
+    const NgramIndex& live_;
+    string key_;
+    string file_;
+    dirstamps_t dirs_;
+    vector<char> frozen_live_;  // which of the frozen paths are not erased
+    vector<string> added_;      // the added paths, which are not erased
+
+    NgramIndex result_;
+    bool ok_;
+
+    Thread<Compactor> thread_;
+    Mutex lock_;
+    bool done_;
+};
+
+Compactor::Compactor(const NgramIndex& live, const string& key,
+                     const string& file, const dirstamps_t& dirs):
+    live_(live), key_(key), file_(file), dirs_(dirs),
+    frozen_live_(live.nfrozen()), ok_(false), done_(false)
+{
+    for (pathid_t id = 0; id < live.nfrozen(); id++)
+        frozen_live_[id] = !live.IsErased(id);
+    for (pathid_t id = live.nfrozen(); id < live.npaths(); id++) {
+        if (!live.IsErased(id))
+            added_.push_back(live.path(id));
+    }
+}
+
+void
+Compactor::Start()
+{
+    // lhackd's SIGTERM has to reach its accept(), not the compaction
+    if (!thread_.StartMasked(this))
+        Run();
+}
+
+bool
+Compactor::IsDone()
+{
+    ScopedLock l(lock_);
+    return done_;
+}
+
+NgramIndex*
+Compactor::Finish()
+{
+    thread_.Join();
+    return ok_? &result_: 0;
+}
+
+void
+Compactor::Run()
+{
+    vector<string> paths;
+    paths.reserve(frozen_live_.size() + added_.size());
+    for (pathid_t id = 0; id < frozen_live_.size(); id++) {
+        if (frozen_live_[id])
+            paths.push_back(live_.path(id));
+    }
+    paths.insert(paths.end(), added_.begin(), added_.end());
+    SortForIndex(paths);
+
+    IndexSource src;
+    src.key = key_;
+    src.dirs.swap(dirs_);
+    src.fullpaths.reserve(paths.size());
+    for (size_t i = 0; i < paths.size(); i++)
+        AddPath(paths[i], src);
+    ok_ = result_.Build(src, file_);
+
+    ScopedLock l(lock_);
+    done_ = true;
+}
+
+Library::Library(const string& root, const vector<string>& filters,
+                 const SearchOptions& opts):
+    root_(root), filters_(filters), opts_(opts),
+    key_(IndexKey(root, filters)),
+    index_file_(opts.index_file.empty()? string(): KeyedIndexFile(opts.index_file, key_)),
+    loaded_(false), generation_(0), frozen_generation_(0),
+    rendered_(0), rendered_generation_(0), compactor_(0)
+{
+}
+
+Library::~Library()
+{
+    StopCompaction();
+    delete rendered_;
+}
+
+bool
+Library::Refresh(Stats *stats)
+{
+    {
+        StageTimer timer(stats, kStageIndexLoad);
+        if (loaded_ && watcher_.IsOpen()) {
+            if (Update())
+                return true;
+            // some changes were lost, so the library has to be crawled again
+        }
+        else if (loaded_ && index_.IsFresh()) {
+            return true;
+        }
+    }
+
+    StopCompaction();
+    ++ generation_;
+    ++ frozen_generation_;
+
+    // The watch is set up before the crawl, so that no change is missed
+    if (opts_.watch && !watcher_.Open(root_))
+        cerr << "Can't watch " << root_ << " for changes" << endl;
+
+    bool opened;
+    {
+        StageTimer timer(stats, kStageIndexLoad);
+        opened = !loaded_ && !opts_.rebuild && !index_file_.empty()
+              && index_.Open(index_file_, key_) && index_.IsFresh();
+    }
+    if (opened) {
+        loaded_ = true;
     }
     else {
-        return fullpaths[path];
+        // The index covers all file names, regardless of the query, so that
+        // it can be reused by the following searches
+        IndexSource src;
+        src.key = key_;
+        src.fullpaths.reserve(1024);
+        {
+            StageTimer timer(stats, kStageCrawl);
+            IndexFiles(root_, filters_, src,
+                       opts_.threads? opts_.threads: OnlineCpus());
+        }
+        if (stats) {
+            stats->files_visited = src.nvisited;
+            stats->files_matched = src.fullpaths.size();
+        }
+        StageTimer timer(stats, kStageIndexBuild);
+        loaded_ = index_.Build(src, index_file_);
     }
+
+    // apply whatever changed during the crawl
+    if (loaded_ && watcher_.IsOpen() && !Update())
+        watcher_.Close();
+
+    return loaded_;
+}
+
+// Applies the pending changes under the root. Returns false if they
+// can't be followed anymore.
+bool
+Library::Update()
+{
+    if (compactor_ && compactor_->IsDone())
+        FinishCompaction();
+
+    vector<FsEvent> events;
+    if (!watcher_.Poll(events))
+        return false;
+    for (size_t i = 0; i < events.size(); i++)
+        Apply(events[i]);
+    if (compactor_)
+        log_.insert(log_.end(), events.begin(), events.end());
+
+    if (!compactor_ && NeedsCompaction())
+        StartCompaction();
+
+    return true;
+}
+
+void
+Library::Apply(const FsEvent& ev)
+{
+    ++ generation_;
+    switch (ev.kind) {
+    case FsEvent::kFileAdded: {
+        size_t slash = ev.path.rfind('/');
+        const char *name = ev.path.c_str() + ((slash == string::npos)? 0: slash + 1);
+        if (!MatchesFilters(name, filters_) || index_.Find(ev.path) >= 0)
+            break;
+        IndexSource src(31);
+        src.first_pathid = index_.npaths();
+        if (AddPath(ev.path, src))
+            index_.Append(src);
+        break;
+    }
+    case FsEvent::kFileRemoved: {
+        int id = index_.Find(ev.path);
+        if (id >= 0)
+            index_.Erase(id);
+        break;
+    }
+    case FsEvent::kDirRemoved:
+        index_.EraseDir(ev.path);
+        break;
+    }
+}
+
+// The in-memory additions are slower to search than the frozen index and
+// the tombstones still take up space, so they are folded in once they
+// make up a sizeable part of the library
+bool
+Library::NeedsCompaction() const
+{
+    return index_.nadded() + index_.nerased() > 64 + index_.nfrozen() / 16;
+}
+
+void
+Library::StartCompaction()
+{
+    // The directories are stamped before the last changes are drained,
+    // so that a change racing with the compaction can only make the
+    // saved index look stale, never fresh
+    vector<string> paths;
+    watcher_.Dirs(paths);
+    dirstamps_t dirs;
+    struct stat st;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (stat(paths[i].c_str(), &st) < 0)
+            continue;
+        DirStamp stamp;
+        stamp.path = paths[i];
+        stamp.mtime_sec = st.st_mtim.tv_sec;
+        stamp.mtime_nsec = st.st_mtim.tv_nsec;
+        dirs.push_back(stamp);
+    }
+    sort(dirs.begin(), dirs.end(), DirStampLess());
+
+    vector<FsEvent> events;
+    if (!watcher_.Poll(events))
+        return; // the library will be crawled again anyway
+    for (size_t i = 0; i < events.size(); i++)
+        Apply(events[i]);
+
+    compactor_ = new Compactor(index_, key_, index_file_, dirs);
+    compactor_->Start();
+}
+
+// Switches to the compacted index, re-applying the changes which came
+// after the compaction was started
+void
+Library::FinishCompaction()
+{
+    NgramIndex *result = compactor_->Finish();
+    if (result) {
+        index_.swap(*result);
+        ++ frozen_generation_;
+        for (size_t i = 0; i < log_.size(); i++)
+            Apply(log_[i]);
+    }
+    StopCompaction();
+}
+
+void
+Library::StopCompaction()
+{
+    if (compactor_) {
+        compactor_->Finish();
+        delete compactor_;
+        compactor_ = 0;
+    }
+    log_.clear();
+}
+
+string
+Library::Search(const string& target, SimMeasure measure, float alpha, Stats *stats)
+{
+    vector<SearchResult> results;
+    if (!SearchTopK(target, measure, alpha, 1, results, stats))
+        return string();
+    return results[0].path;
+}
+
+size_t
+Library::SearchTopK(const string& target, SimMeasure measure, float alpha, size_t k,
+                    vector<SearchResult>& out_results, Stats *stats)
+{
+    out_results.clear();
+    if (target.empty() || !Refresh(stats))
+        return 0;
+
+    return MatchTarget(target, measure, alpha, k, out_results, stats);
+}
+
+bool
+Library::MatchRendered(const TitleShape& query, const GlyphSet& glyphs,
+                       SimMeasure measure, float alpha,
+                       SearchResult *out_result, Stats *stats)
+{
+    if (!Refresh(stats))
+        return false;
+
+    if (!rendered_ || rendered_generation_ != frozen_generation_) {
+        StageTimer timer(stats, kStageIndexBuild);
+        if (!rendered_)
+            rendered_ = new RenderedTitles;
+        rendered_->Update(index_, glyphs,
+                          index_file_.empty()? string(): index_file_ + ".titles");
+        rendered_generation_ = frozen_generation_;
+    }
+
+    StageTimer timer(stats, kStageMatch);
+    unsigned distance;
+    int id = rendered_->Match(query, index_, glyphs, &distance);
+    if (id < 0)
+        return false;
+
+    // scored as the search would score the title, had it been read
+    string path = index_.path(id);
+    string title, name;
+    NormalizeName(DisplayName(path.c_str()), title);
+    int fnbase, fnlen;
+    if (title.empty() || !FindBasename(path, &fnbase, &fnlen))
+        return false;
+    NormalizeName(path.data() + fnbase, path.data() + fnbase + fnlen, name);
+    unsigned overlap = SharedNgrams(title, name);
+    float similarity = SimBounds(measure, alpha, title.size()).Similarity(overlap, name.size());
+    if (similarity < alpha - 1e-6)
+        return false;
+
+    out_result->path = path;
+    out_result->overlap = overlap;
+    out_result->similarity = similarity;
+    return true;
+}
+
+void
+Library::SearchAll(const vector<string>& targets, SimMeasure measure, float alpha,
+                   size_t k, vector<vector<SearchResult> >& out_results, Stats *stats)
+{
+    out_results.assign(targets.size(), vector<SearchResult>());
+    if (targets.empty() || !Refresh(stats))
+        return;
+
+    for (size_t t = 0; t < targets.size(); t++) {
+        if (!targets[t].empty())
+            MatchTarget(targets[t], measure, alpha, k, out_results[t], stats);
+    }
+}
+
+size_t
+Library::MatchTarget(const string& target, SimMeasure measure, float alpha, size_t k,
+                     vector<SearchResult>& out_results, Stats *stats)
+{
+    if (stats) {
+        stats->ngrams = index_.nngrams();
+        stats->postings = index_.npostings();
+    }
+
+    StageTimer timer(stats, kStageMatch);
+    vector<Match> matches;
+    BestMatches(target, measure, alpha, index_, k, matches, stats);
+    out_results.resize(matches.size());
+    for (size_t i = 0; i < matches.size(); i++) {
+        out_results[i].path = index_.path(matches[i].pathid);
+        out_results[i].overlap = matches[i].overlap;
+        out_results[i].similarity = matches[i].similarity;
+    }
+
+    return out_results.size();
+}
+
+string Search(const string& fsroot, vector<string>& filters,
+              const string& target, float alpha, const SearchOptions& opts)
+{
+    Library library(fsroot, filters, opts);
+    return library.Search(target, opts.measure, alpha);
+}
+
+size_t SearchTopK(const string& fsroot, vector<string>& filters,
+                  const string& target, float alpha, size_t k,
+                  vector<SearchResult>& out_results, const SearchOptions& opts)
+{
+    Library library(fsroot, filters, opts);
+    return library.SearchTopK(target, opts.measure, alpha, k, out_results);
 }
 
 }; // namespace lhack
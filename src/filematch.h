@@ -17,10 +17,220 @@
 #ifndef FILEMATCH_H
 #define FILEMATCH_H
 
+#include <string>
+#include <vector>
+
+#include "ngindex.h"
+#include "watcher.h"
+#include "stats.h"
+
 namespace lhack {
 
+using namespace std;
+
+/**
+ * How the similarity of a file name Y to a query X is measured, where
+ * |X| and |Y| are their n-gram counts (the lengths in bytes, after the
+ * normalization in ngrams.h) and |X & Y|
+ * is the number of n-grams they share. Each measure bounds the length of
+ * the names which can reach a given similarity (see SimBounds), so only
+ * the index partitions of these lengths are searched.
+ */
+enum SimMeasure {
+    kSimOverlap,    // |X & Y| / |X| - the share of the query found in the name
+    kSimCosine,     // |X & Y| / sqrt(|X| |Y|)
+    kSimDice,       // 2 |X & Y| / (|X| + |Y|)
+    kSimJaccard,    // |X & Y| / (|X| + |Y| - |X & Y|)
+    kNumSimMeasures
+};
+
+static const char* const kSimMeasureNames[kNumSimMeasures] = {
+    "overlap", "cosine", "dice", "jaccard"
+};
+
+// Parses one of kSimMeasureNames
+bool ParseSimMeasure(const string& name, SimMeasure *out_measure);
+
+/**
+ * What a file name has to satisfy to be at least 'alpha'-similar to a
+ * query of 'qlen' n-grams (as in SimString): its length must be within
+ * [MinLen(), MaxLen()], and it must share at least Tau(length) n-grams
+ * with the query.
+ */
+class SimBounds
+{
+public:
+    SimBounds(SimMeasure measure, float alpha, unsigned qlen);
+
+    unsigned MinLen() const { return minlen_; }
+    unsigned MaxLen() const { return maxlen_; }
+    unsigned Tau(unsigned len) const;
+    float Similarity(unsigned overlap, unsigned len) const;
+
+private:
+    SimMeasure measure_;
+    double alpha_;
+    unsigned qlen_;
+    unsigned minlen_, maxlen_;
+};
+
+struct SearchOptions {
+    SearchOptions(): rebuild(false), threads(0), watch(false), measure(kSimOverlap) {}
+
+    // Where the index is persisted between invocations ("" - don't persist).
+    // Each library saves its own, see KeyedIndexFile().
+    string index_file;
+
+    // Re-crawl the library even if the saved index looks up to date
+    bool rebuild;
+
+    // Threads used to crawl and index the library (0 - one per CPU)
+    unsigned threads;
+
+    // Follow the changes under the root with inotify, instead of checking
+    // the directory mtimes on every search (for long-running processes)
+    bool watch;
+
+    // The similarity measure of the searches made by Resolver and by the
+    // Search() functions below
+    SimMeasure measure;
+};
+
+// Crawls 'root' and indexes the names of the files matching 'filters'.
+// With more than one thread the crawl is parallel (see crawl.h).
+void IndexFiles(const string& root, const vector<string>& filters,
+                IndexSource& out, unsigned nthreads = 1);
+
+// Indexes the name of one more file. Returns false if the path has no basename.
+bool AddPath(const string& path, IndexSource& out);
+
+// Sorts the paths in the order their pathids are given in (by the length
+// of the file name, then by path, see kIndexPartitioned)
+void SortForIndex(vector<string>& paths);
+
+// A file name similar to a query
+struct Match {
+    pathid_t pathid;
+    unsigned overlap;       // the n-grams it shares with the query
+    float similarity;       // on the scale of 'alpha'
+};
+
+// Finds the (up to) 'k' file names most similar to 'query', which are at
+// least 'alpha'-similar to it. They are stored from the best in
+// 'out_matches', and their number is returned. The candidate counts are
+// recorded in 'stats', if given.
+size_t BestMatches(const string& query, SimMeasure measure, float alpha,
+                   const NgramIndex& ngindex, size_t k, vector<Match>& out_matches,
+                   Stats *stats = 0);
+
+// Returns the pathid of the file name most similar to 'query' or -1
+int BestMatch(const string& query, SimMeasure measure, float alpha,
+              const NgramIndex& ngindex, Stats *stats = 0);
+
+// A file found by Library::SearchTopK()
+struct SearchResult {
+    string path;
+    unsigned overlap;
+    float similarity;
+};
+
+class Compactor;
+class GlyphSet;
+class RenderedTitles;
+struct TitleShape;
+
+/**
+ * A set of files (all files under 'root', matching one of 'filters'),
+ * whose index is kept open between searches.
+ *
+ * If SearchOptions::watch is set, the files added and removed under the
+ * root are applied to the index as they come (see NgramIndex::Append()
+ * and NgramIndex::Erase()), and once enough of them accumulate, the index
+ * is rebuilt from the live paths on a background thread.
+ */
+class Library
+{
+public:
+    Library(const string& root, const vector<string>& filters,
+            const SearchOptions& opts = SearchOptions());
+    ~Library();
+
+    // Makes sure the index reflects the file system, rebuilding it if needed
+    bool Refresh(Stats *stats = 0);
+
+    // Returns the path of the file best matching 'target' or "" if none
+    // satisfies the similarity coefficient 'alpha'
+    string Search(const string& target, SimMeasure measure, float alpha,
+                  Stats *stats = 0);
+
+    // Finds the (up to) 'k' files best matching 'target' and stores them
+    // from the best in 'out_results'. Returns their number.
+    size_t SearchTopK(const string& target, SimMeasure measure, float alpha, size_t k,
+                      vector<SearchResult>& out_results, Stats *stats = 0);
+
+    // Same as SearchTopK(), for a batch of targets (e.g. all the titles
+    // on a page). The index is refreshed once, before the first target.
+    // 'out_results' gets one entry per target.
+    void SearchAll(const vector<string>& targets, SimMeasure measure, float alpha,
+                   size_t k, vector<vector<SearchResult> >& out_results,
+                   Stats *stats = 0);
+
+    /**
+     * Finds the file whose name, drawn with 'glyphs', looks like the
+     * grabbed title 'query' (see RenderedTitles::Match()). The names
+     * are drawn the first time (and again whenever the index is rebuilt),
+     * and kept next to the index file. The title is then taken for the
+     * name as drawn (see DisplayName()), and the file's similarity to it
+     * by 'measure' has to reach 'alpha', as in a search. Returns false if
+     * no file stands out.
+     */
+    bool MatchRendered(const TitleShape& query, const GlyphSet& glyphs,
+                       SimMeasure measure, float alpha,
+                       SearchResult *out_result, Stats *stats = 0);
+
+    // Changes whenever the indexed files may have changed, i.e. the
+    // results of an earlier search may no longer be valid. Call Refresh()
+    // first to pick up the latest changes.
+    unsigned generation() const { return generation_; }
+
+private:
+    Library(const Library&);
+    Library& operator=(const Library&);
+
+    bool Update();
+    size_t MatchTarget(const string& target, SimMeasure measure, float alpha, size_t k,
+                       vector<SearchResult>& out_results, Stats *stats);
+    void Apply(const FsEvent& ev);
+    bool NeedsCompaction() const;
+    void StartCompaction();
+    void FinishCompaction();
+    void StopCompaction();
+
+    string root_;
+    vector<string> filters_;
+    SearchOptions opts_;
+    string key_;
+    string index_file_;     // see KeyedIndexFile()
+    NgramIndex index_;
+    bool loaded_;
+    unsigned generation_;
+    unsigned frozen_generation_;    // changes when index_ is rebuilt
+    RenderedTitles *rendered_;
+    unsigned rendered_generation_;  // the frozen_generation_ they were drawn for
+
+    TreeWatcher watcher_;
+    Compactor *compactor_;
+    vector<FsEvent> log_;       // the changes made while compacting
+};
+
 string Search(const string& fsroot, vector<string>& filters,
-              const string& target, float alpha);
+              const string& target, float alpha,
+              const SearchOptions& opts = SearchOptions());
+
+size_t SearchTopK(const string& fsroot, vector<string>& filters,
+                  const string& target, float alpha, size_t k,
+                  vector<SearchResult>& out_results,
+                  const SearchOptions& opts = SearchOptions());
 
 };
 
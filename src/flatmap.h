@@ -0,0 +1,176 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef FLATMAP_H
+#define FLATMAP_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <stdint.h>
+
+namespace lhack {
+
+using namespace std;
+
+// Scrambles the bits of a 32-bit key (the finalizer of MurmurHash3), so
+// that keys differing in a single byte don't end up in adjacent slots
+inline uint32_t
+MixHash(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x85ebca6bu;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35u;
+    key ^= key >> 16;
+    return key;
+}
+
+/**
+ * A hash map from 32-bit keys, for the n-gram dictionary while the index
+ * is being built. The entries are kept in a dense array, in the order
+ * they were inserted, and the table itself is open-addressed (linear
+ * probing) and only holds the keys and the positions of the entries,
+ * so that a probe rarely takes more than one cache line. There is no
+ * erase.
+ *
+ * The interface is the subset of std::map's needed by the index code;
+ * the iterators are invalidated by an insertion.
+ */
+template <typename Value>
+class FlatMap
+{
+public:
+    typedef uint32_t key_type;
+    typedef pair<key_type, Value> value_type;
+    typedef typename vector<value_type>::iterator iterator;
+    typedef typename vector<value_type>::const_iterator const_iterator;
+
+    explicit FlatMap(size_t nexpected = 0): mask_(0) { Rehash(nexpected); }
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    iterator begin() { return entries_.begin(); }
+    iterator end() { return entries_.end(); }
+    const_iterator begin() const { return entries_.begin(); }
+    const_iterator end() const { return entries_.end(); }
+
+    iterator find(key_type key)
+    {
+        const Slot *slot = Probe(key);
+        return slot->pos? entries_.begin() + (slot->pos - 1): entries_.end();
+    }
+
+    const_iterator find(key_type key) const
+    {
+        const Slot *slot = Probe(key);
+        return slot->pos? entries_.begin() + (slot->pos - 1): entries_.end();
+    }
+
+    Value& operator[](key_type key)
+    {
+        Slot *slot = Probe(key);
+        if (slot->pos)
+            return entries_[slot->pos - 1].second;
+
+        // keep the load factor at or below 1/2
+        if (2 * (entries_.size() + 1) > slots_.size()) {
+            Rehash(entries_.size() + 1);
+            slot = Probe(key);
+        }
+        Append(key);
+        slot->key = key;
+        slot->pos = entries_.size();
+        return entries_.back().second;
+    }
+
+    void clear()
+    {
+        vector<value_type>().swap(entries_);
+        Slot empty = {0, 0};
+        vector<Slot>(16, empty).swap(slots_);
+        mask_ = 15;
+    }
+
+    void swap(FlatMap& other)
+    {
+        entries_.swap(other.entries_);
+        slots_.swap(other.slots_);
+        std::swap(mask_, other.mask_);
+    }
+
+private:
+    struct Slot {
+        key_type key;
+        uint32_t pos;   // 1 + the position of the entry, 0 if the slot is free
+    };
+
+    Slot* Probe(key_type key) const
+    {
+        size_t i = MixHash(key) & mask_;
+        const Slot *slot = &slots_[i];
+        while (slot->pos && slot->key != key) {
+            i = (i + 1) & mask_;
+            slot = &slots_[i];
+        }
+        return const_cast<Slot*>(slot);
+    }
+
+    // Makes room for at least 'nentries' entries and re-inserts the keys
+    void Rehash(size_t nentries)
+    {
+        size_t nslots = 16;
+        while (nslots < 2 * nentries)
+            nslots *= 2;
+        if (nslots <= slots_.size())
+            return;
+
+        Slot empty = {0, 0};
+        slots_.assign(nslots, empty);
+        mask_ = nslots - 1;
+        for (size_t e = 0; e < entries_.size(); e++) {
+            Slot *slot = Probe(entries_[e].first);
+            slot->key = entries_[e].first;
+            slot->pos = e + 1;
+        }
+    }
+
+    // Adds an entry with a default value. The values (e.g. posting vectors)
+    // are swapped rather than copied when the array grows.
+    void Append(key_type key)
+    {
+        if (entries_.size() == entries_.capacity()) {
+            vector<value_type> grown;
+            grown.reserve(max<size_t>(16, 2 * entries_.size()));
+            for (size_t e = 0; e < entries_.size(); e++) {
+                grown.push_back(value_type(entries_[e].first, Value()));
+                std::swap(grown.back().second, entries_[e].second);
+            }
+            entries_.swap(grown);
+        }
+        entries_.push_back(value_type(key, Value()));
+    }
+
+    vector<value_type> entries_;
+    vector<Slot> slots_;
+    size_t mask_;
+};
+
+}; // namespace lhack
+
+#endif // FLATMAP_H
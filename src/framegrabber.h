@@ -18,49 +18,112 @@
 #define FRAMEGRABBER_H
 
 #include <string>
+#include <vector>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
 
 #include "linux/fb.h"
 #include "devicedefs.h"
+#include "pixops.h"
 
 namespace lhack {
 
 
-// A bitmap to be passed around ...
-struct Bitmap {
-    Bitmap(int width, int height, int bpp):
-        width_(width), height_(height), bpp_(bpp)
+/**
+ * A non-owning view of an image, whose rows are 'stride' bytes apart. It
+ * may point into the mapped frame buffer or into a Bitmap, and is only
+ * valid as long as what it points to. Copying it copies the pointer.
+ */
+class BitmapView
+{
+public:
+    BitmapView(): data_(0), width_(-1), height_(0), bpp_(8), stride_(0) {}
+    BitmapView(const char *data, int width, int height, int bpp, int stride):
+        data_(data), width_(width), height_(height), bpp_(bpp), stride_(stride) {}
+
+    bool IsValid() const { return data_ && width_ != -1; }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int bpp() const { return bpp_; }
+    int stride() const { return stride_; }
+    const char* buffer() const { return data_; }
+    const char* row(int y) const { return data_ + y * stride_; }
+
+    // The bytes of pixels in a row, without any padding
+    size_t row_bytes() const { return (width_ * bpp_) / 8; }
+
+private:
+    const char *data_;
+    int width_;
+    int height_;
+    int bpp_;
+    int stride_;
+};
+
+/**
+ * An image owning its (tightly packed) pixels. Copies share the pixels,
+ * with the reference count kept in the same allocation. swap() hands
+ * them over without touching the count - the way to move a Bitmap, as
+ * there are no rvalue references in C++98.
+ */
+class Bitmap
+{
+public:
+    Bitmap(): width_(-1), height_(0), bpp_(8), block_(0) {}
+
+    Bitmap(int width, int height, int bpp): width_(-1), height_(0), bpp_(8), block_(0)
     {
-        buffer_ = new char[((width*bpp)/8) * height];
-        refcnt_ = new int;
-        *refcnt_ = 1;
+        Reset(width, height, bpp);
     }
 
-    Bitmap(const Bitmap& other)
+    Bitmap(const Bitmap& other):
+        width_(other.width_), height_(other.height_), bpp_(other.bpp_), block_(other.block_)
     {
-        this->buffer_ = other.buffer_;
-        this->width_ = other.width_;
-        this->height_ = other.height_;
-        this->bpp_ = other.bpp_;
-
-        this->refcnt_ = other.refcnt_;
-        ++ *refcnt_;
+        if (block_)
+            ++ block_->refcnt;
     }
 
     Bitmap& operator=(const Bitmap& other)
     {
-        if (! (-- *refcnt_)) {
-            delete[] buffer_;
-            delete refcnt_;
-        }
+        Bitmap copy(other);
+        swap(copy);
+        return *this;
+    }
+
+    ~Bitmap() { Release(); }
 
-        this->buffer_ = other.buffer_;
-        this->width_ = other.width_;
-        this->height_ = other.height_;
-        this->bpp_ = other.bpp_;
+    void swap(Bitmap& other)
+    {
+        std::swap(width_, other.width_);
+        std::swap(height_, other.height_);
+        std::swap(bpp_, other.bpp_);
+        std::swap(block_, other.block_);
+    }
 
-        this->refcnt_ = other.refcnt_;
-        ++ *refcnt_;
+    // Gives the bitmap a new size. The memory of the pixels is reused if
+    // it isn't shared and is large enough, and the pixels are undefined.
+    void Reset(int width, int height, int bpp)
+    {
+        size_t size = ((width * bpp) / 8) * height;
+        if (!block_ || block_->refcnt > 1 || block_->capacity < size) {
+            Release();
+            block_ = static_cast<Block*>(::operator new(sizeof(Block) + size));
+            block_->refcnt = 1;
+            block_->capacity = size;
+        }
+        width_ = width;
+        height_ = height;
+        bpp_ = bpp;
     }
 
     void SetInvalid()
@@ -68,88 +131,316 @@ struct Bitmap {
         width_ = -1;
     }
 
-    bool IsValid()
+    bool IsValid() const
     {
         return width_ != -1;
     }
 
-    ~Bitmap()
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int bpp() const { return bpp_; }
+    char* buffer() { return block_? block_->pixels(): 0; }
+
+    BitmapView view() const
     {
-        if (! (-- *refcnt_)) {
-            delete[] buffer_;
-            delete refcnt_;
-        }
+        return BitmapView(block_? block_->pixels(): 0, width_, height_, bpp_,
+                          (width_ * bpp_) / 8);
     }
 
-    int width() { return width_; }
-    int height() { return height_; }
-    int bpp() { return bpp_; }
-    char* buffer() {return buffer_; }
-
 private:
+    // The header of the pixels' memory
+    struct Block {
+        int refcnt;
+        size_t capacity;
+
+        char* pixels() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    void Release()
+    {
+        if (block_ && !(-- block_->refcnt))
+            ::operator delete(block_);
+        block_ = 0;
+    }
+
     int width_;
     int height_;
     int bpp_;
-    char *buffer_;
-    int *refcnt_;
+    Block *block_;
 };
 
+// A fast hash of the pixels, to tell whether a title (or a whole page)
+// has been seen before. Not meant to withstand crafted inputs.
+inline uint64_t
+HashBitmap(const BitmapView& image, uint64_t hash = 14695981039346656037ULL)
+{
+    size_t len = image.row_bytes();
+    for (int y = 0; y < image.height(); y++) {
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(image.row(y));
+        size_t k = 0;
+        for (; k + 4 <= len; k += 4) {
+            uint32_t word;
+            memcpy(&word, p + k, sizeof(word));
+            hash = (hash ^ word) * 1099511628211ULL;
+        }
+        for (; k < len; k++)
+            hash = (hash ^ p[k]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 29);
+}
+
+// The geometry of a frame buffer
+struct ScreenInfo {
+    int width, height, bpp;
+};
+
+// Reads the geometry 'fbdev' reports. Fails for plain files.
+inline bool
+ReadScreenInfo(const char *fbdev, ScreenInfo *out_info)
+{
+    int fd = open(fbdev, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct fb_var_screeninfo vinfo;
+    bool ok = (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) == 0);
+    close(fd);
+    if (!ok)
+        return false;
+
+    out_info->width = vinfo.xres;
+    out_info->height = vinfo.yres;
+    out_info->bpp = vinfo.bits_per_pixel;
+    return true;
+}
+
+template <typename DIM>
+inline bool
+ScreenMatches(const ScreenInfo& info)
+{
+    return info.width == DIM::kScreenWidth && info.height == DIM::kScreenHeight
+        && info.bpp == DIM::kBPP;
+}
+
 /**
  * Reads the frame buffer and finds the entries there.
+ *
+ * The frame buffer device (or a frame buffer dump, on a development host)
+ * is mapped once, and the probes and the crops are done directly in the
+ * mapping, so a grab makes no system calls. A file which can't be mapped
+ * is read instead - the part of the frame where the entries of either
+ * layout can be, with a single pread() per grab.
  **/
 template <typename DIM=KDXDimensions >
 class FrameGrabber
 {
 public:
-    FrameGrabber(const char *fbdev): fbdev_(fbdev) {};
+    FrameGrabber(const char *fbdev);
+    ~FrameGrabber();
 
     /**
-     * Try to find the selected (underlined) title and return its bitmap image.
-     * Check the result using IsValid() method of Bitmap.
+     * Try to find the selected (underlined) title and return its 8bpp image.
+     * Check the result using IsValid() method of BitmapView.
+     *
+     * The images returned by the grabs are only valid until the next grab:
+     * they are unpacked into memory reused by every grab or, if the frame
+     * buffer is 8bpp, point into the frame itself. So a grab doesn't
+     * allocate anything once the first one is done.
      */
-    Bitmap GrabSelected();
+    BitmapView GrabSelected();
+
+    /**
+     * Crops the titles of all entries on the page (the underlines aren't
+     * included, so the crops don't change with the selection), from the
+     * top. Returns the row of the selected one, or -1 if nothing is
+     * selected, in which case 'out_titles' is left empty.
+     */
+    int GrabAll(std::vector<BitmapView>& out_titles);
+
+    /**
+     * Identifies the selection: the layout, the selected row and the bytes
+     * of its title, as they are in the frame (nothing is unpacked).
+     * Returns 0 if nothing is selected. It takes the probes GrabSelected()
+     * makes and a hash of a title, so it can be polled cheaply.
+     */
+    uint64_t Fingerprint();
 
 private:
+    FrameGrabber(const FrameGrabber&);
+    FrameGrabber& operator=(const FrameGrabber&);
+
+    bool Open();
+    void Close();
+
+    // Makes the frame readable with At() for the current grab
+    bool LoadFrame();
+
+    // Returns the bytes [offset, offset + len) of the frame or 0 if they
+    // weren't loaded (e.g. they are past its end)
+    const unsigned char* At(size_t offset, size_t len) const
+    {
+        if (offset < view_off_ || offset + len > view_off_ + view_len_)
+            return 0;
+        return view_ + (offset - view_off_);
+    }
+
+    // Finds out whether a collection is shown. Returns the number of
+    // entries on the page (0 on error) and the offset of the first one.
+    int FindLayout(size_t *out_first);
+
+    // Returns the row whose underline is solid or -1
+    int FindSelected(size_t first, int entries_page);
+
+    // Returns the title starting at 'offset', unpacked into the 'slot'-th
+    // title of the arena unless the frame is 8bpp already
+    BitmapView CropTitle(size_t offset, int slot);
+
+    static int title_height() { return DIM::kFontHeight + DIM::kUlineMinOffset; }
+
+    // The geometry of the underline check, in words of a scanline
+    static int check_start()
+    {
+        return ((DIM::kOffsetX + 2*sizeof(unsigned))*DIM::kBPP) / (8 * sizeof(unsigned));
+    }
+    static int check_len()
+    {
+        return ((DIM::kEntryLen - 2*sizeof(unsigned))*DIM::kBPP) / (8 * sizeof(unsigned));
+    }
+    static size_t check_bytes()
+    {
+        return (check_start() + check_len() + 3) * sizeof(unsigned);
+    }
+
+    // The distance between two entries
+    size_t entry_bytes() const
+    {
+        return line_length_ * (DIM::kFontHeight + DIM::kUlineBaseOffset + DIM::kEntryGap);
+    }
+
+    // The scanlines [first, end) hold all that a grab reads in either
+    // layout: the collection's underline, the titles and the underlines
+    static int region_first_row()
+    {
+        return std::min<int>(DIM::kOffsetUlineCol, std::min<int>(DIM::kOffsetY, DIM::kOffsetYCol));
+    }
+    static int region_end_row()
+    {
+        int pitch = DIM::kFontHeight + DIM::kUlineBaseOffset + DIM::kEntryGap;
+        int uline = DIM::kFontHeight + DIM::kUlineBaseOffset + 1;
+        return std::max<int>(DIM::kOffsetYCol + (DIM::kEntryPerPgCol - 1) * pitch,
+                             DIM::kOffsetY + (DIM::kEntryPerPg - 1) * pitch) + uline + 1;
+    }
+
     const char *fbdev_;
+    int fd_;
+    unsigned char *map_;
+    size_t map_size_;
+    size_t line_length_;  // bytes per scanline, including any padding
+    std::vector<unsigned char> framebuf_;   // what was read, if not mapped
+    Bitmap arena_;  // the unpacked titles, one after another
+
+    // the part of the frame At() can return
+    const unsigned char *view_;
+    size_t view_off_, view_len_;
 };
 
 template <typename DIM >
-Bitmap FrameGrabber<DIM>::GrabSelected()
+FrameGrabber<DIM>::FrameGrabber(const char *fbdev):
+    fbdev_(fbdev), fd_(-1), map_(0), map_size_(0),
+    line_length_((DIM::kScreenWidth * DIM::kBPP) / 8),
+    view_(0), view_off_(0), view_len_(0)
 {
-    using namespace std;
+    Open();
+}
 
-#ifdef LHACK_DEBUG_GRABBER
-    int chkline_idx = 1;
-#endif
+template <typename DIM >
+FrameGrabber<DIM>::~FrameGrabber()
+{
+    Close();
+}
 
-    int i, j;
-    int bytes_row = (DIM::kScreenWidth * DIM::kBPP) / 8;
-    int bytes_skip =  bytes_row * DIM::kOffsetYCol; // skip the lines before the 1st title
-    int bytes_entry = bytes_row * (DIM::kFontHeight + DIM::kUlineBaseOffset + DIM::kEntryGap);
-    int off_uline = bytes_row * (DIM::kFontHeight + DIM::kUlineBaseOffset + 1);
-    int bytes_row_title = (DIM::kEntryLen * DIM::kBPP) / 8;
-    int title_height = DIM::kFontHeight + DIM::kUlineMinOffset;
+template <typename DIM >
+bool FrameGrabber<DIM>::Open()
+{
+    fd_ = open(fbdev_, O_RDONLY);
+    if (fd_ < 0)
+        return false;
+
+    // a dump has the layout of the device's frame buffer, without padding
+    struct fb_fix_screeninfo finfo;
+    struct stat st;
+    if (ioctl(fd_, FBIOGET_FSCREENINFO, &finfo) == 0 && finfo.line_length) {
+        line_length_ = finfo.line_length;
+        map_size_ = finfo.smem_len;
+    }
+    else if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode)) {
+        map_size_ = st.st_size;
+    }
+    if (map_size_) {
+        void *map = mmap(0, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (map != MAP_FAILED)
+            map_ = static_cast<unsigned char*>(map);
+        else
+            map_size_ = 0;
+    }
+    view_ = map_;
+    view_off_ = 0;
+    view_len_ = map_size_;
 
-    int check_start = ((DIM::kOffsetX + 2*sizeof(unsigned))*DIM::kBPP) / (8 * sizeof(unsigned));
-    int check_len = ((DIM::kEntryLen - 2*sizeof(unsigned))*DIM::kBPP) / (8 * sizeof(unsigned));
+    return true;
+}
 
-    char *linebuf = new char[bytes_row];
+template <typename DIM >
+void FrameGrabber<DIM>::Close()
+{
+    if (map_)
+        munmap(map_, map_size_);
+    if (fd_ >= 0)
+        close(fd_);
+    map_ = 0;
+    map_size_ = 0;
+    fd_ = -1;
+    view_ = 0;
+    view_len_ = 0;
+}
 
-    Bitmap title(DIM::kEntryLen, title_height, 8);
+template <typename DIM >
+bool FrameGrabber<DIM>::LoadFrame()
+{
+    if (fd_ < 0 && !Open())
+        return false;
+    if (map_)
+        return true;
+
+    size_t first = region_first_row() * line_length_;
+    size_t len = region_end_row() * line_length_ - first;
+    framebuf_.resize(len);
+    ssize_t got = pread(fd_, &framebuf_[0], len, first);
+    view_ = &framebuf_[0];
+    view_off_ = first;
+    view_len_ = (got > 0)? got: 0;
+
+    return got > 0;
+}
+
+template <typename DIM >
+int FrameGrabber<DIM>::FindLayout(size_t *out_first)
+{
+    using namespace std;
 
-    ifstream fb(fbdev_, ios::in | ios::binary);
+    size_t bytes_row = line_length_;
 
     // Check whether we are browsing a collection
     // (relies on the fact that the collection name's underline is longer)
+    const unsigned *line = reinterpret_cast<const unsigned*>(
+                At(bytes_row * DIM::kOffsetUlineCol, check_bytes()));
+    if (!line)
+        return 0;
+
     int entries_page = DIM::kEntryPerPgCol;
-    fb.seekg(bytes_row * DIM::kOffsetUlineCol);
-    fb.read(linebuf, bytes_row);
-    for (i = check_start - 4; i < check_start + check_len + 3; i++) {
-        if (((unsigned*) linebuf)[i] != DIM::kUlineColor) {
-            entries_page = DIM::kEntryPerPg;
-            bytes_skip = bytes_row * DIM::kOffsetY;
-            break;
-        }
+    *out_first = bytes_row * DIM::kOffsetYCol; // skip the lines before the 1st title
+    if (!IsSolidLine(line + check_start() - 4, check_len() + 7, DIM::kUlineColor)) {
+        entries_page = DIM::kEntryPerPg;
+        *out_first = bytes_row * DIM::kOffsetY;
     }
 
 #ifdef LHACK_DEBUG_GRABBER
@@ -157,67 +448,139 @@ Bitmap FrameGrabber<DIM>::GrabSelected()
         std::cout << "Bytes per line: " << bytes_row << std::endl;
         std::cout << "Collection name underline offset: " << (bytes_row * DIM::kOffsetUlineCol) << std::endl;
         std::cout << "Entries per page: " << entries_page << std::endl;
-        std::cout << "Check length: " << check_len << std::endl;
+        std::cout << "Check length: " << check_len() << std::endl;
         ofstream chkdump("chkcollection.gray", ios::out | ios::binary);
-        chkdump.write(linebuf, bytes_row);
+        chkdump.write((const char*) line, check_bytes());
         chkdump.close();
 
     }
 #endif
 
+    return entries_page;
+}
+
+template <typename DIM >
+int FrameGrabber<DIM>::FindSelected(size_t first, int entries_page)
+{
+    using namespace std;
+
+#ifdef LHACK_DEBUG_GRABBER
+    int chkline_idx = 1;
+#endif
 
-    for (i = 0; i < entries_page; i++) {
-        // Check for the solid underline
-        fb.seekg(bytes_skip + off_uline, ios::beg);
-        fb.read(linebuf, bytes_row);
+    size_t off_uline = line_length_ * (DIM::kFontHeight + DIM::kUlineBaseOffset + 1);
+    for (int i = 0; i < entries_page; i++) {
+        // Check for the solid underline (IsSolidLine() stops at the first
+        // word that differs, so the dotted ones cost a word or two)
+        const unsigned *line = reinterpret_cast<const unsigned*>(
+                    At(first + i * entry_bytes() + off_uline, check_bytes()));
+        if (!line)
+            break;
 #ifdef LHACK_DEBUG_GRABBER
         {
             char dumpfile[80];
             snprintf(dumpfile, 80, "chkline%02d.gray", chkline_idx++);
             ofstream chkdump(dumpfile, ios::out | ios::binary);
-            chkdump.write(linebuf, bytes_row);
+            chkdump.write((const char*) line, check_bytes());
             chkdump.close();
         }
 #endif
-        for (j = check_start; j < check_start + check_len; j++) {
-            if (((unsigned*) linebuf)[j] != DIM::kUlineColor) {
-                break;
-            }
-        }
-
         // Selected item has been found
-        if (j == check_start + check_len) {
-            bytes_skip += (DIM::kOffsetX * DIM::kBPP) / 8;
-            fb.seekg(bytes_skip, ios::beg);
-
-            char *buffer = title.buffer();
-            int buff_off = 0;
-            for (int k = 0; k < title_height; k++) {
-                fb.read(linebuf, bytes_row_title);
+        if (IsSolidLine(line + check_start(), check_len(), DIM::kUlineColor))
+            return i;
+    }
 
-                // Convert the bit-depth. Assumes a 4bpp FB and 8bpp target
-                for (int h = 0; h < bytes_row_title; h++) {
-                    buffer[buff_off++] = 0xf0 & linebuf[h];
-                    buffer[buff_off++] = linebuf[h] << 4;
-                }
+    return -1;
+}
 
-                bytes_skip += bytes_row;
-                fb.seekg(bytes_skip, ios::beg);
-            }
+template <typename DIM >
+BitmapView FrameGrabber<DIM>::CropTitle(size_t offset, int slot)
+{
+    int bytes_row_title = (DIM::kEntryLen * DIM::kBPP) / 8;
 
-            break;
-        }
+    offset += (DIM::kOffsetX * DIM::kBPP) / 8;
+    const unsigned char *src = At(offset, (title_height() - 1) * line_length_ + bytes_row_title);
+    if (!src)
+        return BitmapView();
+    if (DIM::kBPP == 8) {
+        return BitmapView(reinterpret_cast<const char*>(src), DIM::kEntryLen,
+                          title_height(), 8, line_length_);
+    }
 
-        bytes_skip += bytes_entry;
+    // Convert the bit-depth to 8bpp
+    int slots = std::max<int>(DIM::kEntryPerPg, DIM::kEntryPerPgCol);
+    if (!arena_.IsValid())
+        arena_.Reset(DIM::kEntryLen, slots * title_height(), 8);
+    char *buffer = arena_.buffer() + slot * title_height() * DIM::kEntryLen;
+    BitmapView title(buffer, DIM::kEntryLen, title_height(), 8, DIM::kEntryLen);
+    for (int k = 0; k < title_height(); k++) {
+        RowUnpacker<DIM::kBPP>::Unpack(src, buffer, DIM::kEntryLen);
+
+        buffer += DIM::kEntryLen;
+        src += line_length_;
     }
 
-    if (i == DIM::kEntryPerPg)
-        title.SetInvalid();
+    return title;
+}
 
-    delete[] linebuf;
-    fb.close();
+template <typename DIM >
+BitmapView FrameGrabber<DIM>::GrabSelected()
+{
+    size_t first;
+    int entries_page = LoadFrame()? FindLayout(&first): 0;
+    int selected = entries_page? FindSelected(first, entries_page): -1;
+    if (selected < 0)
+        return BitmapView();
 
-    return title;
+    return CropTitle(first + selected * entry_bytes(), 0);
+}
+
+template <typename DIM >
+uint64_t FrameGrabber<DIM>::Fingerprint()
+{
+    size_t first;
+    int entries_page = LoadFrame()? FindLayout(&first): 0;
+    int selected = entries_page? FindSelected(first, entries_page): -1;
+    if (selected < 0)
+        return 0;
+
+    int bytes_row_title = (DIM::kEntryLen * DIM::kBPP) / 8;
+    size_t offset = first + selected * entry_bytes() + (DIM::kOffsetX * DIM::kBPP) / 8;
+    const unsigned char *src = At(offset, (title_height() - 1) * line_length_ + bytes_row_title);
+    if (!src)
+        return 0;
+    BitmapView title(reinterpret_cast<const char*>(src), DIM::kEntryLen, title_height(),
+                     DIM::kBPP, line_length_);
+    uint64_t hash = HashBitmap(title, (uint64_t) entries_page << 32 | (selected + 1));
+    return hash? hash: 1;
+}
+
+template <typename DIM >
+int FrameGrabber<DIM>::GrabAll(std::vector<BitmapView>& out_titles)
+{
+    out_titles.clear();
+
+    size_t first;
+    int entries_page = LoadFrame()? FindLayout(&first): 0;
+    int selected = entries_page? FindSelected(first, entries_page): -1;
+    if (selected < 0)
+        return -1;
+
+    for (int i = 0; i < entries_page; i++) {
+        BitmapView title = CropTitle(first + i * entry_bytes(), i);
+        if (!title.IsValid())
+            break;
+        out_titles.push_back(title);
+    }
+
+    // a page cut short by the end of the frame buffer, which the selection
+    // can't be on anyway
+    if (selected >= (int) out_titles.size()) {
+        out_titles.clear();
+        return -1;
+    }
+
+    return selected;
 }
 
 }; // namespace
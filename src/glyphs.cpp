@@ -0,0 +1,173 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "glyphs.h"
+#include "pixops.h"
+#include "serial.h"
+
+namespace lhack {
+
+using namespace std;
+
+namespace {
+
+const char kGlyphMagic[4] = {'L', 'H', 'G', 'L'};
+const uint32_t kGlyphVersion = 2;
+
+// The most glyphs accepted from a file
+const uint32_t kMaxGlyphs = 4096;
+
+} // anonymous namespace
+
+bool
+GlyphSet::Load(const string& file)
+{
+    *this = GlyphSet();
+
+    ifstream in(file.c_str(), ios::in | ios::binary);
+    if (!in)
+        return false;
+    ostringstream buf;
+    buf << in.rdbuf();
+    string data = buf.str();
+
+    ByteReader reader(data);
+    char magic[4];
+    for (int i = 0; i < 4; i++)
+        magic[i] = reader.Raw<char>();
+    uint32_t version = reader.Raw<uint32_t>();
+    if (memcmp(magic, kGlyphMagic, sizeof(magic)) != 0
+            || version < 1 || version > kGlyphVersion)
+        return false;
+
+    int height = reader.Raw<uint32_t>();
+    int space = reader.Raw<uint32_t>();
+    int letter_gap = (version >= 2)? reader.Raw<uint32_t>(): 0;
+    int word_gap = (version >= 2)? reader.Raw<uint32_t>(): 0;
+    uint32_t nglyphs = reader.Raw<uint32_t>();
+    // the sizes are read as unsigned, so a corrupt one may come out negative
+    if (!reader.ok() || height <= 0 || height > kMaxTitleHeight || space < 0
+            || letter_gap < 0 || word_gap < 0 || nglyphs > kMaxGlyphs)
+        return false;
+    GlyphSet glyphs;
+    for (uint32_t i = 0; reader.ok() && i < nglyphs; i++) {
+        string text = reader.String();
+        inkcol_t cell[kGlyphWidth];
+        for (int x = 0; x < kGlyphWidth; x++)
+            cell[x] = reader.Raw<inkcol_t>();
+        if (reader.ok())
+            glyphs.Add(text, cell);
+    }
+    if (!reader.ok())
+        return false;
+
+    *this = glyphs;
+    height_ = height;
+    space_ = space;
+    set_gaps(letter_gap, word_gap);
+    return true;
+}
+
+bool
+GlyphSet::Save(const string& file) const
+{
+    string data(kGlyphMagic, sizeof(kGlyphMagic));
+    PutRaw(data, kGlyphVersion);
+    PutRaw(data, (uint32_t) height_);
+    PutRaw(data, (uint32_t) space_);
+    PutRaw(data, (uint32_t) letter_gap_);
+    PutRaw(data, (uint32_t) word_gap_);
+    PutRaw(data, (uint32_t) texts_.size());
+    for (size_t i = 0; i < texts_.size(); i++) {
+        PutString(data, texts_[i]);
+        for (int x = 0; x < kGlyphWidth; x++)
+            PutRaw(data, cell(i)[x]);
+    }
+
+    ofstream out(file.c_str(), ios::out | ios::binary | ios::trunc);
+    out.write(data.data(), data.size());
+    out.close();
+    return !out.fail();
+}
+
+uint64_t
+GlyphSet::Hash() const
+{
+    string data;
+    PutRaw(data, (uint32_t) height_);
+    PutRaw(data, (uint32_t) letter_gap_);
+    PutRaw(data, (uint32_t) word_gap_);
+    for (size_t i = 0; i < texts_.size(); i++)
+        PutString(data, texts_[i]);
+    for (size_t i = 0; i < cells_.size(); i++)
+        PutRaw(data, cells_[i]);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < data.size(); i++)
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+void
+GlyphSet::Add(const string& text, const inkcol_t *cell)
+{
+    texts_.push_back(text);
+    cells_.insert(cells_.end(), cell, cell + kGlyphWidth);
+    unsigned ink = 0;
+    for (int x = 0; x < kGlyphWidth; x++)
+        ink += scalar::PopCount(cell[x]);
+    inks_.push_back(ink);
+    widths_.push_back(GlyphCellWidth(cell));
+}
+
+int
+GlyphSet::Classify(const inkcol_t *cell) const
+{
+    unsigned ink = 0;
+    for (int x = 0; x < kGlyphWidth; x++)
+        ink += scalar::PopCount(cell[x]);
+    int width = GlyphCellWidth(cell);
+
+    int best = -1;
+    unsigned best_distance = ~0u, other_distance = ~0u;
+    for (size_t i = 0; i < texts_.size(); i++) {
+        // a glyph that much wider or narrower is too far off anyway
+        if (abs(widths_[i] - width) > 2)
+            continue;
+        unsigned distance = HammingDistance(cell, &cells_[i * kGlyphWidth], kGlyphWidth);
+        if (distance < best_distance) {
+            if (best >= 0 && texts_[best] != texts_[i])
+                other_distance = best_distance;
+            best = i;
+            best_distance = distance;
+        }
+        else if (distance < other_distance && texts_[best] != texts_[i]) {
+            other_distance = distance;
+        }
+    }
+
+    if (best < 0 || best_distance * 100 > kGlyphMismatch * (ink + inks_[best])
+            || other_distance <= best_distance)
+        return -1;
+    return best;
+}
+
+}; // namespace lhack
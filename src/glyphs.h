@@ -0,0 +1,204 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef GLYPHS_H
+#define GLYPHS_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#include "framegrabber.h"
+#include "titleprep.h"
+
+namespace lhack {
+
+using namespace std;
+
+// The widest glyph, in columns. A glyph is kept as a cell of this many
+// inkcol_t, left-aligned and padded with empty columns.
+const int kGlyphWidth = 32;
+
+// How many of the pixels of a glyph and a template (together) may differ
+// for the glyph to be taken for the template, in percent
+const unsigned kGlyphMismatch = 10;
+
+/**
+ * The glyphs of the font the shell draws the titles with, so that the
+ * titles can be read without Tesseract (see RecognizeGlyphs()). A glyph
+ * is a run of columns with ink, in the rows of the title region - the
+ * font is always drawn at the same size and height, so the same letter
+ * always gives the same bits. Letters which touch make a single glyph,
+ * with a longer text.
+ *
+ * The set is made by lhglyphs from labelled frame buffer dumps and saved
+ * (in the host's byte order, see serial.h) as
+ *
+ *   char magic[4], uint32_t version
+ *   uint32_t height, uint32_t space, uint32_t letter_gap, uint32_t word_gap
+ *   uint32_t nglyphs, {string text, inkcol_t cell[kGlyphWidth]}[nglyphs]
+ *
+ * The gaps are only in the files of version 2 on (0 in the older ones).
+ */
+class GlyphSet
+{
+public:
+    GlyphSet(): height_(0), space_(0), letter_gap_(0), word_gap_(0) {}
+
+    bool Load(const string& file);
+    bool Save(const string& file) const;
+
+    bool empty() const { return texts_.empty(); }
+    size_t size() const { return texts_.size(); }
+
+    // The rows of the title region the glyphs were cut from
+    int height() const { return height_; }
+    void set_height(int height) { height_ = height; }
+
+    // The narrowest gap between two words, in columns
+    int space() const { return space_; }
+    void set_space(int space) { space_ = space; }
+
+    // The typical gaps between two letters of a word and between two
+    // words, for drawing a text with the glyphs (see TitleRenderer)
+    int letter_gap() const { return letter_gap_; }
+    int word_gap() const { return word_gap_; }
+    void set_gaps(int letter_gap, int word_gap)
+    {
+        letter_gap_ = letter_gap;
+        word_gap_ = word_gap;
+    }
+
+    bool CanRender() const { return !empty() && word_gap_ > 0; }
+
+    // Changes with any of the glyphs, texts or gaps
+    uint64_t Hash() const;
+
+    const string& text(int glyph) const { return texts_[glyph]; }
+    const inkcol_t* cell(int glyph) const { return &cells_[glyph * kGlyphWidth]; }
+
+    void Add(const string& text, const inkcol_t *cell);
+
+    /**
+     * Finds the glyph whose bits differ the least from 'cell'. Returns -1
+     * if even that one differs by more than kGlyphMismatch, or if a glyph
+     * with another text is as close.
+     */
+    int Classify(const inkcol_t *cell) const;
+
+private:
+    int height_;
+    int space_;
+    int letter_gap_;
+    int word_gap_;
+    vector<string> texts_;
+    vector<inkcol_t> cells_;    // kGlyphWidth per glyph
+    vector<unsigned> inks_;     // the pixels of each glyph
+    vector<int> widths_;        // ... and its columns
+};
+
+// The width of the glyph in 'cell'
+inline int
+GlyphCellWidth(const inkcol_t *cell)
+{
+    int width = kGlyphWidth;
+    while (width > 0 && !cell[width - 1])
+        width--;
+    return width;
+}
+
+// Puts the columns [x0, x1) into a cell; false if they don't fit
+inline bool
+MakeGlyphCell(const inkcol_t *columns, int x0, int x1, inkcol_t *cell)
+{
+    if (x1 - x0 > kGlyphWidth)
+        return false;
+    memset(cell, 0, kGlyphWidth * sizeof(inkcol_t));
+    memcpy(cell, columns + x0, (x1 - x0) * sizeof(inkcol_t));
+    return true;
+}
+
+// Finds the glyph starting at or after column 'x' of [x, end): its
+// columns are [*x0, *x1). Returns false if there is none.
+inline bool
+NextGlyph(const inkcol_t *columns, int x, int end, int *x0, int *x1)
+{
+    while (x < end && !columns[x])
+        x++;
+    if (x == end)
+        return false;
+    *x0 = x;
+    while (x < end && columns[x])
+        x++;
+    *x1 = x;
+    return true;
+}
+
+/**
+ * Reads the title in 'title' (as grabbed, see FrameGrabber) glyph by glyph
+ * with 'glyphs'. Only the title's columns are read (see
+ * FindTitleColumns()), and a gap of at least glyphs.space() columns is a
+ * space. Returns false if the set is for another title height, or any of
+ * the glyphs isn't recognized with confidence (see GlyphSet::Classify()),
+ * in which case the title is left to Tesseract.
+ */
+template <typename DIM>
+bool
+RecognizeGlyphs(const GlyphSet& glyphs, const BitmapView& title, string *out_text)
+{
+    out_text->clear();
+    int width = title.width();
+    if (glyphs.empty() || !title.IsValid() || title.bpp() != 8
+            || title.height() != glyphs.height() || width > DIM::kEntryLen)
+        return false;
+
+    inkcol_t columns[DIM::kEntryLen];
+    int left, right;
+    InkColumns(title, columns);
+    if (!FindTitleColumns<DIM>(columns, width, &left, &right))
+        return false;
+
+    inkcol_t cell[kGlyphWidth];
+    int x0, x1, prev_end = left;
+    while (NextGlyph(columns, prev_end, right, &x0, &x1)) {
+        if (!MakeGlyphCell(columns, x0, x1, cell))
+            return false;
+        int glyph = glyphs.Classify(cell);
+        if (glyph < 0)
+            return false;
+        if (!out_text->empty() && x0 - prev_end >= glyphs.space())
+            out_text->push_back(' ');
+        out_text->append(glyphs.text(glyph));
+        prev_end = x1;
+    }
+    return true;
+}
+
+// Where the glyphs of a device are looked for: "lhack-<width>x<height>.glyphs"
+// in 'dir' (the model directory)
+template <typename DIM>
+string
+GlyphFile(const string& dir)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/lhack-%dx%d.glyphs", DIM::kScreenWidth, DIM::kScreenHeight);
+    return dir + name;
+}
+
+};
+
+#endif // GLYPHS_H
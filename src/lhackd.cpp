@@ -0,0 +1,219 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+/**
+ * lhackd - keeps Tesseract initialized and the file indices open, and
+ * answers the requests of lhack over a Unix domain socket.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "pipeline.h"
+#include "screenwatch.h"
+#include "daemon.h"
+
+namespace {
+
+volatile sig_atomic_t g_quit = 0;
+
+void
+OnSignal(int)
+{
+    g_quit = 1;
+}
+
+// Requests taking longer than that to arrive are dropped, so that
+// a stuck client can't block the daemon
+const int kRecvTimeoutSec = 2;
+
+}
+
+int main(int argc, char **argv)
+{
+    using namespace lhack;
+
+    const char *sockpath = kDaemonSocket;
+    SearchOptions sopts;
+    OcrProfile profile = kOcrDefault;
+    sopts.index_file = string(kShareDir) + "/lhack.idx";
+    sopts.watch = true; // the libraries stay open, so they follow the changes
+    bool page_mode = false;
+    bool render_match = false;
+    int watch_ms = 0;
+    string memo_file = string(kShareDir) + "/lhack.memo";
+
+    static const struct option long_opts[] = {
+        {"socket", required_argument, 0, 's'},
+        {"index", required_argument, 0, 'i'},
+        {"fast", no_argument, 0, 'f'},
+        {"render", no_argument, 0, 'r'},
+        {"watch-screen", required_argument, 0, 'w'},
+        {"threads", required_argument, 0, 'j'},
+        {"page", no_argument, 0, 'p'},
+        {"memo", required_argument, 0, 'm'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:i:frj:pm:w:", long_opts, 0)) != -1) {
+        switch (opt) {
+        case 's':
+            sockpath = optarg;
+            break;
+        case 'f':
+            profile = kOcrFast;
+            break;
+        case 'r':
+            render_match = true;
+            break;
+        case 'w':
+            watch_ms = atoi(optarg);
+            break;
+        case 'j':
+            sopts.threads = atoi(optarg);
+            break;
+        case 'i':
+            sopts.index_file = optarg;
+            break;
+        case 'p':
+            page_mode = true;
+            break;
+        case 'm':
+            memo_file = optarg;
+            break;
+        default:
+            std::cerr << "Syntax: lhackd [-s|--socket path] [-i|--index file] [-f|--fast] [-r|--render] [-j|--threads n] "
+                         "[-p|--page] [-m|--memo file] [-w|--watch-screen ms]" << std::endl;
+            return 2;
+        }
+    }
+
+    const char *fbdev = "/dev/fb/0";
+#if defined(LHACK_DEVEL_HOST)
+    if (optind >= argc) {
+        std::cerr << "You must provide a grayscale image as the final arg. to be used instead of fbdev\n";
+        return 3;
+    }
+    fbdev = argv[optind];
+#endif
+
+    // The device is told by the frame buffer's geometry. The page mode
+    // recognizes a whole page at a time, with one OCR engine per CPU.
+    ResolverBase *resolver = NewResolver(fbdev, kShareDir, "eng", profile,
+                                         page_mode? (sopts.threads? sopts.threads: OnlineCpus()): 1);
+    resolver->SetPageMode(page_mode);
+    resolver->SetMemo(memo_file);
+    resolver->SetRenderMatch(render_match);
+    resolver->Warmup();
+
+    int lfd = ListenDaemon(sockpath);
+    if (lfd < 0) {
+        std::cerr << "lhackd: can't listen on " << sockpath << std::endl;
+        delete resolver;
+        return 1;
+    }
+
+    // With -w the selection is resolved as soon as it settles, so that
+    // the request finds the answer ready
+    ScreenWatch watch(resolver, watch_ms);
+    if (watch_ms > 0 && !watch.Start())
+        std::cerr << "lhackd: can't start the screen watch" << std::endl;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSignal;
+    sigaction(SIGTERM, &sa, 0);
+    sigaction(SIGINT, &sa, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!g_quit) {
+        int cfd = accept(lfd, 0, 0);
+        if (cfd < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        struct timeval tv = {kRecvTimeoutSec, 0};
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        message_t request;
+        if (!RecvMessage(cfd, request) || request.size() < 5
+                || request[0] != kCmdResolve) {
+            close(cfd);
+            continue;
+        }
+
+        bool want_stats = (request.size() > 5 && request[5] == "1");
+        size_t k = (request.size() > 6)? atoi(request[6].c_str()): 1;
+        k = max<size_t>(1, min<size_t>(k, kMaxResults));
+        Stats stats;
+        message_t reply((want_stats || k > 1)? 4: 3);
+        vector<string> filters;
+        SplitFilters(request[2].c_str(), filters);
+        int status = kResolveNoSelection;
+        vector<SearchResult> results;
+        if (!filters.empty()) {
+            SearchOptions ropts = sopts;
+            ropts.rebuild = (request[4] == "1");
+            if (request.size() > 7 && !ParseSimMeasure(request[7], &ropts.measure))
+                ropts.measure = kSimOverlap;
+            status = watch.ResolveTopK(request[1], filters, atof(request[3].c_str()),
+                                       ropts, k, &results, &reply[2],
+                                       want_stats? &stats: 0);
+        }
+        if (!results.empty())
+            reply[1] = results[0].path;
+        if (want_stats)
+            reply[3] = stats.ToJson();
+        char code[16];
+        snprintf(code, sizeof(code), "%d", status);
+        reply[0] = code;
+        // the worst results are left out if the paths don't all fit
+        size_t size = MessageSize(reply);
+        for (size_t i = 0; k > 1 && i < results.size(); i++) {
+            char overlap[16], similarity[32];
+            snprintf(overlap, sizeof(overlap), "%u", results[i].overlap);
+            snprintf(similarity, sizeof(similarity), "%.4f", results[i].similarity);
+            size += results[i].path.size() + strlen(overlap) + strlen(similarity) + 3;
+            if (size > kMaxMessageSize)
+                break;
+            reply.push_back(results[i].path);
+            reply.push_back(overlap);
+            reply.push_back(similarity);
+        }
+        SendMessage(cfd, reply);
+        close(cfd);
+    }
+
+    close(lfd);
+    unlink(sockpath);
+    watch.Stop();
+    delete resolver; // saves the memo
+
+    return 0;
+}
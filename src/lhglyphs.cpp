@@ -0,0 +1,344 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+/**
+ * lhglyphs - makes the glyph set RecognizeGlyphs() reads the titles with,
+ * out of frame buffer dumps whose selected titles are known:
+ *
+ *   lhglyphs labels out.glyphs
+ *
+ * Each line of 'labels' is a dump, a tab and the text of the title
+ * selected on it. All the dumps are of the same device, which is told by
+ * their size (see KnownDevices). The title's glyphs are paired with the
+ * letters of the text word by word. A word which is a single glyph is
+ * kept whole; any other word whose glyphs and letters don't pair up
+ * (letters which touch) is skipped. When the same glyph is labelled
+ * differently, the most frequent text wins. The most usual gaps between
+ * the letters and between the words are kept too, for drawing file names
+ * with the glyphs (see TitleRenderer).
+ *
+ * The set is then checked by reading the titles back with it. Copy it to
+ * the model directory as lhack-<width>x<height>.glyphs (see GlyphFile()).
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#include "devicedefs.h"
+#include "framegrabber.h"
+#include "glyphs.h"
+
+namespace {
+
+using namespace std;
+using namespace lhack;
+
+struct Label {
+    string dump;
+    string text;
+};
+
+// Splits 'word' into its (UTF-8) characters
+void
+SplitChars(const string& word, vector<string>& out_chars)
+{
+    out_chars.clear();
+    for (size_t i = 0; i < word.size(); i++) {
+        if ((word[i] & 0xc0) != 0x80 || out_chars.empty())
+            out_chars.push_back(string());
+        out_chars.back().push_back(word[i]);
+    }
+}
+
+void
+SplitWords(const string& text, vector<string>& out_words)
+{
+    out_words.clear();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find(' ', pos);
+        if (end == string::npos)
+            end = text.size();
+        if (end > pos)
+            out_words.push_back(text.substr(pos, end - pos));
+        pos = end + 1;
+    }
+}
+
+// The glyphs of a title: their columns [x0, x1)
+struct Glyph {
+    int x0, x1;
+};
+
+/**
+ * Collects the glyphs of the titles of the device 'DIM'
+ */
+template <typename DIM>
+class GlyphCollector
+{
+public:
+    GlyphCollector(): height_(0), max_inner_gap_(0), min_word_gap_(DIM::kEntryLen),
+                      titles_(0), words_(0), skipped_(0) {}
+
+    // Adds the glyphs of the title selected on 'label.dump'
+    bool Add(const Label& label)
+    {
+        FrameGrabber<DIM> grabber(label.dump.c_str());
+        BitmapView title = grabber.GrabSelected();
+        if (!title.IsValid()) {
+            cerr << label.dump << ": no title selected" << endl;
+            return false;
+        }
+        inkcol_t columns[DIM::kEntryLen];
+        int left, right;
+        InkColumns(title, columns);
+        if (!FindTitleColumns<DIM>(columns, title.width(), &left, &right)) {
+            cerr << label.dump << ": the selected title is empty" << endl;
+            return false;
+        }
+        height_ = title.height();
+
+        vector<Glyph> glyphs;
+        Glyph glyph;
+        for (int x = left; NextGlyph(columns, x, right, &glyph.x0, &glyph.x1); x = glyph.x1)
+            glyphs.push_back(glyph);
+
+        // The words are told apart by the widest gaps
+        vector<string> words;
+        SplitWords(label.text, words);
+        if (words.empty() || glyphs.size() < words.size()) {
+            cerr << label.dump << ": " << glyphs.size() << " glyphs for \""
+                 << label.text << "\"" << endl;
+            return false;
+        }
+        vector<pair<int, size_t> > gaps;
+        for (size_t g = 1; g < glyphs.size(); g++)
+            gaps.push_back(make_pair(glyphs[g].x0 - glyphs[g - 1].x1, g));
+        sort(gaps.begin(), gaps.end());
+        vector<size_t> starts;
+        starts.push_back(0);
+        for (size_t w = 1; w < words.size(); w++) {
+            starts.push_back(gaps[gaps.size() - w].second);
+            min_word_gap_ = min(min_word_gap_, gaps[gaps.size() - w].first);
+            word_gaps_.push_back(gaps[gaps.size() - w].first);
+        }
+        if (gaps.size() >= words.size())
+            max_inner_gap_ = max(max_inner_gap_, gaps[gaps.size() - words.size()].first);
+        for (size_t g = 0; g + words.size() <= gaps.size(); g++)
+            letter_gaps_.push_back(gaps[g].first);
+        sort(starts.begin(), starts.end());
+        starts.push_back(glyphs.size());
+
+        titles_++;
+        vector<string> chars;
+        inkcol_t cell[kGlyphWidth];
+        for (size_t w = 0; w < words.size(); w++) {
+            SplitChars(words[w], chars);
+            size_t first = starts[w], count = starts[w + 1] - first;
+            words_++;
+            if (count == chars.size()) {
+                for (size_t c = 0; c < count; c++) {
+                    if (MakeGlyphCell(columns, glyphs[first + c].x0, glyphs[first + c].x1, cell))
+                        Count(cell, chars[c]);
+                }
+            }
+            else if (count == 1) {
+                // a whole word, or one which touches throughout
+                if (MakeGlyphCell(columns, glyphs[first].x0, glyphs[first].x1, cell))
+                    Count(cell, words[w]);
+            }
+            else {
+                skipped_++;
+            }
+        }
+        return true;
+    }
+
+    // Makes the set out of the glyphs collected so far
+    void Build(GlyphSet& out) const
+    {
+        out = GlyphSet();
+        out.set_height(height_);
+        // half way between the widest gap within a word and the narrowest
+        // between two of them
+        out.set_space(min_word_gap_ > max_inner_gap_
+                      ? (max_inner_gap_ + min_word_gap_ + 1) / 2
+                      : max_inner_gap_ + 1);
+        out.set_gaps(Median(letter_gaps_), Median(word_gaps_));
+        for (counts_t::const_iterator it = counts_.begin(); it != counts_.end(); it++) {
+            const map<string, unsigned>& texts = it->second;
+            map<string, unsigned>::const_iterator best = texts.begin();
+            for (map<string, unsigned>::const_iterator t = texts.begin(); t != texts.end(); t++) {
+                if (t->second > best->second)
+                    best = t;
+            }
+            out.Add(best->first, reinterpret_cast<const inkcol_t*>(it->first.data()));
+        }
+    }
+
+    void PrintSummary(const GlyphSet& glyphs) const
+    {
+        cout << titles_ << " titles, " << words_ << " words (" << skipped_
+             << " skipped), " << glyphs.size() << " glyphs, space: " << glyphs.space()
+             << " columns, gaps: " << glyphs.letter_gap() << "/" << glyphs.word_gap() << endl;
+        if (word_gaps_.empty())
+            cout << "warning: no title of several words; file names can't be drawn" << endl;
+        if (min_word_gap_ <= max_inner_gap_) {
+            cout << "warning: a gap within a word (" << max_inner_gap_
+                 << ") is as wide as one between two words (" << min_word_gap_ << ")" << endl;
+        }
+    }
+
+private:
+    typedef map<string, map<string, unsigned> > counts_t;
+
+    static int Median(vector<int> values)
+    {
+        if (values.empty())
+            return 0;
+        nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        return values[values.size() / 2];
+    }
+
+    // Counts 'text' for the glyph 'cell'
+    void Count(const inkcol_t *cell, const string& text)
+    {
+        string key(reinterpret_cast<const char*>(cell), kGlyphWidth * sizeof(inkcol_t));
+        counts_[key][text]++;
+    }
+
+    counts_t counts_;   // the cells' bytes -> their texts, and how often
+    int height_;
+    int max_inner_gap_;
+    int min_word_gap_;
+    vector<int> letter_gaps_;
+    vector<int> word_gaps_;
+    unsigned titles_, words_, skipped_;
+};
+
+// Reads the titles back with 'glyphs'; returns how many came out right
+template <typename DIM>
+unsigned
+CheckGlyphs(const GlyphSet& glyphs, const vector<Label>& labels)
+{
+    unsigned right = 0;
+    string text;
+    for (size_t i = 0; i < labels.size(); i++) {
+        FrameGrabber<DIM> grabber(labels[i].dump.c_str());
+        vector<string> words;
+        SplitWords(labels[i].text, words);
+        string expected;
+        for (size_t w = 0; w < words.size(); w++)
+            expected += (w? " ": "") + words[w];
+
+        if (!RecognizeGlyphs<DIM>(glyphs, grabber.GrabSelected(), &text))
+            cout << labels[i].dump << ": not recognized" << endl;
+        else if (text != expected)
+            cout << labels[i].dump << ": \"" << text << "\"" << endl;
+        else
+            right++;
+    }
+    return right;
+}
+
+template <typename DIM>
+int
+MakeGlyphs(const vector<Label>& labels, const string& outfile)
+{
+    GlyphCollector<DIM> collector;
+    for (size_t i = 0; i < labels.size(); i++)
+        collector.Add(labels[i]);
+
+    GlyphSet glyphs;
+    collector.Build(glyphs);
+    collector.PrintSummary(glyphs);
+    if (glyphs.empty())
+        return 1;
+    if (!glyphs.Save(outfile)) {
+        cerr << "Can't write " << outfile << endl;
+        return 1;
+    }
+
+    unsigned right = CheckGlyphs<DIM>(glyphs, labels);
+    cout << right << " of " << labels.size() << " titles read back right; copy "
+         << outfile << " to " << GlyphFile<DIM>("<modeldir>") << endl;
+    return 0;
+}
+
+// Runs MakeGlyphs() for the first device of 'List' whose frame is 'size' bytes
+template <typename List>
+struct DeviceDispatch {
+    static int Run(off_t size, const vector<Label>& labels, const string& outfile)
+    {
+        typedef typename List::Head DIM;
+        if (size == (off_t) DIM::kScreenWidth * DIM::kScreenHeight * DIM::kBPP / 8)
+            return MakeGlyphs<DIM>(labels, outfile);
+        return DeviceDispatch<typename List::Tail>::Run(size, labels, outfile);
+    }
+};
+
+template <>
+struct DeviceDispatch<NoDevice> {
+    static int Run(off_t size, const vector<Label>&, const string&)
+    {
+        cerr << "No known device has a frame of " << size << " bytes" << endl;
+        return 1;
+    }
+};
+
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        cerr << "Syntax: lhglyphs labels out.glyphs" << endl;
+        return 2;
+    }
+
+    ifstream in(argv[1]);
+    if (!in) {
+        cerr << "Can't read " << argv[1] << endl;
+        return 2;
+    }
+    vector<Label> labels;
+    string line;
+    while (getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (tab == string::npos || tab == 0)
+            continue;
+        Label label;
+        label.dump = line.substr(0, tab);
+        label.text = line.substr(tab + 1);
+        labels.push_back(label);
+    }
+    if (labels.empty()) {
+        cerr << "No labelled dumps in " << argv[1] << endl;
+        return 2;
+    }
+
+    struct stat st;
+    if (stat(labels[0].dump.c_str(), &st) < 0) {
+        cerr << "Can't read " << labels[0].dump << endl;
+        return 2;
+    }
+    return DeviceDispatch<KnownDevices>::Run(st.st_size, labels, argv[2]);
+}
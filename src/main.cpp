@@ -18,16 +18,190 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <climits>
 
-#include "framegrabber.h"
-#include "ocr.h"
-#include "filematch.h"
+#include <getopt.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "daemon.h"
+
+namespace {
+
+/**
+ * Forwards the request to lhackd, if one is running. Returns the exit
+ * status, or -1 if the request should be served in-process.
+ */
+int
+ResolveRemote(const char *sockpath, char **args, bool rebuild, size_t k,
+              lhack::SimMeasure measure, std::vector<lhack::SearchResult> *out_results, std::string *out_stats)
+{
+    using namespace lhack;
+
+    int fd = ConnectDaemon(sockpath);
+    if (fd < 0)
+        return -1;
+
+    // The daemon has a working directory of its own
+    char root[PATH_MAX];
+    if (!realpath(args[1], root)) {
+        close(fd);
+        return -1;
+    }
+
+    message_t request, reply;
+    request.push_back(kCmdResolve);
+    request.push_back(root);
+    request.push_back(args[2]);
+    request.push_back(args[3]);
+    request.push_back(rebuild? "1": "0");
+    bool send_measure = (measure != kSimOverlap);
+    if (out_stats || k > 1 || send_measure)
+        request.push_back(out_stats? "1": "0");
+    if (k > 1 || send_measure) {
+        char num[16];
+        snprintf(num, sizeof(num), "%u", (unsigned) k);
+        request.push_back(num);
+    }
+    if (send_measure)
+        request.push_back(kSimMeasureNames[measure]);
+    bool ok = SendMessage(fd, request) && RecvMessage(fd, reply) && reply.size() >= 3;
+    close(fd);
+    if (!ok)
+        return -1;
+
+#if defined(LHACK_DEVEL_HOST)
+    std::cout << "OCR result: " << reply[2] << std::endl;
+#endif
+    out_results->clear();
+    if (k > 1) {
+        for (size_t i = 4; i + 2 < reply.size(); i += 3) {
+            SearchResult result;
+            result.path = reply[i];
+            result.overlap = atoi(reply[i + 1].c_str());
+            result.similarity = atof(reply[i + 2].c_str());
+            out_results->push_back(result);
+        }
+    }
+    else if (!reply[1].empty()) {
+        SearchResult result;
+        result.path = reply[1];
+        result.overlap = 0;
+        result.similarity = 0;
+        out_results->push_back(result);
+    }
+    if (out_stats && reply.size() > 3)
+        *out_stats = reply[3];
+    int status = atoi(reply[0].c_str());
+    return (status == kResolveOk && out_results->empty())? kResolveNoMatch: status;
+}
+
+// Emits the statistics as a line of JSON to 'file' ("" - stderr)
+void
+WriteStats(const std::string& file, const std::string& json)
+{
+    if (file.empty()) {
+        std::cerr << json << std::endl;
+        return;
+    }
+    std::ofstream out(file.c_str(), std::ios::out | std::ios::app);
+    out << json << std::endl;
+}
+
+}
 
 int main(int argc, char **argv)
 {
     using namespace lhack;
+
+    uint64_t start_us = NowUs();
+
+    SearchOptions sopts;
+    OcrProfile profile = kOcrDefault;
+    sopts.index_file = string(kShareDir) + "/lhack.idx";
+    string memo_file = string(kShareDir) + "/lhack.memo";
+    const char *sockpath = kDaemonSocket;
+    bool use_daemon = true;
+    bool local_opts = false;    // set up in lhackd when it starts, not per request
+    bool want_stats = false;
+    string stats_file;
+    size_t topk = 1;
+    bool render_match = false;
+
+    static const struct option long_opts[] = {
+        {"index", required_argument, 0, 'i'},
+        {"rebuild", no_argument, 0, 'R'},
+        {"socket", required_argument, 0, 's'},
+        {"no-daemon", no_argument, 0, 'n'},
+        {"fast", no_argument, 0, 'f'},
+        {"render", no_argument, 0, 'r'},
+        {"threads", required_argument, 0, 'j'},
+        {"stats", optional_argument, 0, 'S'},
+        {"top", required_argument, 0, 'k'},
+        {"memo", required_argument, 0, 'm'},
+        {"measure", required_argument, 0, 'M'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:Rs:nfrj:S::k:m:M:", long_opts, 0)) != -1) {
+        switch (opt) {
+        case 'f':
+            profile = kOcrFast;
+            local_opts = true;
+            break;
+        case 'r':
+            render_match = true;
+            local_opts = true;
+            break;
+        case 'j':
+            sopts.threads = atoi(optarg);
+            local_opts = true;
+            break;
+        case 'i':
+            sopts.index_file = optarg;
+            local_opts = true;
+            break;
+        case 'R':
+            sopts.rebuild = true;
+            break;
+        case 's':
+            sockpath = optarg;
+            break;
+        case 'n':
+            use_daemon = false;
+            break;
+        case 'S':
+            want_stats = true;
+            stats_file = optarg? optarg: "";
+            break;
+        case 'k':
+            topk = std::max(1, atoi(optarg));
+            break;
+        case 'm':
+            memo_file = optarg;
+            local_opts = true;
+            break;
+        case 'M':
+            if (!ParseSimMeasure(optarg, &sopts.measure)) {
+                std::cerr << "Unknown similarity measure: " << optarg << std::endl;
+                return 2;
+            }
+            break;
+        default:
+            return 2;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc < 4) {
-        std::cerr << "Syntax: lhack rootdir comma-sep-filters similarity-coeff" << std::endl;
+        std::cerr << "Syntax: lhack [-R|--rebuild] [-i|--index file] [-s|--socket path] "
+                     "[-n|--no-daemon] [-f|--fast] [-r|--render] [-j|--threads n] [-S|--stats[=file]] [-k|--top n] "
+                     "[-m|--memo file] [-M|--measure overlap|cosine|dice|jaccard] "
+                     "rootdir comma-sep-filters similarity-coeff" << std::endl;
         return 2;
     }
 
@@ -41,66 +215,60 @@ int main(int argc, char **argv)
     std::cout << "FB device: " << fbdev << std::endl;
 #endif
 
-#if defined(LHACK_K3)
-    FrameGrabber<K3Dimensions> fgrab(fbdev);
-#else
-    FrameGrabber<KDXDimensions> fgrab(fbdev);
-#endif
-    Bitmap image = fgrab.GrabSelected();
-    if (!image.IsValid())
+    std::vector<std::string> filters;
+    SplitFilters(argv[2], filters);
+    if (filters.empty())
         return 2;
 
-#ifdef LHACK_DEBUG_GRABBER
-    if (image.IsValid()) {
-        char dmpname[80];
-        snprintf(dmpname, 80, "titledump-%dx%d.gray", image.width(), image.height());
-        std::ofstream bmdump(dmpname);
-        bmdump.write(image.buffer(), image.height()*image.width());
-        bmdump.close();
+    std::vector<SearchResult> results;
+    Stats stats;
+    Stats *pstats = want_stats? &stats: 0;
+    string daemon_stats;
+    int status = -1;
+    ResolverBase *resolver = 0;
+    // The daemon would serve the request with its own settings of these
+    if (use_daemon && !local_opts) {
+        StageTimer timer(pstats, kStageDaemon);
+        status = ResolveRemote(sockpath, argv, sopts.rebuild, topk, sopts.measure, &results,
+                               want_stats? &daemon_stats: 0);
     }
-#endif
-
-#if defined(LHACK_DEVEL_HOST)
-    #if defined(LHACK_K3)
-    Recognizer<K3Dimensions> ocr("/mnt/x86/share", "eng");
-    #else
-    Recognizer<KDXDimensions> ocr("/mnt/x86/share", "eng");
-    #endif
-#else
-    #if defined(LHACK_K3)
-    Recognizer<K3Dimensions> ocr("/mnt/us/launchpad/share", "eng");
-    #else
-    Recognizer<KDXDimensions> ocr("/mnt/us/launchpad/share", "eng");
-    #endif
-#endif
-    string ocr_result = ocr.Recognize(image);
+    if (status < 0) {
+        string ocr_result;
+        uint64_t init_start = NowUs();
+        resolver = NewResolver(fbdev, kShareDir, "eng", profile);
+        resolver->SetMemo(memo_file);
+        resolver->SetRenderMatch(render_match);
+        stats.stage_us[kStageInit] += NowUs() - init_start;
+        status = resolver->ResolveTopK(argv[1], filters, atof(argv[3]), sopts,
+                                       topk, &results, &ocr_result, pstats);
 #if defined(LHACK_DEVEL_HOST)
-    std::cout << "OCR result: " << ocr_result << std::endl;
+        std::cout << "OCR result: " << ocr_result << std::endl;
 #endif
-
-    std::vector<std::string> filters;
-    char* fbegin = argv[2];
-    char* fend = fbegin;
-    while (*fend) {
-        if (*fend == ',') {
-            filters.push_back(string(fbegin, fend));
-            fbegin = ++fend;
-        }
-        else {
-            ++ fend;
-        }
     }
-    if (fend > fbegin)
-        filters.push_back(string(fbegin, fend));
-
-    if (filters.empty())
-        return 2;
 
-    string match = Search(argv[1], filters, ocr_result, atof(argv[3]));
-    if (match.empty())
-        return 3;
+    if (want_stats) {
+        char extra[64];
+        snprintf(extra, sizeof(extra), "{\"status\":%d,\"total_us\":%llu,", status,
+                 (unsigned long long) (NowUs() - start_us));
+        WriteStats(stats_file, extra + stats.ToJson(daemon_stats).substr(1));
+    }
 
-    std::cout << match << std::endl;
+    // With --top the results are ranked, one per line:
+    // similarity <tab> overlap <tab> path
+    if (status == kResolveOk && topk == 1 && !results.empty()) {
+        std::cout << results[0].path << std::endl;
+    }
+    else if (status == kResolveOk) {
+        for (size_t i = 0; i < results.size(); i++) {
+            printf("%.4f\t%u\t%s\n", results[i].similarity, results[i].overlap,
+                   results[i].path.c_str());
+        }
+    }
 
-    return 0;
+    // A refresh of the library the lookup turned out not to need may still
+    // be running (see Resolver). The result is flushed first, though the
+    // exit has to wait for it, so that the index is saved whole.
+    fflush(stdout);
+    delete resolver;
+    return status;
 }
@@ -0,0 +1,181 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+
+#include "memo.h"
+#include "serial.h"
+
+namespace lhack {
+
+using namespace std;
+
+namespace {
+
+const char kMemoMagic[4] = {'L', 'H', 'M', 'C'};
+const uint32_t kMemoVersion = 1;
+
+} // anonymous namespace
+
+MemoCache::MemoCache(size_t capacity):
+    dirty_(false), titles_(capacity), results_(capacity)
+{
+}
+
+string
+MemoCache::ResultKey(const string& index_key, float alpha, const string& ocr)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\n%g\n", alpha);
+    return index_key + buf + ocr;
+}
+
+bool
+MemoCache::Load(const string& file)
+{
+    file_ = file;
+    dirty_ = false;
+    titles_.Clear();
+    results_.Clear();
+
+    ifstream in(file.c_str(), ios::in | ios::binary);
+    if (!in)
+        return false;
+    ostringstream buf;
+    buf << in.rdbuf();
+    string data = buf.str();
+
+    ByteReader reader(data);
+    char magic[4];
+    for (int i = 0; i < 4; i++)
+        magic[i] = reader.Raw<char>();
+    if (memcmp(magic, kMemoMagic, sizeof(magic)) != 0
+            || reader.Raw<uint32_t>() != kMemoVersion)
+        return false;
+
+    // The counts are checked against the smallest size of their entries
+    // before anything is allocated for them. The entries are saved from
+    // the most recently used, so they are put back in the reverse order.
+    uint32_t ntitles = reader.Raw<uint32_t>();
+    if (!reader.ok() || ntitles > reader.left() / (sizeof(uint64_t) + sizeof(uint32_t)))
+        return false;
+    vector<pair<uint64_t, string> > titles(ntitles);
+    for (size_t i = 0; reader.ok() && i < titles.size(); i++) {
+        titles[i].first = reader.Raw<uint64_t>();
+        titles[i].second = reader.String();
+    }
+    uint32_t nresults = reader.ok()? reader.Raw<uint32_t>(): 0;
+    if (!reader.ok() || nresults > reader.left() / (4 * sizeof(uint32_t)))
+        return false;
+    vector<pair<string, MemoResult> > results(nresults);
+    for (size_t i = 0; reader.ok() && i < results.size(); i++) {
+        results[i].first = reader.String();
+        results[i].second.path = reader.String();
+        results[i].second.overlap = reader.Raw<uint32_t>();
+        results[i].second.similarity = reader.Raw<float>();
+    }
+    if (!reader.ok())
+        return false;
+
+    for (size_t i = titles.size(); i-- > 0; )
+        titles_.Put(titles[i].first, titles[i].second);
+    for (size_t i = results.size(); i-- > 0; )
+        results_.Put(results[i].first, results[i].second);
+
+    return true;
+}
+
+bool
+MemoCache::Save()
+{
+    if (!dirty_ || file_.empty())
+        return true;
+
+    string data(kMemoMagic, sizeof(kMemoMagic));
+    PutRaw(data, kMemoVersion);
+    PutRaw(data, (uint32_t) titles_.size());
+    typedef LruMap<uint64_t, string, Uint64Hash>::entries_t titles_t;
+    for (titles_t::const_iterator it = titles_.entries().begin();
+         it != titles_.entries().end(); it++) {
+        PutRaw(data, it->first);
+        PutString(data, it->second);
+    }
+    PutRaw(data, (uint32_t) results_.size());
+    typedef LruMap<string, MemoResult>::entries_t results_t;
+    for (results_t::const_iterator it = results_.entries().begin();
+         it != results_.entries().end(); it++) {
+        PutString(data, it->first);
+        PutString(data, it->second.path);
+        PutRaw(data, (uint32_t) it->second.overlap);
+        PutRaw(data, it->second.similarity);
+    }
+
+    if (!ReplaceFile(file_, data.data(), data.size()))
+        return false;
+
+    dirty_ = false;
+    return true;
+}
+
+bool
+MemoCache::FindOcr(uint64_t title_hash, string *out_ocr)
+{
+    string *ocr = titles_.Find(title_hash);
+    if (!ocr)
+        return false;
+    *out_ocr = *ocr;
+    return true;
+}
+
+void
+MemoCache::PutOcr(uint64_t title_hash, const string& ocr)
+{
+    titles_.Put(title_hash, ocr);
+    dirty_ = true;
+}
+
+bool
+MemoCache::FindResult(const string& key, MemoResult *out_result)
+{
+    MemoResult *result = results_.Find(key);
+    if (!result)
+        return false;
+
+    // the file may have been deleted or moved since
+    struct stat st;
+    if (stat(result->path.c_str(), &st) < 0) {
+        results_.Erase(key);
+        dirty_ = true;
+        return false;
+    }
+
+    *out_result = *result;
+    return true;
+}
+
+void
+MemoCache::PutResult(const string& key, const MemoResult& result)
+{
+    results_.Put(key, result);
+    dirty_ = true;
+}
+
+}; // namespace lhack
@@ -0,0 +1,161 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <utility>
+#include <tr1/unordered_map>
+
+#include <stdint.h>
+
+namespace lhack {
+
+using namespace std;
+
+/**
+ * A map holding at most 'capacity' entries, which drops the least
+ * recently used one to make room for a new one.
+ */
+template <typename Key, typename Value, typename Hash = tr1::hash<Key> >
+class LruMap
+{
+public:
+    typedef pair<Key, Value> entry_t;
+    typedef list<entry_t> entries_t;    // from the most recently used
+
+    explicit LruMap(size_t capacity): capacity_(capacity) {}
+
+    // Returns the value of 'key' (and marks it as used) or 0
+    Value* Find(const Key& key)
+    {
+        typename map_t::iterator it = map_.find(key);
+        if (it == map_.end())
+            return 0;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->second;
+    }
+
+    void Put(const Key& key, const Value& value)
+    {
+        Value *old = Find(key);
+        if (old) {
+            *old = value;
+            return;
+        }
+        entries_.push_front(make_pair(key, value));
+        map_[key] = entries_.begin();
+        if (map_.size() > capacity_) {
+            map_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+    void Erase(const Key& key)
+    {
+        typename map_t::iterator it = map_.find(key);
+        if (it == map_.end())
+            return;
+        entries_.erase(it->second);
+        map_.erase(it);
+    }
+
+    void Clear()
+    {
+        map_.clear();
+        entries_.clear();
+    }
+
+    size_t size() const { return map_.size(); }
+    const entries_t& entries() const { return entries_; }
+
+private:
+    typedef tr1::unordered_map<Key, typename entries_t::iterator, Hash> map_t;
+
+    size_t capacity_;
+    entries_t entries_;
+    map_t map_;
+};
+
+// A search result remembered by MemoCache
+struct MemoResult {
+    string path;
+    unsigned overlap;
+    float similarity;
+};
+
+/**
+ * Remembers what the recent lookups found, so that opening the same book
+ * again costs neither the OCR nor the search. There are two levels:
+ *
+ *  - the hash of a title's bitmap (and the OCR profile) -> its OCR result
+ *  - the library, alpha and the OCR result -> the best matching file
+ *
+ * The second level is only trusted as long as the file still exists; a
+ * file added to the library later doesn't invalidate it.
+ *
+ * The cache is saved to a file (in the host's byte order), from the most
+ * recently used entry. Using an entry doesn't mark the cache as changed,
+ * so the order on disk is only brought up to date with the next change.
+ *
+ *   char magic[4], uint32_t version
+ *   uint32_t ntitles, {uint64_t hash, string ocr}[ntitles]
+ *   uint32_t nresults, {string key, string path, uint32_t overlap,
+ *                       float similarity}[nresults]
+ *
+ * where each string is a uint32_t length followed by the bytes.
+ */
+class MemoCache
+{
+public:
+    explicit MemoCache(size_t capacity = 256);
+
+    // Reads the entries saved in 'file' (if any) and saves them there later
+    bool Load(const string& file);
+
+    // Writes the entries to the file given to Load() (atomically), if
+    // anything changed since it was loaded or saved
+    bool Save();
+
+    bool FindOcr(uint64_t title_hash, string *out_ocr);
+    void PutOcr(uint64_t title_hash, const string& ocr);
+
+    // 'key' is made by ResultKey()
+    bool FindResult(const string& key, MemoResult *out_result);
+    void PutResult(const string& key, const MemoResult& result);
+
+    static string ResultKey(const string& index_key, float alpha, const string& ocr);
+
+private:
+    struct Uint64Hash {
+        size_t operator()(uint64_t value) const { return (size_t) (value ^ (value >> 32)); }
+    };
+
+    MemoCache(const MemoCache&);
+    MemoCache& operator=(const MemoCache&);
+
+    string file_;
+    bool dirty_;
+    LruMap<uint64_t, string, Uint64Hash> titles_;
+    LruMap<string, MemoResult> results_;
+};
+
+};
+
+#endif // MEMO_H
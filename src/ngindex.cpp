@@ -0,0 +1,611 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ngindex.h"
+#include "serial.h"
+
+namespace lhack {
+
+using namespace std;
+
+string
+IndexKey(const string& root, const vector<string>& filters)
+{
+    string key(root);
+    for (size_t i = 0; i < filters.size(); i++) {
+        key.push_back('\n');
+        key.append(filters[i]);
+    }
+    return key;
+}
+
+string
+KeyedIndexFile(const string& file, const string& key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++)
+        hash = (hash ^ (unsigned char) key[i]) * 1099511628211ULL;
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%08x", (unsigned) (hash ^ (hash >> 32)));
+
+    size_t slash = file.rfind('/');
+    size_t dot = file.rfind('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash)
+            || dot == ((slash == string::npos)? 0: slash + 1))
+        return file + suffix;
+    return file.substr(0, dot) + suffix + file.substr(dot);
+}
+
+int
+ComparePaths(const char *left, const char *right)
+{
+    for (; *left && *left == *right; left++, right++)
+        ;
+    if (*left == '/' && *right)
+        return -1;
+    if (*right == '/' && *left)
+        return 1;
+    return (unsigned char) *left - (unsigned char) *right;
+}
+
+namespace {
+
+// Whether 'count' entries of 'entry_size' bytes from 'off' are aligned
+// and end at or before 'end'
+inline bool
+SectionFits(uint32_t off, uint32_t count, size_t entry_size, uint32_t end)
+{
+    return off % 4 == 0 && (uint64_t) off + (uint64_t) count * entry_size <= end;
+}
+
+} // anonymous namespace
+
+NgramIndex::NgramIndex():
+    base_(0), size_(0), mapped_(false), hdr_(0), dirs_(0),
+    paths_(0), byname_(0), parts_(0), keys_(0), dict_(0), skips_(0), postings_(0), nerased_(0)
+{
+}
+
+NgramIndex::~NgramIndex()
+{
+    Close();
+}
+
+void
+NgramIndex::Close()
+{
+    if (mapped_)
+        munmap(const_cast<char*>(base_), size_);
+    vector<char>().swap(image_);
+    base_ = 0;
+    size_ = 0;
+    mapped_ = false;
+    hdr_ = 0;
+
+    vector<string>().swap(added_paths_);
+    vector<unsigned>().swap(added_fnlen_);
+    added_ids_t().swap(added_ids_);
+    added_index_t().swap(added_);
+    vector<char>().swap(erased_);
+    nerased_ = 0;
+}
+
+bool
+NgramIndex::Attach(const char *base, size_t size, const string& key)
+{
+    if (size < sizeof(IndexHeader))
+        return false;
+
+    // A truncated or corrupt file is rejected before anything in it is
+    // read: the sections have to lie within the file, before the strings,
+    // every string has to start within the strings and end there, and the
+    // partitions, posting lists and skip tables have to lie within theirs
+    const IndexHeader *hdr = reinterpret_cast<const IndexHeader*>(base);
+    if (memcmp(hdr->magic, kIndexMagic, sizeof(kIndexMagic)) != 0
+            || hdr->version != kIndexVersion
+            || hdr->ngram_size != NgramCursor::kSize
+            || hdr->file_size != size
+            || hdr->off_strings >= size
+            || base[size - 1] != '\0'
+            || !SectionFits(hdr->off_dirs, hdr->ndirs, sizeof(IndexDirEntry), hdr->off_strings)
+            || !SectionFits(hdr->off_paths, hdr->npaths, sizeof(IndexPathEntry), hdr->off_strings)
+            || !SectionFits(hdr->off_byname, hdr->npaths, sizeof(uint32_t), hdr->off_strings)
+            || !SectionFits(hdr->off_parts, hdr->nparts, sizeof(IndexPartition), hdr->off_strings)
+            || !SectionFits(hdr->off_keys, hdr->nngrams, sizeof(ngramid_t), hdr->off_strings)
+            || !SectionFits(hdr->off_dict, hdr->nngrams, sizeof(IndexDictEntry), hdr->off_strings)
+            || !SectionFits(hdr->off_skips, hdr->nskips, sizeof(SkipEntry), hdr->off_strings)
+            || hdr->off_postings > hdr->off_strings)
+        return false;
+
+    const char *strings = base + hdr->off_strings;
+    uint32_t strings_size = size - hdr->off_strings;
+    if (hdr->key_off >= strings_size || key.compare(strings + hdr->key_off) != 0)
+        return false;
+
+    const IndexDirEntry *dirs = reinterpret_cast<const IndexDirEntry*>(base + hdr->off_dirs);
+    for (uint32_t i = 0; i < hdr->ndirs; i++) {
+        if (dirs[i].path_off >= strings_size)
+            return false;
+    }
+    const IndexPathEntry *paths = reinterpret_cast<const IndexPathEntry*>(base + hdr->off_paths);
+    const uint32_t *byname = reinterpret_cast<const uint32_t*>(base + hdr->off_byname);
+    for (uint32_t i = 0; i < hdr->npaths; i++) {
+        if (paths[i].path_off >= strings_size || byname[i] >= hdr->npaths)
+            return false;
+    }
+
+    const IndexPartition *parts = reinterpret_cast<const IndexPartition*>(base + hdr->off_parts);
+    for (uint32_t i = 0; i < hdr->nparts; i++) {
+        if (parts[i].first > hdr->npaths
+                || (i > 0 && (parts[i].first < parts[i - 1].first
+                              || parts[i].fnlen <= parts[i - 1].fnlen)))
+            return false;
+    }
+
+    // A posting takes a byte at least, so each list has to have room for
+    // its count within the postings
+    const IndexDictEntry *dict = reinterpret_cast<const IndexDictEntry*>(base + hdr->off_dict);
+    const SkipEntry *skips = reinterpret_cast<const SkipEntry*>(base + hdr->off_skips);
+    uint32_t postings_size = hdr->off_strings - hdr->off_postings;
+    for (uint32_t i = 0; i < hdr->nngrams; i++) {
+        const IndexDictEntry& e = dict[i];
+        if ((uint64_t) e.post_off + e.post_cnt > postings_size)
+            return false;
+        if (e.post_cnt <= kPostingBlock)
+            continue;
+        uint32_t nblocks = (e.post_cnt + kPostingBlock - 1) / kPostingBlock;
+        if ((uint64_t) e.skip_off + nblocks > hdr->nskips)
+            return false;
+        for (uint32_t b = 0; b < nblocks; b++) {
+            if (skips[e.skip_off + b].offset >= postings_size - e.post_off)
+                return false;
+        }
+    }
+
+    base_ = base;
+    size_ = size;
+    hdr_ = hdr;
+    dirs_ = reinterpret_cast<const IndexDirEntry*>(base + hdr->off_dirs);
+    paths_ = reinterpret_cast<const IndexPathEntry*>(base + hdr->off_paths);
+    byname_ = reinterpret_cast<const uint32_t*>(base + hdr->off_byname);
+    parts_ = reinterpret_cast<const IndexPartition*>(base + hdr->off_parts);
+    keys_ = reinterpret_cast<const ngramid_t*>(base + hdr->off_keys);
+    dict_ = reinterpret_cast<const IndexDictEntry*>(base + hdr->off_dict);
+    skips_ = reinterpret_cast<const SkipEntry*>(base + hdr->off_skips);
+    postings_ = reinterpret_cast<const uint8_t*>(base + hdr->off_postings);
+
+    return true;
+}
+
+bool
+NgramIndex::Open(const string& file, const string& key)
+{
+    Close();
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    if (!Attach(static_cast<const char*>(map), st.st_size, key)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    mapped_ = true;
+
+    return true;
+}
+
+bool
+NgramIndex::IsFresh() const
+{
+    if (!hdr_ || !hdr_->ndirs)
+        return false;
+
+    const char *strings = base_ + hdr_->off_strings;
+    struct stat st;
+    for (unsigned i = 0; i < hdr_->ndirs; i++) {
+        if (stat(strings + dirs_[i].path_off, &st) < 0
+                || (uint32_t) st.st_mtim.tv_sec != dirs_[i].mtime_sec
+                || (uint32_t) st.st_mtim.tv_nsec != dirs_[i].mtime_nsec)
+            return false;
+    }
+
+    return true;
+}
+
+uint64_t
+NgramIndex::Fingerprint() const
+{
+    if (!hdr_)
+        return 0;
+
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(hdr_);
+    for (size_t i = 0; i < sizeof(IndexHeader); i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    p = reinterpret_cast<const unsigned char*>(dirs_);
+    for (size_t i = 0; i < hdr_->ndirs * sizeof(IndexDirEntry); i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+bool
+NgramIndex::Lookup(ngramid_t ngram, PostingList *out_list) const
+{
+    const ngramid_t *end = keys_ + hdr_->nngrams;
+    const ngramid_t *key = lower_bound(keys_, end, ngram);
+    if (key == end || *key != ngram)
+        return false;
+
+    const IndexDictEntry *lo = dict_ + (key - keys_);
+    out_list->data = postings_ + lo->post_off;
+    out_list->count = lo->post_cnt;
+    out_list->skips = (lo->post_cnt > kPostingBlock)? skips_ + lo->skip_off: 0;
+    return true;
+}
+
+bool
+NgramIndex::LookupAdded(ngramid_t ngram, PostingList *out_list) const
+{
+    added_index_t::const_iterator it = added_.find(ngram);
+    if (it == added_.end())
+        return false;
+
+    out_list->data = reinterpret_cast<const uint8_t*>(it->second.data.data());
+    out_list->count = it->second.count;
+    out_list->skips = 0;
+    return true;
+}
+
+void
+NgramIndex::Append(const IndexSource& src)
+{
+    for (size_t i = 0; i < src.fullpaths.size(); i++) {
+        added_ids_[src.fullpaths[i]] = npaths();
+        added_paths_.push_back(src.fullpaths[i]);
+        added_fnlen_.push_back(src.fnlen[i]);
+    }
+
+    // the new pathids are greater than all the others, so they can
+    // simply be appended to the lists
+    for (index_t::const_iterator it = src.index.begin(); it != src.index.end(); it++) {
+        AddedPostings& added = added_[it->first];
+        const ngram_invert_t& invidx = it->second;
+        for (size_t k = 0; k < invidx.size(); k++) {
+            uint32_t delta = invidx[k].first - added.last;
+            if (invidx[k].second == 1) {
+                PutVarint(delta << 1, added.data);
+            }
+            else {
+                PutVarint((delta << 1) | 1, added.data);
+                PutVarint(invidx[k].second - 2, added.data);
+            }
+            added.last = invidx[k].first;
+            ++ added.count;
+        }
+    }
+}
+
+void
+NgramIndex::Erase(pathid_t id)
+{
+    if (id >= npaths() || IsErased(id))
+        return;
+
+    if (erased_.size() < npaths())
+        erased_.resize(npaths() + npaths() / 8, 0);
+    erased_[id] = 1;
+    ++ nerased_;
+
+    if (id >= nfrozen())
+        added_ids_.erase(added_paths_[id - nfrozen()]);
+}
+
+int
+NgramIndex::Find(const string& path) const
+{
+    const char *strings = base_ + hdr_->off_strings;
+    unsigned lo = 0, hi = hdr_->npaths;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (ComparePaths(strings + paths_[byname_[mid]].path_off, path.c_str()) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < hdr_->npaths && path.compare(strings + paths_[byname_[lo]].path_off) == 0
+            && !IsErased(byname_[lo]))
+        return byname_[lo];
+
+    added_ids_t::const_iterator it = added_ids_.find(path);
+    return (it != added_ids_.end())? (int) it->second: -1;
+}
+
+void
+NgramIndex::FrozenRange(unsigned minlen, unsigned maxlen,
+                        pathid_t *out_first, pathid_t *out_last) const
+{
+    *out_first = 0;
+    *out_last = hdr_->npaths;
+    if (!IsPartitioned() || minlen > maxlen) {
+        if (minlen > maxlen)
+            *out_last = 0;
+        return;
+    }
+
+    const IndexPartition *end = parts_ + hdr_->nparts;
+    const IndexPartition *lo = parts_, *hi = end;
+    while (lo < hi) {
+        const IndexPartition *mid = lo + (hi - lo) / 2;
+        if (mid->fnlen < minlen)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *out_first = (lo == end)? hdr_->npaths: lo->first;
+
+    hi = end;
+    while (lo < hi) {
+        const IndexPartition *mid = lo + (hi - lo) / 2;
+        if (mid->fnlen <= maxlen)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *out_last = (lo == end)? hdr_->npaths: lo->first;
+}
+
+unsigned
+NgramIndex::EraseDir(const string& dir)
+{
+    string prefix(dir);
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/')
+        prefix.push_back('/');
+
+    // the files under 'dir' are contiguous in the path order, starting
+    // at the first path that is not less than the prefix
+    const char *strings = base_ + hdr_->off_strings;
+    unsigned count = 0;
+    unsigned pos = 0, hi = hdr_->npaths;
+    while (pos < hi) {
+        unsigned mid = pos + (hi - pos) / 2;
+        if (ComparePaths(strings + paths_[byname_[mid]].path_off, prefix.c_str()) < 0)
+            pos = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; pos < hdr_->npaths; pos++) {
+        pathid_t id = byname_[pos];
+        if (prefix.compare(0, prefix.size(), path(id), prefix.size()) != 0)
+            break;
+        if (!IsErased(id)) {
+            Erase(id);
+            ++ count;
+        }
+    }
+
+    for (pathid_t id = hdr_->npaths; id < npaths(); id++) {
+        if (!IsErased(id) && prefix.compare(0, prefix.size(), path(id), prefix.size()) == 0) {
+            Erase(id);
+            ++ count;
+        }
+    }
+
+    return count;
+}
+
+void
+NgramIndex::swap(NgramIndex& other)
+{
+    std::swap(base_, other.base_);
+    std::swap(size_, other.size_);
+    std::swap(mapped_, other.mapped_);
+    image_.swap(other.image_);
+    std::swap(hdr_, other.hdr_);
+    std::swap(dirs_, other.dirs_);
+    std::swap(paths_, other.paths_);
+    std::swap(byname_, other.byname_);
+    std::swap(parts_, other.parts_);
+    std::swap(keys_, other.keys_);
+    std::swap(dict_, other.dict_);
+    std::swap(skips_, other.skips_);
+    std::swap(postings_, other.postings_);
+    added_paths_.swap(other.added_paths_);
+    added_fnlen_.swap(other.added_fnlen_);
+    added_ids_.swap(other.added_ids_);
+    added_.swap(other.added_);
+    erased_.swap(other.erased_);
+    std::swap(nerased_, other.nerased_);
+}
+
+namespace {
+
+inline uint32_t
+AlignUp(uint32_t off)
+{
+    return (off + 3) & ~3u;
+}
+
+// An n-gram of the source index, to be frozen
+typedef pair<ngramid_t, const ngram_invert_t*> dict_source_t;
+
+// Orders pathids by their paths
+class ByNameLess
+{
+public:
+    explicit ByNameLess(const fullpaths_t& paths): paths_(paths) {}
+
+    inline bool operator()(uint32_t left, uint32_t right) const
+    {
+        return ComparePaths(paths_[left].c_str(), paths_[right].c_str()) < 0;
+    }
+
+private:
+    const fullpaths_t& paths_;
+};
+
+struct DictLess {
+    inline bool operator()(const dict_source_t& left, const dict_source_t& right) const
+    {
+        return left.first < right.first;
+    }
+};
+
+inline uint32_t
+AppendString(string& blob, const string& s)
+{
+    uint32_t off = blob.size();
+    blob.append(s);
+    blob.push_back('\0');
+    return off;
+}
+
+} // anonymous namespace
+
+bool
+NgramIndex::Build(const IndexSource& src, const string& file)
+{
+    Close();
+
+    IndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kIndexMagic, sizeof(kIndexMagic));
+    hdr.version = kIndexVersion;
+    hdr.ngram_size = NgramCursor::kSize;
+    hdr.ndirs = src.dirs.size();
+    hdr.npaths = src.fullpaths.size();
+    hdr.nngrams = src.index.size();
+
+    string strings;
+    hdr.key_off = AppendString(strings, src.key);
+
+    vector<IndexDirEntry> dirs(hdr.ndirs);
+    for (unsigned i = 0; i < hdr.ndirs; i++) {
+        dirs[i].path_off = AppendString(strings, src.dirs[i].path);
+        dirs[i].mtime_sec = src.dirs[i].mtime_sec;
+        dirs[i].mtime_nsec = src.dirs[i].mtime_nsec;
+    }
+
+    vector<IndexPathEntry> paths(hdr.npaths);
+    vector<IndexPartition> parts;
+    hdr.flags |= kIndexPartitioned;
+    for (unsigned i = 0; i < hdr.npaths; i++) {
+        paths[i].path_off = AppendString(strings, src.fullpaths[i]);
+        paths[i].fnbase = src.fnbase[i];
+        paths[i].fnlen = src.fnlen[i];
+        if (parts.empty() || parts.back().fnlen != src.fnlen[i]) {
+            if (!parts.empty() && parts.back().fnlen > src.fnlen[i])
+                hdr.flags &= ~kIndexPartitioned;
+            IndexPartition part = {src.fnlen[i], i};
+            parts.push_back(part);
+        }
+    }
+    if (!(hdr.flags & kIndexPartitioned))
+        parts.clear();
+    hdr.nparts = parts.size();
+
+    // Find() and EraseDir() look the paths up in the path order
+    vector<uint32_t> byname(hdr.npaths);
+    for (unsigned i = 0; i < hdr.npaths; i++)
+        byname[i] = i;
+    sort(byname.begin(), byname.end(), ByNameLess(src.fullpaths));
+
+    // The dictionary is sorted, so that the lookups can use binary search
+    vector<dict_source_t> sources;
+    sources.reserve(hdr.nngrams);
+    for (index_t::const_iterator it = src.index.begin(); it != src.index.end(); it++)
+        sources.push_back(make_pair(it->first, &it->second));
+    sort(sources.begin(), sources.end(), DictLess());
+
+    vector<ngramid_t> keys(hdr.nngrams);
+    vector<IndexDictEntry> dict(hdr.nngrams);
+    string postings;
+    vector<SkipEntry> skips;
+    for (unsigned i = 0; i < dict.size(); i++) {
+        const ngram_invert_t& invidx = *sources[i].second;
+        keys[i] = sources[i].first;
+        dict[i].post_cnt = invidx.size();
+        dict[i].post_off = postings.size();
+        dict[i].skip_off = skips.size();
+        EncodePostings(invidx.begin(), invidx.end(), postings, skips);
+        hdr.npostings += dict[i].post_cnt;
+    }
+    hdr.nskips = skips.size();
+
+    hdr.off_dirs = AlignUp(sizeof(IndexHeader));
+    hdr.off_paths = AlignUp(hdr.off_dirs + hdr.ndirs * sizeof(IndexDirEntry));
+    hdr.off_byname = AlignUp(hdr.off_paths + hdr.npaths * sizeof(IndexPathEntry));
+    hdr.off_parts = AlignUp(hdr.off_byname + hdr.npaths * sizeof(uint32_t));
+    hdr.off_keys = AlignUp(hdr.off_parts + hdr.nparts * sizeof(IndexPartition));
+    hdr.off_dict = AlignUp(hdr.off_keys + hdr.nngrams * sizeof(ngramid_t));
+    hdr.off_skips = AlignUp(hdr.off_dict + hdr.nngrams * sizeof(IndexDictEntry));
+    hdr.off_postings = AlignUp(hdr.off_skips + hdr.nskips * sizeof(SkipEntry));
+    hdr.off_strings = AlignUp(hdr.off_postings + postings.size());
+    hdr.file_size = AlignUp(hdr.off_strings + strings.size());
+
+    image_.assign(hdr.file_size, 0);
+    char *base = &image_[0];
+    memcpy(base, &hdr, sizeof(hdr));
+    if (hdr.ndirs)
+        memcpy(base + hdr.off_dirs, &dirs[0], hdr.ndirs * sizeof(IndexDirEntry));
+    if (hdr.npaths) {
+        memcpy(base + hdr.off_paths, &paths[0], hdr.npaths * sizeof(IndexPathEntry));
+        memcpy(base + hdr.off_byname, &byname[0], hdr.npaths * sizeof(uint32_t));
+    }
+    if (hdr.nparts)
+        memcpy(base + hdr.off_parts, &parts[0], hdr.nparts * sizeof(IndexPartition));
+    if (hdr.nngrams) {
+        memcpy(base + hdr.off_keys, &keys[0], hdr.nngrams * sizeof(ngramid_t));
+        memcpy(base + hdr.off_dict, &dict[0], hdr.nngrams * sizeof(IndexDictEntry));
+    }
+    if (hdr.nskips)
+        memcpy(base + hdr.off_skips, &skips[0], hdr.nskips * sizeof(SkipEntry));
+    memcpy(base + hdr.off_postings, postings.data(), postings.size());
+    memcpy(base + hdr.off_strings, strings.data(), strings.size());
+
+    // If the image can't be saved or mapped, the in-memory copy is used
+    if (!file.empty() && ReplaceFile(file, &image_[0], image_.size())) {
+        vector<char> image;
+        image.swap(image_);
+        if (Open(file, src.key))
+            return true;
+        image_.swap(image);
+    }
+
+    return Attach(&image_[0], image_.size(), src.key);
+}
+
+}; // namespace lhack
@@ -0,0 +1,284 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef NGINDEX_H
+#define NGINDEX_H
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <functional>
+#include <tr1/unordered_map>
+
+#include <stdint.h>
+
+#include "postings.h"
+#include "flatmap.h"
+#include "ngrams.h"
+
+namespace lhack {
+
+using namespace std;
+
+// array recording all paths where the ngram was encountered
+// (the mutable form, used while the index is being built)
+typedef vector<index_atom_t> ngram_invert_t;
+
+typedef FlatMap<ngram_invert_t> index_t;
+typedef vector<string> fullpaths_t;
+
+// A directory seen during the crawl, along with its modification time.
+// Adding, removing or renaming a file changes the mtime of its parent,
+// so these are enough to tell whether a saved index is still valid.
+struct DirStamp {
+    string path;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+};
+typedef vector<DirStamp> dirstamps_t;
+
+// What the crawl produced, before it is frozen into the on-disk layout.
+// It is only needed until NgramIndex::Build() returns.
+struct IndexSource {
+    string key;             // root + filters, see IndexKey()
+    dirstamps_t dirs;
+    fullpaths_t fullpaths;
+    vector<unsigned> fnbase;
+    vector<unsigned> fnlen;     // the n-gram count of the (normalized) file name
+    index_t index;
+    pathid_t first_pathid;  // the pathid of fullpaths[0]
+    unsigned nvisited;      // files seen by the crawl, including the filtered out
+
+    explicit IndexSource(size_t nngrams = 4096):
+        index(nngrams), first_pathid(0), nvisited(0) {}
+};
+
+// Orders paths the way a depth-first walk with sorted directory entries
+// visits them: component by component, with strcmp(). All the files
+// under a directory are contiguous in this order.
+int ComparePaths(const char *left, const char *right);
+
+struct PathLess {
+    inline bool operator()(const string& left, const string& right) const
+    {
+        return ComparePaths(left.c_str(), right.c_str()) < 0;
+    }
+};
+
+/**
+ * The on-disk index file. Everything is stored in the host's byte order
+ * and is 4-byte aligned, so that the file can be mmap()-ed and queried
+ * in place. A file written on a host with different endianness simply
+ * fails the version check (the magic reads the same) and gets rebuilt.
+ *
+ *   IndexHeader
+ *   IndexDirEntry[ndirs]
+ *   IndexPathEntry[npaths]    (see kIndexPartitioned)
+ *   uint32_t byname[npaths]   (the pathids in ComparePaths() order)
+ *   IndexPartition[nparts]
+ *   ngramid_t keys[nngrams]   (sorted)
+ *   IndexDictEntry[nngrams]   (in the order of the keys)
+ *   SkipEntry[nskips]         (the skip tables of the long posting lists)
+ *   uint8_t postings[]        (compressed, see postings.h)
+ *   char strings[]            (key, dir and file paths, '\0' terminated)
+ */
+static const char kIndexMagic[4] = {'L', 'H', 'I', 'X'};
+static const uint32_t kIndexVersion = 6;
+
+// The paths are ordered by the length of their file names (and then by
+// ComparePaths()), so that the names of a given length, i.e. with a given
+// number of n-grams, have contiguous pathids - a partition. A search
+// only needs to look at the partitions whose length can satisfy the
+// similarity threshold (see SimBounds).
+static const uint32_t kIndexPartitioned = 2;
+
+struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t ngram_size;    // LHACK_NGRAM of the build which wrote the file
+    uint32_t file_size;
+    uint32_t key_off;
+    uint32_t ndirs, npaths, nparts, nngrams, nskips, npostings;
+    uint32_t off_dirs, off_paths, off_byname, off_parts, off_keys, off_dict,
+             off_skips, off_postings, off_strings;
+};
+
+struct IndexDirEntry {
+    uint32_t path_off;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+};
+
+struct IndexPathEntry {
+    uint32_t path_off;
+    uint32_t fnbase;
+    uint32_t fnlen;
+};
+
+// The first pathid of the file names of 'fnlen' n-grams
+struct IndexPartition {
+    uint32_t fnlen;
+    uint32_t first;
+};
+
+// The n-gram ids are kept apart from the rest of the dictionary, so that
+// the binary search of a lookup only touches the dense array of the keys
+struct IndexDictEntry {
+    uint32_t post_off;      // byte offset in the postings section
+    uint32_t post_cnt;
+    uint32_t skip_off;      // index of the first skip entry, if post_cnt > kPostingBlock
+};
+
+// Identifies the set of files an index covers
+string IndexKey(const string& root, const vector<string>& filters);
+
+// The file the index of 'key' is saved to, so that the libraries don't
+// overwrite each other's index: 'file' with a hash of the key before its
+// extension (e.g. lhack.idx -> lhack-0123abcd.idx)
+string KeyedIndexFile(const string& file, const string& key);
+
+// The postings of one n-gram, added after the index was frozen. They are
+// compressed just like the frozen ones, only without a skip table.
+struct AddedPostings {
+    AddedPostings(): last(0), count(0) {}
+
+    string data;
+    pathid_t last;
+    unsigned count;
+};
+
+/**
+ * A frozen index, either mapped from a file or serialized into memory.
+ *
+ * Paths can be added and removed without rebuilding it: the added paths
+ * get pathids after the frozen ones and are indexed in memory, and the
+ * removed ones are only marked (tombstoned). This lasts until the next
+ * Build(), which folds everything back into a frozen image.
+ */
+class NgramIndex
+{
+public:
+    NgramIndex();
+    ~NgramIndex();
+
+    // Maps 'file' and checks its header. Returns false if the file is
+    // missing, truncated, has an unknown version or covers a different key.
+    bool Open(const string& file, const string& key);
+
+    // Checks the directory mtimes recorded in the index against the file
+    // system. An index without directories (its root couldn't be read) is
+    // never fresh.
+    bool IsFresh() const;
+
+    // Identifies the frozen image: the same files under the same directory
+    // mtimes give the same index, hence the same fingerprint
+    uint64_t Fingerprint() const;
+
+    // Freezes 'src'. If 'file' is not empty the frozen image is saved there
+    // (atomically) for use by the next invocation, and is then mapped from
+    // it, so that it doesn't take up heap. Otherwise it stays in memory.
+    bool Build(const IndexSource& src, const string& file);
+
+    void Close();
+
+    // Adds the paths of 'src', whose pathids must start at npaths()
+    void Append(const IndexSource& src);
+
+    // Tombstones a path, so that it's no longer found by Find() and
+    // skipped by BestMatch()
+    void Erase(pathid_t id);
+
+    // Tombstones all paths under 'dir'. Returns their number.
+    unsigned EraseDir(const string& dir);
+
+    // Returns the pathid of 'path' or -1 if it's not indexed (or erased)
+    int Find(const string& path) const;
+
+    void swap(NgramIndex& other);
+
+    // The number of pathids, including the added and the erased ones
+    unsigned npaths() const { return hdr_->npaths + added_paths_.size(); }
+    unsigned nfrozen() const { return hdr_->npaths; }
+    unsigned nadded() const { return added_paths_.size(); }
+    unsigned nerased() const { return nerased_; }
+
+    const char* path(pathid_t id) const {
+        if (id < hdr_->npaths)
+            return base_ + hdr_->off_strings + paths_[id].path_off;
+        return added_paths_[id - hdr_->npaths].c_str();
+    }
+    // The number of n-grams of a file name
+    unsigned fnlen(pathid_t id) const {
+        if (id < hdr_->npaths)
+            return paths_[id].fnlen;
+        return added_fnlen_[id - hdr_->npaths];
+    }
+    bool IsErased(pathid_t id) const { return id < erased_.size() && erased_[id]; }
+
+    bool IsPartitioned() const { return (hdr_->flags & kIndexPartitioned) != 0; }
+
+    // Returns the range [*out_first, *out_last) of the frozen pathids whose
+    // file names may be 'minlen' to 'maxlen' bytes long. Without the
+    // partitions that's all of them.
+    void FrozenRange(unsigned minlen, unsigned maxlen,
+                     pathid_t *out_first, pathid_t *out_last) const;
+
+    unsigned nngrams() const { return hdr_->nngrams; }
+    unsigned npostings() const { return hdr_->npostings; }
+    size_t size() const { return size_; }
+
+    // Finds the frozen posting list of 'ngram'. Returns false if it is not indexed.
+    bool Lookup(ngramid_t ngram, PostingList *out_list) const;
+
+    // Finds the postings of 'ngram' added since the index was frozen
+    bool LookupAdded(ngramid_t ngram, PostingList *out_list) const;
+
+private:
+    typedef FlatMap<AddedPostings> added_index_t;
+    typedef tr1::unordered_map<string, pathid_t> added_ids_t;
+
+    bool Attach(const char *base, size_t size, const string& key);
+
+    NgramIndex(const NgramIndex&);
+    NgramIndex& operator=(const NgramIndex&);
+
+    const char *base_;
+    size_t size_;
+    bool mapped_;
+    vector<char> image_;
+
+    const IndexHeader *hdr_;
+    const IndexDirEntry *dirs_;
+    const IndexPathEntry *paths_;
+    const uint32_t *byname_;
+    const IndexPartition *parts_;
+    const ngramid_t *keys_;
+    const IndexDictEntry *dict_;
+    const SkipEntry *skips_;
+    const uint8_t *postings_;
+
+    vector<string> added_paths_;
+    vector<unsigned> added_fnlen_;
+    added_ids_t added_ids_;
+    added_index_t added_;
+    vector<char> erased_;
+    unsigned nerased_;
+};
+
+}; // namespace lhack
+
+#endif // NGINDEX_H
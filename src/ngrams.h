@@ -0,0 +1,154 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef NGRAMS_H
+#define NGRAMS_H
+
+#include <string>
+
+#include <stdint.h>
+
+// The n-gram size (in bytes of the normalized name), 2 to 4. Both the
+// index and the queries are built with it; an index file made with
+// another size is rebuilt.
+#ifndef LHACK_NGRAM
+#define LHACK_NGRAM 3
+#endif
+
+namespace lhack {
+
+using namespace std;
+
+typedef uint32_t ngramid_t;
+
+/**
+ * Puts the form of the name in [begin, end) which is split into n-grams
+ * in 'out': the letters are folded to lower case (ASCII, Latin-1 and
+ * Cyrillic), and every run of ASCII characters other than letters and
+ * digits (and of no-break spaces) becomes a single space, except at the
+ * ends, where it is dropped. So "The_Hobbit-(1937)" and "the hobbit 1937"
+ * are the same. The other UTF-8 sequences are copied whole.
+ */
+inline void
+NormalizeName(const char *begin, const char *end, string& out)
+{
+    out.clear();
+    bool separator = false;
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(begin);
+    const unsigned char *e = reinterpret_cast<const unsigned char*>(end);
+    while (p < e) {
+        unsigned char c0 = *p;
+        size_t n = (c0 >= 0xf0)? 4: (c0 >= 0xe0)? 3: (c0 >= 0xc0)? 2: 1;
+        if (n > (size_t) (e - p))
+            n = e - p;
+        bool alnum = (c0 >= '0' && c0 <= '9') || (c0 >= 'a' && c0 <= 'z')
+            || (c0 >= 'A' && c0 <= 'Z');
+        if ((c0 < 0x80 && !alnum) || (n == 2 && c0 == 0xc2 && p[1] == 0xa0)) {
+            separator = true;
+            p += n;
+            continue;
+        }
+        if (separator && !out.empty())
+            out.push_back(' ');
+        separator = false;
+
+        if (n == 1) {
+            out.push_back((c0 >= 'A' && c0 <= 'Z')? c0 + ('a' - 'A'): c0);
+            ++ p;
+            continue;
+        }
+        unsigned char c1 = p[1];
+        if (c0 == 0xc3 && c1 >= 0x80 && c1 <= 0x9e && c1 != 0x97) {
+            c1 += 0x20;                 // U+00C0-00DE (but the sign x)
+        }
+        else if (c0 == 0xd0 && c1 >= 0x90 && c1 <= 0x9f) {
+            c1 += 0x20;                 // U+0410-041F -> U+0430-043F
+        }
+        else if (c0 == 0xd0 && c1 >= 0xa0 && c1 <= 0xaf) {
+            c0 = 0xd1;                  // U+0420-042F -> U+0440-044F
+            c1 -= 0x20;
+        }
+        else if (c0 == 0xd0 && c1 >= 0x80 && c1 <= 0x8f) {
+            c0 = 0xd1;                  // U+0400-040F -> U+0450-045F
+            c1 += 0x10;
+        }
+        out.push_back(c0);
+        out.push_back(c1);
+        out.append(reinterpret_cast<const char*>(p + 2), n - 2);
+        p += n;
+    }
+}
+
+inline void
+NormalizeName(const string& name, string& out)
+{
+    NormalizeName(name.data(), name.data() + name.size(), out);
+}
+
+/**
+ * Walks the n-grams of a normalized name, one per byte: the n-gram
+ * ending at that byte, so the first N - 1 of them are padded with zeros.
+ * A name thus has as many n-grams as bytes, and that is the length the
+ * similarity measures work with.
+ *
+ * The id of an n-gram is its bytes as a big-endian number, which doesn't
+ * depend on the byte order of the host.
+ */
+template <unsigned N>
+class BasicNgramCursor
+{
+public:
+    static const unsigned kSize = N;
+    static const ngramid_t kMask = 0xffffffffu >> (8 * (4 - N));
+
+    explicit BasicNgramCursor(const string& normalized):
+        pos_(normalized.data()), end_(pos_ + normalized.size()), id_(0), at_end_(false)
+    {
+        Next();
+    }
+
+    bool AtEnd() const { return at_end_; }
+    ngramid_t id() const { return id_; }
+
+    void Next()
+    {
+        if (pos_ == end_) {
+            at_end_ = true;
+            return;
+        }
+        id_ = ((id_ << 8) | (unsigned char) *pos_++) & kMask;
+    }
+
+    // The i-th byte of an n-gram (0 - the first)
+    static char Byte(ngramid_t id, unsigned i)
+    {
+        return (char) (id >> (8 * (N - 1 - i)));
+    }
+
+private:
+    // only 2 to 4 bytes fit in an ngramid_t (and a single one is useless)
+    typedef char size_check_t[(N >= 2 && N <= 4)? 1: -1];
+
+    const char *pos_, *end_;
+    ngramid_t id_;
+    bool at_end_;
+};
+
+typedef BasicNgramCursor<LHACK_NGRAM> NgramCursor;
+
+};
+
+#endif // NGRAMS_H
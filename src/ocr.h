@@ -18,42 +18,230 @@
 #define OCR_H
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <tesseract/baseapi.h>
 #include <tesseract/resultiterator.h>
 
 #include "framegrabber.h"
+#include "titleprep.h"
+#include "glyphs.h"
+#include "threads.h"
 
 namespace lhack {
 
 using namespace std;
 
+enum OcrProfile {
+    kOcrDefault,
+    // Skips the dictionaries and the adaptive classifier (see kFastConfig).
+    // The titles are mostly proper names anyway, and the approximate file
+    // matching copes with the occasional misrecognized letter.
+    kOcrFast
+};
+
+// Tesseract config file applied by kOcrFast. It is searched for in
+// <modeldir>/tessdata/configs/
+static const char kFastConfig[] = "lhack-fast";
+
 template <typename DIM=KDXDimensions >
 class Recognizer
 {
 public:
-    Recognizer(string modeldir, string lang) :
-        modeldir_(modeldir), lang_(lang) {}
+    // The model data is loaded once, by Warmup() or the first title to be
+    // recognized - the same instance can then be used to recognize any
+    // number of titles. RecognizeAll() spreads the titles over 'nworkers'
+    // engines; the others are initialized the first time they are needed,
+    // as each of them takes a copy of the model.
+    //
+    // If there are glyphs for the device in 'modeldir' (see GlyphFile()),
+    // the titles are read with them first, and only those they can't read
+    // with confidence are left to Tesseract, whose model isn't loaded
+    // until then.
+    Recognizer(string modeldir, string lang, OcrProfile profile = kOcrDefault,
+               unsigned nworkers = 1);
+    ~Recognizer();
+
+    // Loads the model data of the first engine, unless it's already loaded
+    bool Warmup() { Init(*engines_[0]); return IsReady(); }
+
+    bool IsReady() { return engines_[0]->ready; }
+
+    OcrProfile profile() const { return profile_; }
+
+    const GlyphSet& glyphs() const { return glyphs_; }
 
     // Recognizes the title and filters the metadata
     // i.e. returns only the title
-    string Recognize(Bitmap& image);
+    string Recognize(const BitmapView& image);
+
+    // Recognizes the title with the glyphs only; false if there are none,
+    // or they can't read it (see RecognizeGlyphs() in glyphs.h)
+    bool RecognizeGlyphs(const BitmapView& image, string *out_text) const
+    {
+        return lhack::RecognizeGlyphs<DIM>(glyphs_, image, out_text);
+    }
+
+    // ... and with Tesseract only
+    string RecognizeTesseract(const BitmapView& image);
+
+    // Recognizes a batch of titles (e.g. a whole page) in parallel.
+    // 'out_texts' gets one result per image. Returns how many of them
+    // were read with the glyphs.
+    unsigned RecognizeAll(const vector<BitmapView>& images, vector<string>& out_texts);
 
 private:
+    // Separate TessBaseAPI instances don't share any state, so each
+    // worker thread gets one of them
+    struct Engine {
+        Engine(): ready(false), initialized(false) {}
+
+        tesseract::TessBaseAPI api;
+        bool ready;
+        bool initialized;
+        Bitmap prepared;    // the last title, as given to Tesseract
+    };
+
+    // Recognizes every 'stride'-th of the images, from 'first' on
+    class BatchJob
+    {
+    public:
+        BatchJob(): owner_(0), engine_(0), first_(0), stride_(1), images_(0), out_(0),
+                    glyphs_read_(0) {}
+        BatchJob(Recognizer *owner, Engine *engine, size_t first, size_t stride,
+                 const vector<BitmapView> *images, vector<string> *out):
+            owner_(owner), engine_(engine), first_(first), stride_(stride),
+            images_(images), out_(out), glyphs_read_(0) {}
+
+        void Run()
+        {
+            for (size_t i = first_; i < images_->size(); i += stride_) {
+                if (owner_->RecognizeGlyphs((*images_)[i], &(*out_)[i]))
+                    glyphs_read_++;
+                else
+                    (*out_)[i] = owner_->RecognizeWith(*engine_, (*images_)[i]);
+            }
+        }
+
+        unsigned glyphs_read() const { return glyphs_read_; }
+
+    private:
+        Recognizer *owner_;
+        Engine *engine_;
+        size_t first_, stride_;
+        const vector<BitmapView> *images_;
+        vector<string> *out_;
+        unsigned glyphs_read_;
+    };
+
+    Recognizer(const Recognizer&);
+    Recognizer& operator=(const Recognizer&);
+
+    void Init(Engine& engine);
+    string RecognizeWith(Engine& engine, const BitmapView& image);
+
     string modeldir_;
     string lang_;
+    OcrProfile profile_;
+    vector<Engine*> engines_;
+    GlyphSet glyphs_;
 };
 
 template <typename DIM >
-string Recognizer<DIM>::Recognize(Bitmap& image)
+Recognizer<DIM>::Recognizer(string modeldir, string lang, OcrProfile profile,
+                            unsigned nworkers) :
+    modeldir_(modeldir), lang_(lang), profile_(profile)
+{
+    for (unsigned i = 0; i < max(1u, nworkers); i++)
+        engines_.push_back(new Engine);
+    glyphs_.Load(GlyphFile<DIM>(modeldir_));
+}
+
+template <typename DIM >
+Recognizer<DIM>::~Recognizer()
+{
+    for (size_t i = 0; i < engines_.size(); i++)
+        delete engines_[i];
+}
+
+template <typename DIM >
+void Recognizer<DIM>::Init(Engine& engine)
+{
+    if (engine.initialized)
+        return;
+    engine.initialized = true;
+
+    tesseract::TessBaseAPI& api = engine.api;
+    if (profile_ == kOcrFast) {
+        // The dawgs are "init only" parameters, so they can't be turned off
+        // with SetVariable() - only from a config file read by Init()
+        char *configs[] = {const_cast<char*>(kFastConfig)};
+        engine.ready = (api.Init(modeldir_.c_str(), lang_.c_str(),
+                                 tesseract::OEM_TESSERACT_ONLY, configs, 1, false) == 0);
+        api.SetVariable("classify_enable_learning", "0");
+    }
+    else {
+        engine.ready = (api.Init(modeldir_.c_str(), lang_.c_str()) == 0);
+    }
+
+    // There is always a single line of text on the image, so
+    // the page layout analysis would be wasted
+    api.SetPageSegMode(tesseract::PSM_SINGLE_LINE);
+}
+
+template <typename DIM >
+string Recognizer<DIM>::Recognize(const BitmapView& image)
+{
+    string text;
+    if (!RecognizeGlyphs(image, &text))
+        text = RecognizeTesseract(image);
+    return text;
+}
+
+template <typename DIM >
+string Recognizer<DIM>::RecognizeTesseract(const BitmapView& image)
+{
+    return RecognizeWith(*engines_[0], image);
+}
+
+template <typename DIM >
+unsigned Recognizer<DIM>::RecognizeAll(const vector<BitmapView>& images, vector<string>& out_texts)
 {
-    tesseract::TessBaseAPI api;
-    api.Init(modeldir_.c_str(), lang_.c_str());
-    api.SetImage((const unsigned char*)image.buffer(),
-                 image.width(), image.height(), 1, image.width());
+    out_texts.assign(images.size(), string());
+
+    size_t nworkers = min(engines_.size(), images.size());
+    vector<BatchJob> jobs;
+    for (size_t w = 0; w < nworkers; w++)
+        jobs.push_back(BatchJob(this, engines_[w], w, nworkers, &images, &out_texts));
+    RunAll(jobs);
+
+    unsigned glyphs_read = 0;
+    for (size_t w = 0; w < jobs.size(); w++)
+        glyphs_read += jobs[w].glyphs_read();
+    return glyphs_read;
+}
+
+template <typename DIM >
+string Recognizer<DIM>::RecognizeWith(Engine& engine, const BitmapView& image)
+{
+    Init(engine);
+    if (!engine.ready)
+        return string();
+
+    // Only the title's own pixels are recognized (see PrepareTitle())
+    if (!PrepareTitle<DIM>(image, engine.prepared))
+        return string();
+    BitmapView title = engine.prepared.view();
+
+    tesseract::TessBaseAPI& api = engine.api;
+    api.SetImage((const unsigned char*)title.buffer(), title.width(), title.height(),
+                 title.bpp() / 8, title.stride());
     int ocr_error = api.Recognize(0);
-    if (ocr_error)
+    tesseract::ResultIterator *it = ocr_error? 0: api.GetIterator();
+    if (!it) {
+        api.Clear();
         return string();
-    tesseract::ResultIterator *it = api.GetIterator();
+    }
 
     int top, bottom, left=0, right=0;
     int prev_right = right;
@@ -66,12 +254,25 @@ string Recognizer<DIM>::Recognize(Bitmap& image)
         } else {
             if (prev_right)
                 result.append(" ");
-            result.append(it->GetUTF8Text(tesseract::RIL_WORD));
+            // the text is allocated by Tesseract, and would otherwise leak
+            // in a long-running process
+            char *word = it->GetUTF8Text(tesseract::RIL_WORD);
+            if (word) {
+                result.append(word);
+                delete[] word;
+            }
         }
      } while (it->Next(tesseract::RIL_WORD));
 
     delete it;
 
+    // Drop the results, and unless it is disabled, what the adaptive
+    // classifier has learnt from this title, so that the next title
+    // is recognized the same way, no matter what came before it
+    api.Clear();
+    if (profile_ != kOcrFast)
+        api.ClearAdaptiveClassifier();
+
     return result;
 }
 
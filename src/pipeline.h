@@ -0,0 +1,497 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+
+#include "framegrabber.h"
+#include "ocr.h"
+#include "filematch.h"
+#include "memo.h"
+#include "rendered.h"
+#include "threads.h"
+
+namespace lhack {
+
+using namespace std;
+
+#if defined(LHACK_DEVEL_HOST)
+static const char kShareDir[] = "/mnt/x86/share";
+#else
+static const char kShareDir[] = "/mnt/us/launchpad/share";
+#endif
+
+// The Unix domain socket lhackd listens on
+static const char kDaemonSocket[] = "/tmp/lhackd.sock";
+
+// Exit codes of lhack, also returned by the daemon
+enum ResolveStatus {
+    kResolveOk = 0,
+    kResolveNoSelection = 2,
+    kResolveNoMatch = 3
+};
+
+// Splits a comma-separated list of globs
+inline void
+SplitFilters(const char *list, vector<string>& out_filters)
+{
+    const char* fbegin = list;
+    const char* fend = fbegin;
+    while (*fend) {
+        if (*fend == ',') {
+            out_filters.push_back(string(fbegin, fend));
+            fbegin = ++fend;
+        }
+        else {
+            ++ fend;
+        }
+    }
+    if (fend > fbegin)
+        out_filters.push_back(string(fbegin, fend));
+}
+
+/**
+ * The device-independent interface of Resolver, for the callers which
+ * only find out at run time which device they are on (see NewResolver())
+ */
+class ResolverBase
+{
+public:
+    virtual ~ResolverBase() {}
+
+    virtual void SetPageMode(bool on) = 0;
+    virtual void SetMemo(const string& file) = 0;
+    virtual void SetRenderMatch(bool on) = 0;
+    virtual bool Warmup() = 0;
+
+    // See FrameGrabber::Fingerprint()
+    virtual uint64_t SelectionFingerprint() = 0;
+
+    virtual int Resolve(const string& root, const vector<string>& filters,
+                        float alpha, const SearchOptions& opts,
+                        string *out_path, string *out_ocr, Stats *stats = 0) = 0;
+
+    virtual int ResolveTopK(const string& root, const vector<string>& filters,
+                            float alpha, const SearchOptions& opts, size_t k,
+                            vector<SearchResult> *out_results, string *out_ocr,
+                            Stats *stats = 0) = 0;
+};
+
+// Refreshes a library (i.e. crawls and indexes it on the first lookup) on
+// a thread of its own, while the title is being read
+struct LibraryRefresh {
+    LibraryRefresh(): library(0) {}
+
+    void Run() { library->Refresh(&stats); }
+
+    Library *library;
+    Stats stats;
+};
+
+/**
+ * The whole grab -> OCR -> search chain. The OCR engine and the indices
+ * of the libraries searched so far are kept, so that an instance can
+ * serve many requests (see lhackd.cpp).
+ *
+ * In the page mode all the titles on the page are recognized (with
+ * 'ocr_workers' engines in parallel) and looked up at once, and the
+ * results are kept. As long as the page stays the same, moving the
+ * selection to another entry is answered without any OCR or search.
+ *
+ * With the render matching on, the selected title is first compared with
+ * the file names drawn with the device's glyphs (see RenderedTitles), and
+ * only read if none of them clearly looks like it. It only pays off when
+ * the shell shows the file names as the titles, i.e. for the files
+ * without metadata.
+ *
+ * The index doesn't depend on the title, so when the title has to be
+ * read, the library is refreshed meanwhile on another thread: a lookup
+ * that has to crawl the library takes about as long as the longer of the
+ * two, rather than their sum. If the match turns out to be remembered,
+ * the lookup returns without waiting for the refresh, and the next use
+ * of the libraries (or the destructor) waits for it instead. Only a
+ * resident process (lhackd) gains from that; lhack still waits for the
+ * refresh before it exits, and the saved index is then up to date.
+ */
+template <typename DIM=DeviceDimensions >
+class Resolver: public ResolverBase
+{
+public:
+    Resolver(const char *fbdev, const string& modeldir, const string& lang,
+             OcrProfile profile = kOcrDefault, unsigned ocr_workers = 1):
+        grabber_(fbdev), ocr_(modeldir, lang, profile, ocr_workers),
+        page_mode_(false), render_match_(false), memo_(0) {}
+
+    ~Resolver();
+
+    void SetPageMode(bool on) { page_mode_ = on; page_.valid = false; }
+
+    // Remembers the OCR results and the matched files in 'file' (see
+    // MemoCache), so that a title seen before is resolved without the
+    // OCR or the search. "" turns the memo off.
+    void SetMemo(const string& file);
+
+    // Matches the selected title against the drawn file names before
+    // reading it (not in the page mode, nor for more than one result)
+    void SetRenderMatch(bool on) { render_match_ = on; }
+
+    // Loads the OCR model now rather than with the first title
+    bool Warmup() { return ocr_.Warmup(); }
+
+    uint64_t SelectionFingerprint() { return grabber_.Fingerprint(); }
+
+    /**
+     * Finds the file, whose title is currently selected on the screen.
+     * Returns one of ResolveStatus. 'out_ocr' receives the recognized title.
+     * The stages are timed into 'stats', if given.
+     */
+    int Resolve(const string& root, const vector<string>& filters,
+                float alpha, const SearchOptions& opts,
+                string *out_path, string *out_ocr, Stats *stats = 0);
+
+    // Same as Resolve(), but finds the (up to) 'k' best matching files
+    int ResolveTopK(const string& root, const vector<string>& filters,
+                    float alpha, const SearchOptions& opts, size_t k,
+                    vector<SearchResult> *out_results, string *out_ocr,
+                    Stats *stats = 0);
+
+private:
+    typedef map<string, Library*> libraries_t;
+
+    // The last page resolved in the page mode
+    struct PageCache {
+        PageCache(): valid(false), hash(0), generation(0) {}
+
+        bool valid;
+        uint64_t hash;          // of all the titles on the page
+        string query;           // the library, measure, alpha and k they were resolved with
+        unsigned generation;    // of the library at that time
+        vector<string> ocr;
+        vector<vector<SearchResult> > results;
+    };
+
+    Resolver(const Resolver&);
+    Resolver& operator=(const Resolver&);
+
+    Library* GetLibrary(const string& root, const vector<string>& filters,
+                        const SearchOptions& opts, Stats *stats);
+
+    // Waits for the refresh started by a lookup, if any, and adds its
+    // statistics to 'stats'
+    void FinishRefresh(Stats *stats);
+
+    int ResolvePage(const string& root, const vector<string>& filters,
+                    float alpha, const SearchOptions& opts, size_t k,
+                    vector<SearchResult> *out_results, string *out_ocr,
+                    Stats *stats);
+
+    BitmapView Grab(Stats *stats)
+    {
+        StageTimer timer(stats, kStageGrab);
+        return grabber_.GrabSelected();
+    }
+
+    FrameGrabber<DIM> grabber_;
+    Recognizer<DIM> ocr_;
+    libraries_t libraries_;
+    bool page_mode_;
+    bool render_match_;
+    PageCache page_;
+    MemoCache *memo_;
+    vector<BitmapView> titles_;     // the last page's, kept for its capacity
+    LibraryRefresh refresh_;
+    Thread<LibraryRefresh> refresher_;
+};
+
+template <typename DIM >
+Resolver<DIM>::~Resolver()
+{
+    FinishRefresh(0);
+    SetMemo(string());
+    for (typename libraries_t::iterator it = libraries_.begin();
+         it != libraries_.end(); it++)
+        delete it->second;
+}
+
+template <typename DIM >
+void Resolver<DIM>::SetMemo(const string& file)
+{
+    if (memo_) {
+        memo_->Save();
+        delete memo_;
+        memo_ = 0;
+    }
+    if (!file.empty()) {
+        memo_ = new MemoCache;
+        memo_->Load(file);
+    }
+}
+
+template <typename DIM >
+int Resolver<DIM>::Resolve(const string& root, const vector<string>& filters,
+                           float alpha, const SearchOptions& opts,
+                           string *out_path, string *out_ocr, Stats *stats)
+{
+    vector<SearchResult> results;
+    int status = ResolveTopK(root, filters, alpha, opts, 1, &results, out_ocr, stats);
+    *out_path = results.empty()? string(): results[0].path;
+    return status;
+}
+
+template <typename DIM >
+int Resolver<DIM>::ResolveTopK(const string& root, const vector<string>& filters,
+                               float alpha, const SearchOptions& opts, size_t k,
+                               vector<SearchResult> *out_results, string *out_ocr,
+                               Stats *stats)
+{
+    out_results->clear();
+    if (page_mode_)
+        return ResolvePage(root, filters, alpha, opts, k, out_results, out_ocr, stats);
+
+    BitmapView image = Grab(stats);
+    if (!image.IsValid())
+        return kResolveNoSelection;
+
+#ifdef LHACK_DEBUG_GRABBER
+    {
+        char dmpname[80];
+        snprintf(dmpname, 80, "titledump-%dx%d.gray", image.width(), image.height());
+        std::ofstream bmdump(dmpname);
+        for (int y = 0; y < image.height(); y++)
+            bmdump.write(image.row(y), image.width());
+        bmdump.close();
+    }
+#endif
+
+    Library *library = GetLibrary(root, filters, opts, stats);
+    TitleShape shape;
+    if (render_match_ && k == 1 && GrabbedShape<DIM>(ocr_.glyphs(), image, &shape)) {
+        SearchResult result;
+        if (library->MatchRendered(shape, ocr_.glyphs(), opts.measure, alpha,
+                                   &result, stats)) {
+            // what the title was taken for
+            *out_ocr = DisplayName(result.path.c_str());
+            out_results->push_back(result);
+            if (stats)
+                stats->render_match = 1;
+            return kResolveOk;
+        }
+    }
+
+    // The OCR profile is part of the title's key, as it changes the result
+    uint64_t title_hash = memo_? HashBitmap(image, ocr_.profile() + 1): 0;
+    if (memo_ && memo_->FindOcr(title_hash, out_ocr)) {
+        if (stats)
+            stats->memo_ocr = 1;
+    }
+    else {
+        // If the thread can't be started, the search refreshes the library
+        refresh_.library = library;
+        refresh_.stats = Stats();
+        refresher_.StartMasked(&refresh_);
+
+        // Tesseract is only loaded if the glyphs can't read the title
+        bool read;
+        {
+            StageTimer timer(stats, kStageOcr);
+            read = ocr_.RecognizeGlyphs(image, out_ocr);
+        }
+        if (read) {
+            if (stats)
+                stats->glyph_ocr = 1;
+        }
+        else {
+            {
+                StageTimer timer(stats, kStageInit);
+                ocr_.Warmup();
+            }
+            StageTimer timer(stats, kStageOcr);
+            *out_ocr = ocr_.RecognizeTesseract(image);
+        }
+        if (memo_ && !out_ocr->empty())
+            memo_->PutOcr(title_hash, *out_ocr);
+    }
+
+    // Only the best match is remembered
+    string memo_key;
+    if (memo_ && k == 1 && !out_ocr->empty()) {
+        memo_key = MemoCache::ResultKey(IndexKey(root, filters) + "\n"
+                                        + kSimMeasureNames[opts.measure], alpha, *out_ocr);
+        MemoResult cached;
+        if (!opts.rebuild && memo_->FindResult(memo_key, &cached)) {
+            SearchResult result;
+            result.path = cached.path;
+            result.overlap = cached.overlap;
+            result.similarity = cached.similarity;
+            out_results->push_back(result);
+            if (stats)
+                stats->memo_result = 1;
+            memo_->Save();
+            return kResolveOk;
+        }
+    }
+
+    FinishRefresh(stats);
+    library->SearchTopK(*out_ocr, opts.measure, alpha, k, *out_results, stats);
+
+    if (!memo_key.empty() && !out_results->empty()) {
+        MemoResult result;
+        result.path = (*out_results)[0].path;
+        result.overlap = (*out_results)[0].overlap;
+        result.similarity = (*out_results)[0].similarity;
+        memo_->PutResult(memo_key, result);
+    }
+    if (memo_)
+        memo_->Save();
+
+    return out_results->empty()? kResolveNoMatch: kResolveOk;
+}
+
+template <typename DIM >
+Library* Resolver<DIM>::GetLibrary(const string& root, const vector<string>& filters,
+                                   const SearchOptions& opts, Stats *stats)
+{
+    FinishRefresh(stats);
+
+    string key = IndexKey(root, filters);
+    typename libraries_t::iterator it = libraries_.find(key);
+    if (it == libraries_.end()) {
+        it = libraries_.insert(make_pair(key, (Library*) 0)).first;
+    }
+    else if (opts.rebuild) {
+        delete it->second;
+        it->second = 0;
+    }
+    if (!it->second)
+        it->second = new Library(root, filters, opts);
+
+    return it->second;
+}
+
+template <typename DIM >
+void Resolver<DIM>::FinishRefresh(Stats *stats)
+{
+    if (!refresher_.IsRunning())
+        return;
+    refresher_.Join();
+    if (stats)
+        stats->Add(refresh_.stats);
+}
+
+template <typename DIM >
+int Resolver<DIM>::ResolvePage(const string& root, const vector<string>& filters,
+                               float alpha, const SearchOptions& opts, size_t k,
+                               vector<SearchResult> *out_results, string *out_ocr,
+                               Stats *stats)
+{
+    vector<BitmapView>& titles = titles_;
+    int selected;
+    uint64_t hash = 0;
+    {
+        StageTimer timer(stats, kStageGrab);
+        selected = grabber_.GrabAll(titles);
+        for (size_t i = 0; i < titles.size(); i++)
+            hash = HashBitmap(titles[i], hash);
+    }
+    if (selected < 0)
+        return kResolveNoSelection;
+
+    char params[64];
+    snprintf(params, sizeof(params), "\n%s\n%g\n%u",
+             kSimMeasureNames[opts.measure], alpha, (unsigned) k);
+    string query = IndexKey(root, filters) + params;
+    Library *library = GetLibrary(root, filters, opts, stats);
+
+    bool hit = page_.valid && !opts.rebuild && page_.hash == hash && page_.query == query;
+    if (hit) {
+        // the files may have changed since
+        library->Refresh(stats);
+        hit = (library->generation() == page_.generation);
+    }
+    if (!hit) {
+        page_.valid = false;
+        {
+            StageTimer timer(stats, kStageOcr);
+            unsigned glyphs_read = ocr_.RecognizeAll(titles, page_.ocr);
+            if (stats)
+                stats->glyph_ocr = glyphs_read;
+        }
+        library->SearchAll(page_.ocr, opts.measure, alpha, k, page_.results, stats);
+        page_.hash = hash;
+        page_.query = query;
+        page_.generation = library->generation();
+        page_.valid = true;
+    }
+
+    *out_ocr = page_.ocr[selected];
+    *out_results = page_.results[selected];
+    return out_results->empty()? kResolveNoMatch: kResolveOk;
+}
+
+// Creates the Resolver of the first of 'List' whose geometry is 'screen'
+template <typename List>
+struct ResolverFactory {
+    static ResolverBase* New(const ScreenInfo& screen, const char *fbdev,
+                             const string& modeldir, const string& lang,
+                             OcrProfile profile, unsigned ocr_workers)
+    {
+        typedef typename List::Head DIM;
+        if (ScreenMatches<DIM>(screen))
+            return new Resolver<DIM>(fbdev, modeldir, lang, profile, ocr_workers);
+        return ResolverFactory<typename List::Tail>::New(screen, fbdev, modeldir, lang,
+                                                         profile, ocr_workers);
+    }
+};
+
+template <>
+struct ResolverFactory<NoDevice> {
+    static ResolverBase* New(const ScreenInfo&, const char*, const string&, const string&,
+                             OcrProfile, unsigned)
+    {
+        return 0;
+    }
+};
+
+/**
+ * Creates the Resolver for the device whose geometry the frame buffer
+ * 'fbdev' reports, out of KnownDevices. An unknown geometry, or a plain
+ * file instead of a frame buffer, gets DeviceDimensions.
+ */
+inline ResolverBase*
+NewResolver(const char *fbdev, const string& modeldir, const string& lang,
+            OcrProfile profile = kOcrDefault, unsigned ocr_workers = 1)
+{
+    ScreenInfo screen;
+    ResolverBase *resolver = 0;
+    if (ReadScreenInfo(fbdev, &screen)) {
+        resolver = ResolverFactory<KnownDevices>::New(screen, fbdev, modeldir, lang,
+                                                      profile, ocr_workers);
+    }
+    if (!resolver)
+        resolver = new Resolver<DeviceDimensions>(fbdev, modeldir, lang, profile, ocr_workers);
+    return resolver;
+}
+
+}; // namespace lhack
+
+#endif // PIPELINE_H
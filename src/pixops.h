@@ -0,0 +1,287 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef PIXOPS_H
+#define PIXOPS_H
+
+/**
+ * The pixel kernels used by the frame grabber and the title matching. A
+ * NEON or SSE2 version is selected at compile time when the target
+ * supports it (define LHACK_NO_SIMD to force the scalar code). The ARM11
+ * cores of the Kindle DX and Kindle 3 have no NEON, so they use the
+ * scalar versions.
+ */
+
+#include <cstring>
+
+#include <stdint.h>
+
+#if !defined(LHACK_NO_SIMD) && defined(__ARM_NEON__)
+#define LHACK_SIMD_NEON
+#include <arm_neon.h>
+#elif !defined(LHACK_NO_SIMD) && defined(__SSE2__)
+#define LHACK_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace lhack {
+
+namespace scalar {
+
+// Checks whether all 'count' words of a scanline are equal to 'color'
+inline bool
+IsSolidLine(const unsigned *line, int count, unsigned color)
+{
+    for (int i = 0; i < count; i++)
+        if (line[i] != color)
+            return false;
+    return true;
+}
+
+// Converts 'nbytes' bytes of 4bpp pixels into 2*nbytes 8bpp pixels
+// (the leftmost pixel is in the high nibble)
+inline void
+Unpack4To8(const unsigned char *src, char *dst, int nbytes)
+{
+    for (int h = 0; h < nbytes; h++) {
+        dst[2*h] = 0xf0 & src[h];
+        dst[2*h + 1] = src[h] << 4;
+    }
+}
+
+// The number of bits set in 'x'
+inline unsigned
+PopCount(uint32_t x)
+{
+    x -= (x >> 1) & 0x55555555u;
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    x = (x + (x >> 4)) & 0x0f0f0f0fu;
+    return (x * 0x01010101u) >> 24;
+}
+
+// The number of bits which differ between the 'count' words of 'a' and 'b'
+inline unsigned
+HammingDistance(const uint32_t *a, const uint32_t *b, int count)
+{
+    unsigned distance = 0;
+    for (int i = 0; i < count; i++)
+        distance += PopCount(a[i] ^ b[i]);
+    return distance;
+}
+
+// The sum of the absolute differences of the 'count' bytes of 'a' and 'b'
+inline unsigned
+SumAbsDiff(const uint8_t *a, const uint8_t *b, int count)
+{
+    unsigned sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += (a[i] > b[i])? a[i] - b[i]: b[i] - a[i];
+    return sum;
+}
+
+}; // namespace scalar
+
+// Copies 'npixels' 8bpp pixels
+inline void
+Unpack8To8(const unsigned char *src, char *dst, int npixels)
+{
+    memcpy(dst, src, npixels);
+}
+
+// Converts 'npixels' RGB565 pixels (in the host's byte order) into their
+// 8bpp luma; a gray pixel keeps its level
+inline void
+Unpack16To8(const unsigned char *src, char *dst, int npixels)
+{
+    for (int i = 0; i < npixels; i++) {
+        uint16_t px;
+        memcpy(&px, src + 2*i, sizeof(px));
+        unsigned r = px >> 11, g = (px >> 5) & 0x3f, b = px & 0x1f;
+        r = (r << 3) | (r >> 2);
+        g = (g << 2) | (g >> 4);
+        b = (b << 3) | (b >> 2);
+        dst[i] = (77 * r + 150 * g + 29 * b) >> 8;
+    }
+}
+
+#if defined(LHACK_SIMD_NEON)
+
+inline bool
+IsSolidLine(const unsigned *line, int count, unsigned color)
+{
+    uint32x4_t ref = vdupq_n_u32(color);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t eq = vceqq_u32(vld1q_u32(line + i), ref);
+        uint32x2_t half = vand_u32(vget_low_u32(eq), vget_high_u32(eq));
+        if ((vget_lane_u32(half, 0) & vget_lane_u32(half, 1)) != 0xffffffffu)
+            return false;
+    }
+    return scalar::IsSolidLine(line + i, count - i, color);
+}
+
+inline void
+Unpack4To8(const unsigned char *src, char *dst, int nbytes)
+{
+    const uint8x16_t mask = vdupq_n_u8(0xf0);
+    int h = 0;
+    for (; h + 16 <= nbytes; h += 16) {
+        uint8x16_t px = vld1q_u8(src + h);
+        uint8x16x2_t out;
+        out.val[0] = vandq_u8(px, mask);
+        out.val[1] = vshlq_n_u8(px, 4);
+        vst2q_u8(reinterpret_cast<uint8_t*>(dst) + 2*h, out); // interleaves the two
+    }
+    scalar::Unpack4To8(src + h, dst + 2*h, nbytes - h);
+}
+
+inline unsigned
+HammingDistance(const uint32_t *a, const uint32_t *b, int count)
+{
+    uint32x4_t sum = vdupq_n_u32(0);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint8x16_t diff = vreinterpretq_u8_u32(veorq_u32(vld1q_u32(a + i), vld1q_u32(b + i)));
+        sum = vpadalq_u16(sum, vpaddlq_u8(vcntq_u8(diff)));
+    }
+    uint64x2_t sum2 = vpaddlq_u32(sum);
+    unsigned distance = vgetq_lane_u64(sum2, 0) + vgetq_lane_u64(sum2, 1);
+    return distance + scalar::HammingDistance(a + i, b + i, count - i);
+}
+
+inline unsigned
+SumAbsDiff(const uint8_t *a, const uint8_t *b, int count)
+{
+    uint32x4_t sum = vdupq_n_u32(0);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+        sum = vpadalq_u16(sum, vpaddlq_u8(vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    uint64x2_t sum2 = vpaddlq_u32(sum);
+    unsigned total = vgetq_lane_u64(sum2, 0) + vgetq_lane_u64(sum2, 1);
+    return total + scalar::SumAbsDiff(a + i, b + i, count - i);
+}
+
+#elif defined(LHACK_SIMD_SSE2)
+
+inline bool
+IsSolidLine(const unsigned *line, int count, unsigned color)
+{
+    __m128i ref = _mm_set1_epi32(color);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, ref)) != 0xffff)
+            return false;
+    }
+    return scalar::IsSolidLine(line + i, count - i, color);
+}
+
+inline void
+Unpack4To8(const unsigned char *src, char *dst, int nbytes)
+{
+    const __m128i mask = _mm_set1_epi8((char) 0xf0);
+    int h = 0;
+    for (; h + 16 <= nbytes; h += 16) {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + h));
+        __m128i hi = _mm_and_si128(px, mask);
+        __m128i lo = _mm_and_si128(_mm_slli_epi16(px, 4), mask);
+        __m128i *out = reinterpret_cast<__m128i*>(dst + 2*h);
+        _mm_storeu_si128(out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(hi, lo));
+    }
+    scalar::Unpack4To8(src + h, dst + 2*h, nbytes - h);
+}
+
+// SSE2 has no population count, so the bits are counted in parallel
+// within each byte, and the bytes summed with psadbw
+inline unsigned
+HammingDistance(const uint32_t *a, const uint32_t *b, int count)
+{
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+    __m128i sum = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi16(x, 1), m1));
+        x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi16(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi16(x, 4)), m4);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(x, _mm_setzero_si128()));
+    }
+    unsigned distance = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    return distance + scalar::HammingDistance(a + i, b + i, count - i);
+}
+
+inline unsigned
+SumAbsDiff(const uint8_t *a, const uint8_t *b, int count)
+{
+    __m128i sum = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+    }
+    unsigned total = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    return total + scalar::SumAbsDiff(a + i, b + i, count - i);
+}
+
+#else
+
+using scalar::IsSolidLine;
+using scalar::Unpack4To8;
+using scalar::HammingDistance;
+using scalar::SumAbsDiff;
+
+#endif
+
+/**
+ * Converts a scanline of a frame buffer with 'BPP' bits per pixel into
+ * 'npixels' 8bpp pixels. Only the depths specialized here are supported,
+ * so a device with any other fails to compile.
+ */
+template <int BPP>
+struct RowUnpacker;
+
+template <>
+struct RowUnpacker<4> {
+    static void Unpack(const unsigned char *src, char *dst, int npixels)
+    {
+        Unpack4To8(src, dst, npixels / 2);
+    }
+};
+
+template <>
+struct RowUnpacker<8> {
+    static void Unpack(const unsigned char *src, char *dst, int npixels)
+    {
+        Unpack8To8(src, dst, npixels);
+    }
+};
+
+template <>
+struct RowUnpacker<16> {
+    static void Unpack(const unsigned char *src, char *dst, int npixels)
+    {
+        Unpack16To8(src, dst, npixels);
+    }
+};
+
+}; // namespace lhack
+
+#endif // PIXOPS_H
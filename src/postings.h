@@ -0,0 +1,249 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef POSTINGS_H
+#define POSTINGS_H
+
+#include <vector>
+#include <string>
+#include <utility>
+
+#include <stdint.h>
+
+namespace lhack {
+
+using namespace std;
+
+typedef unsigned int pathid_t;
+
+// <pathid, count_of_ngram_occurences_in_path(pathid)>
+typedef pair<pathid_t, unsigned> index_atom_t;
+
+/**
+ * The frozen (compressed) posting list format.
+ *
+ * Each posting is stored as a varint of (pathid_delta << 1 | count_flag),
+ * where the delta is relative to the previous posting's pathid (to 0 for
+ * the first one). Most n-grams occur just once in a file name, so the
+ * count is implied to be 1 unless the flag is set, in which case a second
+ * varint with (count - 2) follows.
+ *
+ * Lists longer than kPostingBlock postings get a skip table, with one
+ * entry per block of kPostingBlock postings, so that a cursor can jump
+ * over whole blocks without decoding them.
+ */
+static const unsigned kPostingBlock = 64;
+
+struct SkipEntry {
+    uint32_t last_pathid;   // the pathid of the block's last posting
+    uint32_t offset;        // byte offset of the block from the list's start
+};
+
+// A posting list as stored in the index
+struct PostingList {
+    const uint8_t *data;
+    unsigned count;         // number of postings
+    const SkipEntry *skips; // one per block, or 0 if the list is a single block
+};
+
+static const PostingList kNoPostings = {0, 0, 0};
+
+inline void
+PutVarint(uint32_t value, string& out)
+{
+    while (value >= 0x80) {
+        out.push_back((char) (value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char) value);
+}
+
+inline const uint8_t*
+GetVarint(const uint8_t *p, uint32_t *value)
+{
+    uint32_t v = *p & 0x7f;
+    int shift = 7;
+    while (*p++ & 0x80) {
+        v |= (uint32_t) (*p & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = v;
+    return p;
+}
+
+/**
+ * Appends the compressed form of the sorted 'postings' to 'out', and
+ * its skip entries (if any) to 'out_skips'.
+ */
+template <typename Iterator>
+void
+EncodePostings(Iterator first, Iterator last, string& out, vector<SkipEntry>& out_skips)
+{
+    size_t start = out.size();
+    bool blocked = (size_t) (last - first) > kPostingBlock;
+    pathid_t prev = 0;
+    unsigned k = 0;
+    for (Iterator it = first; it != last; ++it, ++k) {
+        if (blocked && k % kPostingBlock == 0) {
+            SkipEntry skip;
+            skip.offset = out.size() - start;
+            out_skips.push_back(skip);
+        }
+        uint32_t delta = it->first - prev;
+        if (it->second == 1) {
+            PutVarint(delta << 1, out);
+        }
+        else {
+            PutVarint((delta << 1) | 1, out);
+            PutVarint(it->second - 2, out);
+        }
+        prev = it->first;
+        if (blocked)
+            out_skips.back().last_pathid = prev;
+    }
+}
+
+/**
+ * Iterates over a compressed posting list in increasing pathid order.
+ */
+class PostingCursor
+{
+public:
+    PostingCursor(): left_(0), pathid_(0), count_(0), atend_(true) {}
+
+    explicit PostingCursor(const PostingList& list) { Reset(list); }
+
+    void Reset(const PostingList& list)
+    {
+        list_ = list;
+        pos_ = list.data;
+        left_ = list.count;
+        pathid_ = 0;
+        count_ = 0;
+        atend_ = false;
+        Next();
+    }
+
+    bool AtEnd() const { return atend_; }
+    pathid_t pathid() const { return pathid_; }
+    unsigned count() const { return count_; }
+
+    // Moves to the next posting
+    void Next()
+    {
+        if (!left_) {
+            atend_ = true;
+            return;
+        }
+        uint32_t v;
+        pos_ = GetVarint(pos_, &v);
+        pathid_ += v >> 1;
+        if (v & 1) {
+            pos_ = GetVarint(pos_, &count_);
+            count_ += 2;
+        }
+        else {
+            count_ = 1;
+        }
+        -- left_;
+    }
+
+    // Moves to the first posting with pathid >= 'target'
+    void SkipTo(pathid_t target)
+    {
+        if (atend_ || pathid_ >= target)
+            return;
+
+        if (list_.skips) {
+            // the block holding the current posting
+            unsigned consumed = list_.count - left_;
+            unsigned block = (consumed - 1) / kPostingBlock;
+            unsigned nblocks = (list_.count + kPostingBlock - 1) / kPostingBlock;
+            unsigned b = block;
+            while (b < nblocks && list_.skips[b].last_pathid < target)
+                ++ b;
+            if (b == nblocks) {
+                left_ = 0;
+                atend_ = true;
+                return;
+            }
+            if (b > block) {
+                pos_ = list_.data + list_.skips[b].offset;
+                pathid_ = list_.skips[b - 1].last_pathid;
+                left_ = list_.count - b * kPostingBlock;
+                Next();
+            }
+        }
+
+        while (!atend_ && pathid_ < target)
+            Next();
+    }
+
+private:
+    PostingList list_;
+    const uint8_t *pos_;
+    unsigned left_;
+    pathid_t pathid_;
+    unsigned count_;
+    bool atend_;
+};
+
+/**
+ * Iterates over two posting lists as if they were one. All pathids in
+ * 'second' must be greater than those in 'first' (e.g. a frozen list
+ * and the postings added after it was frozen).
+ */
+class ChainedCursor
+{
+public:
+    ChainedCursor(const PostingList& first, const PostingList& second):
+        first_(first), second_(second), insecond_(first_.AtEnd()) {}
+
+    bool AtEnd() const { return insecond_ && second_.AtEnd(); }
+    pathid_t pathid() const { return insecond_? second_.pathid(): first_.pathid(); }
+    unsigned count() const { return insecond_? second_.count(): first_.count(); }
+
+    void Next()
+    {
+        if (insecond_) {
+            second_.Next();
+        }
+        else {
+            first_.Next();
+            insecond_ = first_.AtEnd();
+        }
+    }
+
+    void SkipTo(pathid_t target)
+    {
+        if (!insecond_) {
+            first_.SkipTo(target);
+            if (!first_.AtEnd())
+                return;
+            insecond_ = true;
+        }
+        second_.SkipTo(target);
+    }
+
+private:
+    PostingCursor first_;
+    PostingCursor second_;
+    bool insecond_;
+};
+
+}; // namespace lhack
+
+#endif // POSTINGS_H
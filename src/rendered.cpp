@@ -0,0 +1,304 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "rendered.h"
+#include "serial.h"
+
+namespace lhack {
+
+using namespace std;
+
+namespace {
+
+const char kRenderedMagic[4] = {'L', 'H', 'R', 'T'};
+const uint32_t kRenderedVersion = 1;
+
+// The length of the UTF-8 character starting with the byte 'c'
+inline size_t
+Utf8Length(unsigned char c)
+{
+    if (c < 0xc0)
+        return 1;
+    if (c < 0xe0)
+        return 2;
+    if (c < 0xf0)
+        return 3;
+    return 4;
+}
+
+template <typename T>
+void
+PutArray(string& out, const vector<T>& values)
+{
+    if (!values.empty())
+        out.append(reinterpret_cast<const char*>(&values[0]), values.size() * sizeof(T));
+}
+
+} // anonymous namespace
+
+string
+DisplayName(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name? name + 1: path;
+    const char *end = strrchr(name, '.');
+    if (!end || end == name)
+        end = name + strlen(name);
+
+    string out;
+    for (const char *p = name; p < end; p++) {
+        char c = (*p == '_')? ' ': *p;
+        if (c == ' ' && (out.empty() || out[out.size() - 1] == ' '))
+            continue;
+        out.push_back(c);
+    }
+    if (!out.empty() && out[out.size() - 1] == ' ')
+        out.erase(out.size() - 1);
+    return out;
+}
+
+TitleRenderer::TitleRenderer(const GlyphSet& glyphs): glyphs_(glyphs)
+{
+    for (int c = 0; c < 128; c++)
+        ascii_[c] = -1;
+    widths_.resize(glyphs.size());
+    for (size_t i = 0; i < glyphs.size(); i++) {
+        widths_[i] = GlyphCellWidth(glyphs.cell(i));
+        const string& text = glyphs.text(i);
+        if (text.empty() || Utf8Length(text[0]) != text.size())
+            continue;
+        unsigned char c = text[0];
+        if (c < 128) {
+            if (ascii_[c] < 0)
+                ascii_[c] = i;
+        }
+        else {
+            others_.insert(make_pair(text, (int) i));
+        }
+    }
+}
+
+int
+TitleRenderer::Find(const string& text, size_t pos, size_t *len) const
+{
+    unsigned char c = text[pos];
+    if (c < 128) {
+        *len = 1;
+        return ascii_[c];
+    }
+    *len = Utf8Length(c);
+    map<string, int>::const_iterator it = others_.find(text.substr(pos, *len));
+    return (it == others_.end())? -1: it->second;
+}
+
+bool
+TitleRenderer::Render(const string& text, TitleShape *out) const
+{
+    return Render(text, out, 0);
+}
+
+// ... and puts where each glyph ends in 'out_ends', if given
+bool
+TitleRenderer::Render(const string& text, TitleShape *out, vector<int> *out_ends) const
+{
+    inkcol_t columns[kShapeWidth];
+    memset(columns, 0, sizeof(columns));
+
+    int x = 0;
+    bool space = false;
+    size_t len;
+    for (size_t pos = 0; pos < text.size(); pos += len) {
+        if (text[pos] == ' ') {
+            len = 1;
+            space = true;
+            continue;
+        }
+        int glyph = Find(text, pos, &len);
+        if (glyph < 0)
+            return false;
+        if (x > 0)
+            x += space? glyphs_.word_gap(): glyphs_.letter_gap();
+        space = false;
+
+        const inkcol_t *cell = glyphs_.cell(glyph);
+        for (int i = 0; i < widths_[glyph] && x + i < kShapeWidth; i++)
+            columns[x + i] = cell[i];
+        x += widths_[glyph];
+        if (out_ends)
+            out_ends->push_back(min(x, kShapeWidth));
+    }
+
+    MakeShape(columns, 0, min(x, kShapeWidth), out);
+    return out->ink > 0;
+}
+
+bool
+TitleRenderer::Matches(const string& text, const TitleShape& shape) const
+{
+    TitleShape drawn;
+    vector<int> ends;
+    if (!Render(text, &drawn, &ends))
+        return false;
+    // whatever the title has past the drawn text goes with the last glyph
+    ends.back() = max(shape.width, drawn.width);
+
+    int x0 = 0;
+    for (size_t g = 0; g < ends.size(); g++) {
+        int x1 = ends[g];
+        unsigned ink = 0;
+        for (int x = x0; x < x1; x++)
+            ink += scalar::PopCount(shape.columns[x]) + scalar::PopCount(drawn.columns[x]);
+        unsigned distance = HammingDistance(shape.columns + x0, drawn.columns + x0, x1 - x0);
+        if (distance * 100 > kGlyphMismatch * ink)
+            return false;
+        x0 = x1;
+    }
+    return true;
+}
+
+void
+RenderedTitles::Update(const NgramIndex& index, const GlyphSet& glyphs, const string& file)
+{
+    uint64_t fingerprint = index.Fingerprint();
+    uint64_t glyphs_hash = glyphs.Hash();
+    if (fingerprint == fingerprint_ && glyphs_hash == glyphs_hash_)
+        return;
+    if (!file.empty() && Load(file, fingerprint, glyphs_hash, index.nfrozen()))
+        return;
+
+    ids_.clear();
+    inks_.clear();
+    bins_.clear();
+    TitleRenderer renderer(glyphs);
+    TitleShape shape;
+    for (pathid_t id = 0; id < index.nfrozen(); id++) {
+        if (!renderer.Render(DisplayName(index.path(id)), &shape))
+            continue;
+        ids_.push_back(id);
+        inks_.push_back(shape.signature.ink);
+        bins_.insert(bins_.end(), shape.signature.bins, shape.signature.bins + kSignatureBins);
+    }
+    fingerprint_ = fingerprint;
+    glyphs_hash_ = glyphs_hash;
+    if (!file.empty())
+        Save(file);
+}
+
+int
+RenderedTitles::Match(const TitleShape& shape, const NgramIndex& index,
+                      const GlyphSet& glyphs, unsigned *out_distance) const
+{
+    const TitleSignature& query = shape.signature;
+    int best_id = -1, second_id = -1;
+    unsigned best = ~0u, second = ~0u;
+    for (size_t i = 0; i < ids_.size(); i++) {
+        // the bins can't be closer than their sums
+        unsigned bound = (inks_[i] > query.ink)? inks_[i] - query.ink: query.ink - inks_[i];
+        if (bound >= second || index.IsErased(ids_[i]))
+            continue;
+        unsigned distance = SumAbsDiff(query.bins, &bins_[i * kSignatureBins], kSignatureBins);
+        if (distance < best) {
+            second = best;
+            second_id = best_id;
+            best = distance;
+            best_id = ids_[i];
+        }
+        else if (distance < second) {
+            second = distance;
+            second_id = ids_[i];
+        }
+    }
+
+    // The signatures only tell how much ink there is where, so the names
+    // are drawn again to be compared bit by bit
+    unsigned limit = query.ink * kRenderMismatch / 100;
+    if (best_id < 0 || best > limit)
+        return -1;
+    TitleRenderer renderer(glyphs);
+    if (!renderer.Matches(DisplayName(index.path(best_id)), shape))
+        return -1;
+    if (second_id >= 0 && second <= limit
+            && renderer.Matches(DisplayName(index.path(second_id)), shape))
+        return -1;
+    *out_distance = best;
+    return best_id;
+}
+
+bool
+RenderedTitles::Load(const string& file, uint64_t fingerprint, uint64_t glyphs_hash,
+                     pathid_t npaths)
+{
+    ifstream in(file.c_str(), ios::in | ios::binary);
+    if (!in)
+        return false;
+    ostringstream buf;
+    buf << in.rdbuf();
+    string data = buf.str();
+
+    ByteReader reader(data);
+    char magic[4];
+    for (int i = 0; i < 4; i++)
+        magic[i] = reader.Raw<char>();
+    if (memcmp(magic, kRenderedMagic, sizeof(magic)) != 0
+            || reader.Raw<uint32_t>() != kRenderedVersion
+            || reader.Raw<uint64_t>() != fingerprint
+            || reader.Raw<uint64_t>() != glyphs_hash)
+        return false;
+    uint32_t count = reader.Raw<uint32_t>();
+    size_t header = 4 + sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t);
+    if (!reader.ok() || data.size() != header + count * (2 * sizeof(uint32_t) + kSignatureBins))
+        return false;
+
+    const char *p = data.data() + header;
+    ids_.resize(count);
+    inks_.resize(count);
+    bins_.resize(count * kSignatureBins);
+    if (count) {
+        memcpy(&ids_[0], p, count * sizeof(uint32_t));
+        p += count * sizeof(uint32_t);
+        memcpy(&inks_[0], p, count * sizeof(uint32_t));
+        p += count * sizeof(uint32_t);
+        memcpy(&bins_[0], p, count * kSignatureBins);
+    }
+    // the fingerprint vouches for the index, not for this file; Match() looks the ids up
+    for (size_t i = 0; i < ids_.size(); i++)
+        if (ids_[i] >= npaths)
+            return false;
+    fingerprint_ = fingerprint;
+    glyphs_hash_ = glyphs_hash;
+    return true;
+}
+
+bool
+RenderedTitles::Save(const string& file) const
+{
+    string data(kRenderedMagic, sizeof(kRenderedMagic));
+    PutRaw(data, kRenderedVersion);
+    PutRaw(data, fingerprint_);
+    PutRaw(data, glyphs_hash_);
+    PutRaw(data, (uint32_t) ids_.size());
+    PutArray(data, ids_);
+    PutArray(data, inks_);
+    PutArray(data, bins_);
+    return ReplaceFile(file, data.data(), data.size());
+}
+
+}; // namespace lhack
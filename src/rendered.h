@@ -0,0 +1,194 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef RENDERED_H
+#define RENDERED_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include "glyphs.h"
+#include "ngindex.h"
+#include "pixops.h"
+
+namespace lhack {
+
+using namespace std;
+
+// A title's signature is its ink, summed over bins of kSignatureBinWidth
+// columns from its first column with ink. The columns past the last bin
+// are left out.
+const int kSignatureBins = 128;
+const int kSignatureBinWidth = 4;
+const int kShapeWidth = kSignatureBins * kSignatureBinWidth;
+
+// How far (the sum of the differences of the bins) a file name may be
+// from a title to be taken for it, in percent of the title's ink. The
+// closest name is then checked bit by bit, as a glyph would be (see
+// kGlyphMismatch).
+const unsigned kRenderMismatch = 10;
+
+struct TitleSignature {
+    uint8_t bins[kSignatureBins];   // saturated at 255
+    unsigned ink;                   // the sum of the bins
+};
+
+// The first kShapeWidth columns of a title, from the first one with ink,
+// and their signature
+struct TitleShape {
+    inkcol_t columns[kShapeWidth];
+    int width;
+    unsigned ink;                   // the pixels with ink
+    TitleSignature signature;
+};
+
+// Makes the shape of the columns [left, right)
+inline void
+MakeShape(const inkcol_t *columns, int left, int right, TitleShape *out)
+{
+    out->width = min(right - left, kShapeWidth);
+    memcpy(out->columns, columns + left, out->width * sizeof(inkcol_t));
+    memset(out->columns + out->width, 0, (kShapeWidth - out->width) * sizeof(inkcol_t));
+
+    unsigned bins[kSignatureBins];
+    memset(bins, 0, sizeof(bins));
+    for (int x = 0; x < out->width; x++)
+        bins[x / kSignatureBinWidth] += scalar::PopCount(out->columns[x]);
+
+    TitleSignature& sig = out->signature;
+    out->ink = sig.ink = 0;
+    for (int i = 0; i < kSignatureBins; i++) {
+        out->ink += bins[i];
+        sig.bins[i] = (bins[i] > 255)? 255: bins[i];
+        sig.ink += sig.bins[i];
+    }
+}
+
+/**
+ * Makes the shape of the title in 'title' (as grabbed, see FrameGrabber),
+ * i.e. of its columns without the metadata (see FindTitleColumns()).
+ * Returns false if 'glyphs' can't draw the file names to compare it with,
+ * or are for another title height, or if the title has no ink.
+ */
+template <typename DIM>
+bool
+GrabbedShape(const GlyphSet& glyphs, const BitmapView& title, TitleShape *out)
+{
+    int width = title.width();
+    if (!glyphs.CanRender() || !title.IsValid() || title.bpp() != 8
+            || title.height() != glyphs.height() || width > DIM::kEntryLen)
+        return false;
+
+    inkcol_t columns[DIM::kEntryLen];
+    int left, right;
+    InkColumns(title, columns);
+    if (!FindTitleColumns<DIM>(columns, width, &left, &right))
+        return false;
+    MakeShape(columns, left, right, out);
+    return true;
+}
+
+// The title the shell shows for a file without metadata: its name without
+// the extension, the underscores as spaces, and the runs of spaces as one
+string DisplayName(const char *path);
+
+/**
+ * Draws texts with the glyphs of a GlyphSet, as the shell draws them: one
+ * glyph per character, GlyphSet::letter_gap() apart within a word and
+ * GlyphSet::word_gap() between the words. Only the glyphs of a single
+ * character are used.
+ */
+class TitleRenderer
+{
+public:
+    explicit TitleRenderer(const GlyphSet& glyphs);
+
+    // Draws 'text' into a shape. Returns false if a character of it has
+    // no glyph.
+    bool Render(const string& text, TitleShape *out) const;
+
+    // Draws 'text' and compares it with 'shape' glyph by glyph: true if
+    // each glyph (and the gap before it) differs by at most kGlyphMismatch
+    // of their pixels
+    bool Matches(const string& text, const TitleShape& shape) const;
+
+private:
+    int Find(const string& text, size_t pos, size_t *len) const;
+    bool Render(const string& text, TitleShape *out, vector<int> *out_ends) const;
+
+    const GlyphSet& glyphs_;
+    int ascii_[128];                // the glyph of each ASCII character, or -1
+    map<string, int> others_;       // ... and of the others (in UTF-8)
+    vector<int> widths_;
+};
+
+/**
+ * The signatures of the file names of an index, drawn with the glyphs,
+ * which the title grabbed from the screen is matched against instead of
+ * being read (see Library::MatchRendered()). They are saved next to the
+ * index file, in the host's byte order, as
+ *
+ *   char magic[4], uint32_t version
+ *   uint64_t fingerprint (of the index, see NgramIndex::Fingerprint())
+ *   uint64_t glyphs (see GlyphSet::Hash())
+ *   uint32_t count, uint32_t pathids[count], uint32_t inks[count]
+ *   uint8_t bins[count][kSignatureBins]
+ *
+ * Only the frozen paths are drawn, and only those whose names have
+ * glyphs for all their characters.
+ */
+class RenderedTitles
+{
+public:
+    RenderedTitles(): fingerprint_(0), glyphs_hash_(0) {}
+
+    // Makes sure the signatures are those of the frozen paths of 'index',
+    // drawn with 'glyphs': loads them from 'file', or draws them and saves
+    // them there ("" keeps them in memory only)
+    void Update(const NgramIndex& index, const GlyphSet& glyphs, const string& file);
+
+    /**
+     * Finds the path whose name looks like the title 'query': the closest
+     * signature, within kRenderMismatch of its ink, whose name drawn with
+     * 'glyphs' matches the title bit by bit, while the next closest one's
+     * doesn't. Returns its pathid and puts the distance of the signatures
+     * in 'out_distance', or returns -1 if there is no such path. The
+     * erased paths are skipped.
+     */
+    int Match(const TitleShape& query, const NgramIndex& index, const GlyphSet& glyphs,
+              unsigned *out_distance) const;
+
+    size_t size() const { return ids_.size(); }
+
+private:
+    bool Load(const string& file, uint64_t fingerprint, uint64_t glyphs_hash,
+              pathid_t npaths);
+    bool Save(const string& file) const;
+
+    uint64_t fingerprint_;
+    uint64_t glyphs_hash_;
+    vector<uint32_t> ids_;
+    vector<uint32_t> inks_;
+    vector<uint8_t> bins_;      // kSignatureBins per path
+};
+
+};
+
+#endif // RENDERED_H
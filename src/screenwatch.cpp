@@ -0,0 +1,184 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cstdio>
+
+#include <sys/stat.h>
+
+#include "screenwatch.h"
+
+namespace lhack {
+
+using namespace std;
+
+namespace {
+
+// Whether the file an answer found is still there. An answer that found
+// none is never reused, as the file may have been added since.
+bool
+StillExists(const vector<SearchResult>& results)
+{
+    struct stat st;
+    return !results.empty() && stat(results[0].path.c_str(), &st) == 0;
+}
+
+} // anonymous namespace
+
+ScreenWatch::ScreenWatch(ResolverBase *resolver, unsigned interval_ms):
+    resolver_(resolver), interval_ms_(max(interval_ms, 1u)), have_query_(false),
+    stop_(false), woken_(false)
+{
+}
+
+ScreenWatch::~ScreenWatch()
+{
+    Stop();
+}
+
+bool
+ScreenWatch::Start()
+{
+    if (thread_.IsRunning())
+        return true;
+    stop_ = false;
+
+    // The signals are left to the main thread, whose accept() they interrupt
+    return thread_.StartMasked(this);
+}
+
+void
+ScreenWatch::Stop()
+{
+    {
+        ScopedLock l(wait_lock_);
+        stop_ = true;
+        wakeup_.Signal();
+    }
+    thread_.Join();
+}
+
+string
+ScreenWatch::QueryKey(const Query& query)
+{
+    char params[64];
+    snprintf(params, sizeof(params), "\n%s\n%g\n%u",
+             kSimMeasureNames[query.opts.measure], query.alpha, (unsigned) query.k);
+    return IndexKey(query.root, query.filters) + params;
+}
+
+int
+ScreenWatch::ResolveTopK(const string& root, const vector<string>& filters,
+                         float alpha, const SearchOptions& opts, size_t k,
+                         vector<SearchResult> *out_results, string *out_ocr,
+                         Stats *stats)
+{
+    bool watching = thread_.IsRunning();
+    if (watching) {
+        ScopedLock l(wait_lock_);
+        woken_ = true;
+        wakeup_.Signal();
+    }
+
+    ScopedLock l(lock_);
+    Query query;
+    query.root = root;
+    query.filters = filters;
+    query.alpha = alpha;
+    query.opts = opts;
+    query.opts.rebuild = false;
+    query.k = k;
+    string key = QueryKey(query);
+
+    uint64_t fingerprint = watching? resolver_->SelectionFingerprint(): 0;
+    if (fingerprint && !opts.rebuild && answer_.valid && answer_.fingerprint == fingerprint
+            && answer_.query == key && StillExists(answer_.results)) {
+        *out_results = answer_.results;
+        *out_ocr = answer_.ocr;
+        if (stats)
+            stats->screen_watch = 1;
+        return answer_.status;
+    }
+
+    int status = resolver_->ResolveTopK(root, filters, alpha, opts, k,
+                                        out_results, out_ocr, stats);
+    query_ = query;
+    have_query_ = true;
+
+    // the same selection needs nothing more, until it changes
+    if (fingerprint && resolver_->SelectionFingerprint() == fingerprint) {
+        answer_.valid = true;
+        answer_.fingerprint = fingerprint;
+        answer_.query = key;
+        answer_.status = status;
+        answer_.results = *out_results;
+        answer_.ocr = *out_ocr;
+    }
+    return status;
+}
+
+bool
+ScreenWatch::Sleep(unsigned ms, bool *woken)
+{
+    ScopedLock l(wait_lock_);
+    if (!stop_ && !woken_)
+        wakeup_.WaitFor(wait_lock_, ms);
+    *woken = woken_;
+    woken_ = false;
+    return !stop_;
+}
+
+void
+ScreenWatch::Run()
+{
+    unsigned interval = interval_ms_;
+    uint64_t seen = 0;
+    bool woken;
+    while (Sleep(interval, &woken)) {
+        if (woken)
+            interval = interval_ms_;
+
+        ScopedLock l(lock_);
+        uint64_t fingerprint = resolver_->SelectionFingerprint();
+        if (fingerprint != seen) {
+            // resolved on the next look, if it stays
+            seen = fingerprint;
+            interval = interval_ms_;
+            continue;
+        }
+
+        string key = have_query_? QueryKey(query_): string();
+        if (!fingerprint || !have_query_
+                || (answer_.valid && answer_.fingerprint == fingerprint && answer_.query == key)) {
+            interval = min(interval * 2, max(kMaxWatchIntervalMs, interval_ms_));
+            continue;
+        }
+
+        Answer answer;
+        answer.status = resolver_->ResolveTopK(query_.root, query_.filters, query_.alpha,
+                                               query_.opts, query_.k, &answer.results,
+                                               &answer.ocr);
+        // the selection may have moved on in the meantime
+        if (resolver_->SelectionFingerprint() == fingerprint) {
+            answer.valid = true;
+            answer.fingerprint = fingerprint;
+            answer.query = key;
+            answer_ = answer;
+        }
+    }
+}
+
+}; // namespace lhack
@@ -0,0 +1,124 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef SCREENWATCH_H
+#define SCREENWATCH_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "pipeline.h"
+#include "threads.h"
+
+namespace lhack {
+
+using namespace std;
+
+// The longest the screen watch sleeps between two looks at the screen,
+// however long the screen has been idle
+const unsigned kMaxWatchIntervalMs = 8000;
+
+/**
+ * Follows the selection on the screen from a background thread, and
+ * resolves each new one before it is asked for, so that the request finds
+ * the answer ready (see lhackd's -w).
+ *
+ * The screen is looked at (see FrameGrabber::Fingerprint()) every
+ * 'interval_ms' milliseconds at first, and half as often after each look
+ * that finds nothing new, down to once in kMaxWatchIntervalMs. A change
+ * of the selection, or a request, brings the rate back up. A selection
+ * is only resolved once it has stayed the same for one interval, so that
+ * scrolling through a page doesn't start the OCR on every entry on the
+ * way. It is resolved with the parameters of the last request, hence
+ * nothing is done before the first one.
+ *
+ * The resolver is only used by one thread at a time, so a request coming
+ * while the watch resolves the selection waits for that answer.
+ */
+class ScreenWatch
+{
+public:
+    ScreenWatch(ResolverBase *resolver, unsigned interval_ms);
+    ~ScreenWatch();
+
+    // Starts the watch thread. Without it ResolveTopK() only passes the
+    // requests on.
+    bool Start();
+    void Stop();
+
+    // Same as ResolverBase::ResolveTopK(), but answered right away if the
+    // watch has resolved the current selection with the same parameters
+    // (and found a file, which still exists)
+    int ResolveTopK(const string& root, const vector<string>& filters,
+                    float alpha, const SearchOptions& opts, size_t k,
+                    vector<SearchResult> *out_results, string *out_ocr,
+                    Stats *stats = 0);
+
+    // The watch thread
+    void Run();
+
+private:
+    struct Query {
+        Query(): alpha(0), k(1) {}
+
+        string root;
+        vector<string> filters;
+        float alpha;
+        SearchOptions opts;
+        size_t k;
+    };
+
+    struct Answer {
+        Answer(): valid(false), fingerprint(0), status(kResolveNoSelection) {}
+
+        bool valid;
+        uint64_t fingerprint;   // of the selection it is for
+        string query;           // ... and the parameters, see QueryKey()
+        int status;
+        vector<SearchResult> results;
+        string ocr;
+    };
+
+    ScreenWatch(const ScreenWatch&);
+    ScreenWatch& operator=(const ScreenWatch&);
+
+    static string QueryKey(const Query& query);
+
+    // Sleeps for 'ms' unless stopped or woken up by a request. Returns
+    // false when stopped; '*woken' tells whether a request came.
+    bool Sleep(unsigned ms, bool *woken);
+
+    ResolverBase *resolver_;
+    unsigned interval_ms_;
+
+    Mutex lock_;            // held while the resolver is used
+    Query query_;           // the last request's
+    bool have_query_;
+    Answer answer_;
+
+    Mutex wait_lock_;
+    CondVar wakeup_;
+    bool stop_;
+    bool woken_;
+
+    Thread<ScreenWatch> thread_;
+};
+
+};
+
+#endif // SCREENWATCH_H
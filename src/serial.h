@@ -0,0 +1,124 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/**
+ * The fields of the small files lhack keeps besides the index (the memo
+ * cache, the glyphs, the drawn file names). They are in the host's byte
+ * order, and a string is a uint32_t length followed by the bytes.
+ */
+
+namespace lhack {
+
+using namespace std;
+
+// The longest string accepted from a file
+const uint32_t kMaxSerialString = 64 * 1024;
+
+template <typename T>
+inline void
+PutRaw(string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void
+PutString(string& out, const string& s)
+{
+    PutRaw(out, (uint32_t) s.size());
+    out.append(s);
+}
+
+/**
+ * Saves 'size' bytes to 'file' through a temporary file renamed over it,
+ * so that a reader never sees a partly written file. The temporary name
+ * has the process and the thread in it, as a daemon may be saving
+ * several files at once, from different threads.
+ */
+inline bool
+ReplaceFile(const string& file, const char *data, size_t size)
+{
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".tmp%d.%lx", (int) getpid(), (unsigned long) pthread_self());
+    string tmpfile = file + suffix;
+
+    ofstream out(tmpfile.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out)
+        return false;
+    out.write(data, size);
+    out.close();
+    if (!out || rename(tmpfile.c_str(), file.c_str()) != 0) {
+        unlink(tmpfile.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the fields back, failing on the first one that doesn't fit
+class ByteReader
+{
+public:
+    explicit ByteReader(const string& data): data_(data), pos_(0), ok_(true) {}
+
+    bool ok() const { return ok_; }
+
+    // The bytes not read yet
+    size_t left() const { return (pos_ < data_.size())? data_.size() - pos_: 0; }
+
+    template <typename T>
+    T Raw()
+    {
+        T value = T();
+        if (ok_ && pos_ + sizeof(value) <= data_.size())
+            memcpy(&value, data_.data() + pos_, sizeof(value));
+        else
+            ok_ = false;
+        pos_ += sizeof(value);
+        return value;
+    }
+
+    string String()
+    {
+        uint32_t len = Raw<uint32_t>();
+        if (!ok_ || len > kMaxSerialString || pos_ + len > data_.size()) {
+            ok_ = false;
+            return string();
+        }
+        pos_ += len;
+        return data_.substr(pos_ - len, len);
+    }
+
+private:
+    const string& data_;
+    size_t pos_;
+    bool ok_;
+};
+
+};
+
+#endif // SERIAL_H
@@ -0,0 +1,186 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+#include <cstdio>
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+namespace lhack {
+
+using namespace std;
+
+// The stages of a lookup, timed when the statistics are requested
+enum Stage {
+    kStageInit,         // loading Tesseract and opening the frame buffer
+    kStageGrab,
+    kStageOcr,
+    kStageIndexLoad,    // opening the saved index, checking it for changes
+    kStageCrawl,
+    kStageIndexBuild,
+    kStageMatch,
+    kStageDaemon,       // the round trip to lhackd
+    kNumStages
+};
+
+static const char* const kStageNames[kNumStages] = {
+    "init", "grab", "ocr", "index_load", "crawl", "index_build", "match", "daemon"
+};
+
+// Microseconds on the monotonic clock
+inline uint64_t
+NowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The peak resident set size of the process in KiB
+inline long
+PeakRssKb()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f) {
+        char line[128];
+        long kb = -1;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+                break;
+        }
+        fclose(f);
+        if (kb >= 0)
+            return kb;
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/**
+ * Where the time of one lookup went, and how much work the search did.
+ * The functions taking a Stats pointer skip all the bookkeeping when it
+ * is 0, so the statistics cost nothing unless they are asked for.
+ */
+struct Stats {
+    Stats():
+        files_visited(0), files_matched(0), ngrams(0), postings(0),
+        candidates(0), candidates_left(0), memo_ocr(0), memo_result(0), glyph_ocr(0),
+        render_match(0), screen_watch(0)
+    {
+        for (int i = 0; i < kNumStages; i++)
+            stage_us[i] = 0;
+    }
+
+    uint64_t stage_us[kNumStages];
+
+    unsigned files_visited;     // by the crawl, before the filters
+    unsigned files_matched;     // ... and after them
+    unsigned ngrams;            // the size of the index
+    unsigned postings;
+    unsigned candidates;        // generated by BestMatch() from the signature
+    unsigned candidates_left;   // ... still there after the pruning
+    unsigned memo_ocr;          // 1 if the OCR result was remembered
+    unsigned memo_result;       // 1 if the matched file was remembered
+    unsigned glyph_ocr;         // the titles read with the glyphs, not Tesseract
+    unsigned render_match;      // 1 if the title matched a drawn file name
+    unsigned screen_watch;      // 1 if the selection was resolved ahead of the request
+
+    // Adds the statistics of another part of the same lookup, e.g. one
+    // done on another thread
+    void Add(const Stats& other)
+    {
+        for (int i = 0; i < kNumStages; i++)
+            stage_us[i] += other.stage_us[i];
+        files_visited += other.files_visited;
+        files_matched += other.files_matched;
+        ngrams += other.ngrams;
+        postings += other.postings;
+        candidates += other.candidates;
+        candidates_left += other.candidates_left;
+        memo_ocr += other.memo_ocr;
+        memo_result += other.memo_result;
+        glyph_ocr += other.glyph_ocr;
+        render_match += other.render_match;
+        screen_watch += other.screen_watch;
+    }
+
+    // Formats the statistics (and the peak RSS of this process) as a JSON
+    // object on a single line. 'nested', if not empty, is added as the
+    // member "daemon" (the statistics lhackd reported).
+    string ToJson(const string& nested = string()) const
+    {
+        char buf[128];
+        string json("{");
+        for (int i = 0; i < kNumStages; i++) {
+            snprintf(buf, sizeof(buf), "\"%s_us\":%llu,", kStageNames[i],
+                     (unsigned long long) stage_us[i]);
+            json.append(buf);
+        }
+        snprintf(buf, sizeof(buf),
+                 "\"files_visited\":%u,\"files_matched\":%u,\"ngrams\":%u,\"postings\":%u,",
+                 files_visited, files_matched, ngrams, postings);
+        json.append(buf);
+        snprintf(buf, sizeof(buf), "\"candidates\":%u,\"candidates_left\":%u,",
+                 candidates, candidates_left);
+        json.append(buf);
+        snprintf(buf, sizeof(buf),
+                 "\"memo_ocr\":%u,\"memo_result\":%u,\"glyph_ocr\":%u,\"render_match\":%u,"
+                 "\"screen_watch\":%u,",
+                 memo_ocr, memo_result, glyph_ocr, render_match, screen_watch);
+        json.append(buf);
+        snprintf(buf, sizeof(buf), "\"peak_rss_kb\":%ld", PeakRssKb());
+        json.append(buf);
+        if (!nested.empty()) {
+            json.append(",\"daemon\":");
+            json.append(nested);
+        }
+        json.push_back('}');
+        return json;
+    }
+};
+
+// Adds the time until it goes out of scope to a stage (if 'stats' isn't 0)
+class StageTimer
+{
+public:
+    StageTimer(Stats *stats, Stage stage):
+        stats_(stats), stage_(stage), start_(stats? NowUs(): 0) {}
+
+    ~StageTimer()
+    {
+        if (stats_)
+            stats_->stage_us[stage_] += NowUs() - start_;
+    }
+
+private:
+    StageTimer(const StageTimer&);
+    StageTimer& operator=(const StageTimer&);
+
+    Stats *stats_;
+    Stage stage_;
+    uint64_t start_;
+};
+
+};
+
+#endif // STATS_H
@@ -0,0 +1,171 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+namespace lhack {
+
+// Thin wrappers around pthreads (the toolchain predates std::thread)
+
+class Mutex
+{
+public:
+    Mutex() { pthread_mutex_init(&mutex_, 0); }
+    ~Mutex() { pthread_mutex_destroy(&mutex_); }
+
+    void Lock() { pthread_mutex_lock(&mutex_); }
+    void Unlock() { pthread_mutex_unlock(&mutex_); }
+
+private:
+    friend class CondVar;
+
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+    pthread_mutex_t mutex_;
+};
+
+class ScopedLock
+{
+public:
+    explicit ScopedLock(Mutex& mutex): mutex_(mutex) { mutex_.Lock(); }
+    ~ScopedLock() { mutex_.Unlock(); }
+
+private:
+    ScopedLock(const ScopedLock&);
+    ScopedLock& operator=(const ScopedLock&);
+
+    Mutex& mutex_;
+};
+
+class CondVar
+{
+public:
+    CondVar() { pthread_cond_init(&cond_, 0); }
+    ~CondVar() { pthread_cond_destroy(&cond_); }
+
+    void Wait(Mutex& mutex) { pthread_cond_wait(&cond_, &mutex.mutex_); }
+
+    // Waits at most 'ms' milliseconds; false if the time ran out
+    bool WaitFor(Mutex& mutex, unsigned ms)
+    {
+        struct timeval now;
+        gettimeofday(&now, 0);
+        unsigned long long ns = (unsigned long long) now.tv_usec * 1000
+                              + (unsigned long long) ms * 1000000;
+        struct timespec deadline;
+        deadline.tv_sec = now.tv_sec + ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+        return pthread_cond_timedwait(&cond_, &mutex.mutex_, &deadline) == 0;
+    }
+    void Signal() { pthread_cond_signal(&cond_); }
+    void Broadcast() { pthread_cond_broadcast(&cond_); }
+
+private:
+    CondVar(const CondVar&);
+    CondVar& operator=(const CondVar&);
+
+    pthread_cond_t cond_;
+};
+
+/**
+ * Runs job.Run() on a separate thread. Join() must be called before
+ * the object (or the job) goes away.
+ */
+template <typename Job>
+class Thread
+{
+public:
+    Thread(): running_(false) {}
+
+    bool Start(Job *job)
+    {
+        running_ = (pthread_create(&thread_, 0, &Thread::Main, job) == 0);
+        return running_;
+    }
+
+    // Same as Start(), but the thread takes none of the process' signals,
+    // so that they keep interrupting the calling thread's system calls
+    bool StartMasked(Job *job)
+    {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        bool started = Start(job);
+        pthread_sigmask(SIG_SETMASK, &old, 0);
+        return started;
+    }
+
+    void Join()
+    {
+        if (running_)
+            pthread_join(thread_, 0);
+        running_ = false;
+    }
+
+    bool IsRunning() const { return running_; }
+
+private:
+    static void* Main(void *arg)
+    {
+        static_cast<Job*>(arg)->Run();
+        return 0;
+    }
+
+    pthread_t thread_;
+    bool running_;
+};
+
+/**
+ * Runs jobs[i].Run() for each job, on a thread per job, and waits for all
+ * of them. The first job runs on the calling thread. If a thread can't be
+ * created, its job is run on the calling thread too. The other threads
+ * take no signals (see Thread::StartMasked()).
+ */
+template <typename Job>
+void
+RunAll(std::vector<Job>& jobs)
+{
+    std::vector<Thread<Job> > threads(jobs.size());
+    for (size_t i = 1; i < jobs.size(); i++) {
+        if (!threads[i].StartMasked(&jobs[i]))
+            jobs[i].Run();
+    }
+    if (!jobs.empty())
+        jobs[0].Run();
+    for (size_t i = 1; i < jobs.size(); i++)
+        threads[i].Join();
+}
+
+// The number of CPUs online (at least 1)
+inline unsigned
+OnlineCpus()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0)? n: 1;
+}
+
+}; // namespace lhack
+
+#endif // THREADS_H
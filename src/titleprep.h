@@ -0,0 +1,147 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef TITLEPREP_H
+#define TITLEPREP_H
+
+#include <cstring>
+
+#include <stdint.h>
+
+#include "framegrabber.h"
+
+namespace lhack {
+
+// The 8bpp level from which a pixel counts as ink. The e-ink frame buffers
+// have the ink in the high levels (the underline is all ones, see
+// kUlineColor), and this is the middle of the 16 gray levels.
+const unsigned char kInkLevel = 0x80;
+
+// The white margin around a prepared title; Tesseract reads the glyphs
+// touching the edges of an image poorly
+const int kTitlePadding = 4;
+
+// The ink of a column of a title: bit y is set if the pixel in row y is
+// ink. The titles of all the known devices are at most 32 rows high.
+typedef uint32_t inkcol_t;
+const int kMaxTitleHeight = 32;
+
+// Puts the ink of the columns of 'title' (an 8bpp image at most
+// kMaxTitleHeight high) in 'out_columns'
+inline void
+InkColumns(const BitmapView& title, inkcol_t *out_columns)
+{
+    int width = title.width();
+    memset(out_columns, 0, width * sizeof(inkcol_t));
+    for (int y = 0; y < title.height(); y++) {
+        const unsigned char *row = reinterpret_cast<const unsigned char*>(title.row(y));
+        for (int x = 0; x < width; x++)
+            out_columns[x] |= inkcol_t(row[x] >= kInkLevel) << y;
+    }
+}
+
+/**
+ * Finds the columns [left, right) of the title itself: from the first
+ * column with ink to the first run of more than DIM::kMaxBBGap columns
+ * without, i.e. the metadata (the author etc.) following the title is
+ * left out. Returns false if there is no ink at all.
+ */
+template <typename DIM>
+bool
+FindTitleColumns(const inkcol_t *columns, int width, int *left, int *right)
+{
+    int x = 0;
+    while (x < width && !columns[x])
+        x++;
+    if (x == width)
+        return false;
+
+    *left = x;
+    *right = x + 1;
+    for (int gap = 0; x < width && gap <= DIM::kMaxBBGap; x++) {
+        if (columns[x]) {
+            *right = x + 1;
+            gap = 0;
+        }
+        else {
+            gap++;
+        }
+    }
+    return true;
+}
+
+/**
+ * Makes the image of a grabbed title which the OCR is given: the title's
+ * columns (see FindTitleColumns()), cropped to the bounding box of their
+ * ink and binarized at kInkLevel, to black glyphs on white with a margin
+ * of kTitlePadding.
+ *
+ * 'out' is reused (see Bitmap::Reset()), so that a title is prepared
+ * without an allocation once 'out' has been large enough. Returns false,
+ * leaving 'out' invalid, if there is no ink at all.
+ */
+template <typename DIM>
+bool
+PrepareTitle(const BitmapView& title, Bitmap& out)
+{
+    // the title region is its font's height and the gap to the underline
+    typedef char height_check_t[(DIM::kFontHeight + DIM::kUlineMinOffset
+                                 <= kMaxTitleHeight)? 1: -1];
+    (void) sizeof(height_check_t);
+
+    int width = title.width();
+    inkcol_t columns[DIM::kEntryLen];
+    int left, right;
+    if (!title.IsValid() || title.bpp() != 8 || width > DIM::kEntryLen
+            || title.height() > kMaxTitleHeight) {
+        out.SetInvalid();
+        return false;
+    }
+    InkColumns(title, columns);
+    if (!FindTitleColumns<DIM>(columns, width, &left, &right)) {
+        out.SetInvalid();
+        return false;
+    }
+
+    // ... and its rows [top, bottom)
+    inkcol_t rows = 0;
+    for (int x = left; x < right; x++)
+        rows |= columns[x];
+    int top = 0, bottom = kMaxTitleHeight;
+    while (!(rows & (inkcol_t(1) << top)))
+        top++;
+    while (!(rows & (inkcol_t(1) << (bottom - 1))))
+        bottom--;
+
+    int out_width = right - left + 2 * kTitlePadding;
+    int out_height = bottom - top + 2 * kTitlePadding;
+    out.Reset(out_width, out_height, 8);
+    char *dst = out.buffer();
+    memset(dst, 0xff, out_width * out_height);
+    dst += kTitlePadding * out_width + kTitlePadding;
+    for (int y = top; y < bottom; y++) {
+        const unsigned char *src = reinterpret_cast<const unsigned char*>(title.row(y)) + left;
+        for (int x = 0; x < right - left; x++)
+            dst[x] = (src[x] >= kInkLevel)? 0: 0xff;
+        dst += out_width;
+    }
+
+    return true;
+}
+
+};
+
+#endif // TITLEPREP_H
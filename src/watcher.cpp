@@ -0,0 +1,246 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "watcher.h"
+
+namespace lhack {
+
+using namespace std;
+
+namespace {
+
+const uint32_t kWatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                          | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+inline string
+JoinPath(const string& dir, const char *name)
+{
+    string path(dir);
+    if (path.empty() || path[path.size() - 1] != '/')
+        path.push_back('/');
+    path.append(name);
+    return path;
+}
+
+inline bool
+IsUnder(const string& path, const string& dir)
+{
+    return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0
+        && (path[dir.size()] == '/' || dir[dir.size() - 1] == '/');
+}
+
+} // anonymous namespace
+
+TreeWatcher::TreeWatcher(): fd_(-1), root_wd_(-1)
+{
+}
+
+TreeWatcher::~TreeWatcher()
+{
+    Close();
+}
+
+void
+TreeWatcher::Close()
+{
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+    root_wd_ = -1;
+    dirs_.clear();
+}
+
+bool
+TreeWatcher::Open(const string& root)
+{
+    Close();
+
+    // inotify_init1() is too new for the device's kernel
+    fd_ = inotify_init();
+    if (fd_ < 0)
+        return false;
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    fcntl(fd_, F_SETFD, FD_CLOEXEC);
+
+    if (!AddTree(root, 0)) {
+        Close();
+        return false;
+    }
+    for (map<int, string>::iterator it = dirs_.begin(); it != dirs_.end(); it++) {
+        if (it->second == root)
+            root_wd_ = it->first;
+    }
+    // only the subdirectories may vanish before they are watched
+    if (root_wd_ < 0) {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+// Watches 'dir' and its subdirectories. If 'out_events' is given, the
+// files found there are reported as added.
+bool
+TreeWatcher::AddTree(const string& dir, vector<FsEvent> *out_events)
+{
+    int wd = inotify_add_watch(fd_, dir.c_str(), kWatchMask);
+    if (wd < 0)
+        return errno != ENOSPC; // the directory may be gone already
+    dirs_[wd] = dir;
+
+    // the watch is set before the listing, so nothing created meanwhile
+    // is missed (but some files may be reported twice)
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return true;
+
+    struct dirent *ent;
+    struct stat st;
+    bool ok = true;
+    while (ok && (ent = readdir(d))) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            continue;
+
+        string path = JoinPath(dir, name);
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            if (lstat(path.c_str(), &st) < 0)
+                continue;
+            type = S_ISDIR(st.st_mode)? DT_DIR: DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            ok = AddTree(path, out_events);
+        }
+        else if ((type == DT_REG || type == DT_LNK) && out_events) {
+            FsEvent ev;
+            ev.kind = FsEvent::kFileAdded;
+            ev.path = path;
+            out_events->push_back(ev);
+        }
+    }
+
+    closedir(d);
+    return ok;
+}
+
+// Stops watching 'dir' and its subdirectories (after they were moved
+// away, the watches would report changes under the old paths)
+void
+TreeWatcher::RemoveTree(const string& dir)
+{
+    map<int, string>::iterator it = dirs_.begin();
+    while (it != dirs_.end()) {
+        if (it->second == dir || IsUnder(it->second, dir)) {
+            inotify_rm_watch(fd_, it->first);
+            dirs_.erase(it++);
+        }
+        else {
+            ++ it;
+        }
+    }
+}
+
+bool
+TreeWatcher::Poll(vector<FsEvent>& out_events)
+{
+    if (fd_ < 0)
+        return false;
+
+    // the buffer must be aligned for inotify_event
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+
+    for (;;) {
+        ssize_t len = read(fd_, u.buf, sizeof(u.buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+
+        for (ssize_t pos = 0; pos < len; ) {
+            const struct inotify_event *ev =
+                reinterpret_cast<const struct inotify_event*>(u.buf + pos);
+            pos += sizeof(struct inotify_event) + ev->len;
+
+            if ((ev->mask & (IN_Q_OVERFLOW | IN_UNMOUNT))
+                    || (ev->wd == root_wd_ && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)))) {
+                Close();
+                return false;
+            }
+
+            map<int, string>::iterator dir = dirs_.find(ev->wd);
+            if (dir == dirs_.end())
+                continue;
+            if (ev->mask & IN_IGNORED) {
+                dirs_.erase(dir);
+                continue;
+            }
+            if (!ev->len)
+                continue; // an event on the directory itself
+
+            FsEvent out;
+            out.path = JoinPath(dir->second, ev->name);
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    if (!AddTree(out.path, &out_events)) {
+                        Close();
+                        return false;
+                    }
+                }
+                else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    RemoveTree(out.path);
+                    out.kind = FsEvent::kDirRemoved;
+                    out_events.push_back(out);
+                }
+            }
+            else {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    out.kind = FsEvent::kFileAdded;
+                    out_events.push_back(out);
+                }
+                else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    out.kind = FsEvent::kFileRemoved;
+                    out_events.push_back(out);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+void
+TreeWatcher::Dirs(vector<string>& out_dirs) const
+{
+    for (map<int, string>::const_iterator it = dirs_.begin(); it != dirs_.end(); it++)
+        out_dirs.push_back(it->second);
+}
+
+}; // namespace lhack
@@ -0,0 +1,85 @@
+/*
+*   Copyright 2011 Vassil Panayotov <vd.panayotov@gmail.com>
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <map>
+#include <vector>
+#include <string>
+
+namespace lhack {
+
+using namespace std;
+
+// A change under a watched tree
+struct FsEvent {
+    enum Kind {
+        kFileAdded,     // created or moved in (also for the files of a new directory)
+        kFileRemoved,   // deleted or moved out
+        kDirRemoved     // deleted or moved out, along with everything under it
+    };
+
+    Kind kind;
+    string path;
+};
+
+/**
+ * Watches a directory tree with inotify. New subdirectories are watched
+ * as they appear, and the files already in them are reported as added.
+ */
+class TreeWatcher
+{
+public:
+    TreeWatcher();
+    ~TreeWatcher();
+
+    // Starts watching 'root' and everything under it. Returns false if
+    // inotify isn't available, the watch limit is reached or the root
+    // itself can't be watched (e.g. while /mnt/us is exported over USB).
+    bool Open(const string& root);
+
+    void Close();
+
+    bool IsOpen() const { return fd_ >= 0; }
+
+    // The inotify descriptor, readable when there are pending events
+    int fd() const { return fd_; }
+
+    // Appends the pending changes to 'out_events', without blocking.
+    // Returns false if changes were lost (the event queue overflowed, the
+    // file system was unmounted or the root went away). The watcher is
+    // closed then, and the tree has to be crawled again.
+    bool Poll(vector<FsEvent>& out_events);
+
+    // The directories being watched
+    void Dirs(vector<string>& out_dirs) const;
+
+private:
+    TreeWatcher(const TreeWatcher&);
+    TreeWatcher& operator=(const TreeWatcher&);
+
+    bool AddTree(const string& dir, vector<FsEvent> *out_events);
+    void RemoveTree(const string& dir);
+
+    int fd_;
+    int root_wd_;
+    map<int, string> dirs_;     // watch descriptor -> directory
+};
+
+};
+
+#endif // WATCHER_H